@@ -1,15 +1,26 @@
 #version 330
 
-layout(location = 0) in vec3 pos;		// Model-space position
+layout(location = 0) in vec3 pos;		// Stored position (see posScale)
 layout(location = 1) in vec3 norm;		// Model-space normal
 
 smooth out vec3 fragNorm;	// Model-space interpolated normal
 
-uniform mat4 xform;			// Model-to-clip space transform
+layout(std140) uniform Frame {
+	mat4 viewProj;			// World-to-clip space transform
+};
+uniform samplerBuffer objects;	// Six texels per object: model matrix columns, posScale, posOffset
+uniform int firstObject;		// Record of this draw's first instance
 
 void main() {
+	// Fetch this instance's record
+	int base = (firstObject + gl_InstanceID) * 6;
+	mat4 model = mat4(texelFetch(objects, base), texelFetch(objects, base + 1),
+		texelFetch(objects, base + 2), texelFetch(objects, base + 3));
+	vec3 posScale = texelFetch(objects, base + 4).xyz;		// Model-space position = posOffset + posScale * pos
+	vec3 posOffset = texelFetch(objects, base + 5).xyz;
+
 	// Transform vertex position
-	gl_Position = xform * vec4(pos, 1.0);
+	gl_Position = viewProj * model * vec4(posOffset + posScale * pos, 1.0);
 
 	// Interpolate normals
 	fragNorm = norm;
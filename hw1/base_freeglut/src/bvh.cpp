@@ -0,0 +1,432 @@
+#define NOMINMAX
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+const uint32_t PARALLEL_ITEMS = 1 << 12;	// Nodes this large build their children in parallel
+const uint32_t BLOCK_ITEMS = 1 << 16;		// Items per block when one node's pass is split up
+const float FLT_INF = std::numeric_limits<float>::infinity();
+
+// Half the surface area of a box
+inline float halfArea(glm::vec3 minBB, glm::vec3 maxBB) {
+	glm::vec3 d = glm::max(maxBB - minBB, glm::vec3(0.0f));
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Entry and exit distances of a ray through a box (entry > exit if it misses)
+inline void slabs(glm::vec3 minBB, glm::vec3 maxBB, glm::vec3 origin, glm::vec3 invDir,
+	float maxT, float& entry, float& exit) {
+	glm::vec3 t0 = (minBB - origin) * invDir, t1 = (maxBB - origin) * invDir;
+	glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+	entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+	exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxT));
+}
+
+// Bounds of some boxes and of their centers
+struct Bounds {
+	glm::vec3 minBB, maxBB;		// Of the boxes
+	glm::vec3 minC, maxC;		// Of the centers
+	Bounds() : minBB(FLT_INF), maxBB(-FLT_INF), minC(FLT_INF), maxC(-FLT_INF) {}
+	void add(const Bounds& b) {
+		minBB = glm::min(minBB, b.minBB); maxBB = glm::max(maxBB, b.maxBB);
+		minC = glm::min(minC, b.minC); maxC = glm::max(maxC, b.maxC);
+	}
+};
+
+// Boxes falling into each bin along the split axis
+struct Bins {
+	uint32_t count[Bvh::SAH_BINS];
+	glm::vec3 minBB[Bvh::SAH_BINS];
+	glm::vec3 maxBB[Bvh::SAH_BINS];
+	Bins() {
+		for (unsigned int b = 0; b < Bvh::SAH_BINS; b++) {
+			count[b] = 0;
+			minBB[b] = glm::vec3(FLT_INF);
+			maxBB[b] = glm::vec3(-FLT_INF);
+		}
+	}
+	void add(const Bins& o) {
+		for (unsigned int b = 0; b < Bvh::SAH_BINS; b++) {
+			count[b] += o.count[b];
+			minBB[b] = glm::min(minBB[b], o.minBB[b]);
+			maxBB[b] = glm::max(maxBB[b], o.maxBB[b]);
+		}
+	}
+};
+
+// Run fn(blockBegin, blockEnd, result) over [begin, end) in blocks of
+// BLOCK_ITEMS, each with its own result, and return the combined result
+template <typename Result, typename Fn>
+Result reduceBlocks(uint32_t begin, uint32_t end, Fn fn) {
+	size_t blocks = (end - begin + BLOCK_ITEMS - 1) / BLOCK_ITEMS;
+	Result result;
+	if (blocks <= 1) {
+		fn(begin, end, result);
+		return result;
+	}
+	std::vector<Result> partial(blocks);
+	ThreadPool::global().run(blocks, [&](size_t b) {
+		fn(begin + (uint32_t)(b * BLOCK_ITEMS), std::min(end, begin + (uint32_t)((b + 1) * BLOCK_ITEMS)), partial[b]);
+	});
+	for (auto& p : partial)
+		result.add(p);
+	return result;
+}
+
+// A box being sorted into the tree; partitioning these directly rather
+// than indices keeps the passes over a node sequential in memory
+struct BuildItem {
+	glm::vec3 minBB;
+	uint32_t item;		// Box index
+	glm::vec3 maxBB;
+	glm::vec3 center() const { return (minBB + maxBB) * 0.5f; }
+};
+
+}
+
+struct Bvh::BuildState {
+	std::vector<BuildItem> refs;		// Boxes in leaf order once built
+	std::atomic<uint32_t> nextNode;		// Next free node
+};
+
+// Build the hierarchy
+void Bvh::build(const BoxSet& boxes) {
+	clear();
+	size_t count = boxes.size();
+	if (count == 0)
+		return;
+
+	BuildState state;
+	state.refs.resize(count);
+	parallelFor(0, count, 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			glm::vec3 c(boxes.cx[i], boxes.cy[i], boxes.cz[i]), e(boxes.ex[i], boxes.ey[i], boxes.ez[i]);
+			state.refs[i].minBB = c - e;
+			state.refs[i].maxBB = c + e;
+			state.refs[i].item = (uint32_t)i;
+		}
+	});
+
+	// A binary tree with one item per leaf has 2n - 1 nodes at most
+	nodes.resize(2 * count - 1);
+	state.nextNode = 1;
+	buildNode(state, 0, 0, (uint32_t)count);
+	nodes.resize(state.nextNode);
+
+	// Leaf boxes are padded so a leaf can always be tested four at a time
+	items.resize(count);
+	leafBoxes.resize(count + 3);
+	parallelFor(0, count, 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			items[i] = state.refs[i].item;
+			setLeafBox(i, state.refs[i].minBB, state.refs[i].maxBB);
+		}
+	});
+	for (size_t i = count; i < count + 3; i++)
+		setLeafBox(i, glm::vec3(0.0f), glm::vec3(0.0f));
+}
+
+// Build the subtree for items [begin, end) into a node
+void Bvh::buildNode(BuildState& state, uint32_t node, uint32_t begin, uint32_t end) {
+	// Bounds of the boxes and their centers
+	Bounds bounds = reduceBlocks<Bounds>(begin, end, [&](uint32_t b, uint32_t e, Bounds& bounds) {
+		for (uint32_t i = b; i < e; i++) {
+			const BuildItem& ref = state.refs[i];
+			bounds.minBB = glm::min(bounds.minBB, ref.minBB);
+			bounds.maxBB = glm::max(bounds.maxBB, ref.maxBB);
+			bounds.minC = glm::min(bounds.minC, ref.center());
+			bounds.maxC = glm::max(bounds.maxC, ref.center());
+		}
+	});
+	nodes[node].minBB = bounds.minBB;
+	nodes[node].maxBB = bounds.maxBB;
+
+	uint32_t count = end - begin;
+	if (count <= MAX_LEAF_ITEMS) {
+		nodes[node].first = begin;
+		nodes[node].count = count;
+		return;
+	}
+
+	// Sort the centers into bins along the axis where they spread the most
+	glm::vec3 extent = bounds.maxC - bounds.minC;
+	int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+	float minC = bounds.minC[axis];
+	float scale = extent[axis] > 0.0f ? SAH_BINS * 0.9999f / extent[axis] : 0.0f;
+	Bins bins = reduceBlocks<Bins>(begin, end, [&](uint32_t b, uint32_t e, Bins& bins) {
+		for (uint32_t i = b; i < e; i++) {
+			const BuildItem& ref = state.refs[i];
+			unsigned int bin = (unsigned int)((ref.center()[axis] - minC) * scale);
+			bins.count[bin]++;
+			bins.minBB[bin] = glm::min(bins.minBB[bin], ref.minBB);
+			bins.maxBB[bin] = glm::max(bins.maxBB[bin], ref.maxBB);
+		}
+	});
+
+	// Pick the split with the lowest cost: each side's surface area times
+	// its number of items
+	int bestSplit = -1;
+	float bestCost = FLT_INF;
+	float rightCost[SAH_BINS];
+	glm::vec3 minBB(FLT_INF), maxBB(-FLT_INF);
+	uint32_t n = 0;
+	for (unsigned int b = SAH_BINS - 1; b > 0; b--) {
+		minBB = glm::min(minBB, bins.minBB[b]);
+		maxBB = glm::max(maxBB, bins.maxBB[b]);
+		n += bins.count[b];
+		rightCost[b] = n > 0 ? halfArea(minBB, maxBB) * n : 0.0f;
+	}
+	minBB = glm::vec3(FLT_INF);
+	maxBB = glm::vec3(-FLT_INF);
+	n = 0;
+	for (unsigned int b = 0; b + 1 < SAH_BINS; b++) {
+		minBB = glm::min(minBB, bins.minBB[b]);
+		maxBB = glm::max(maxBB, bins.maxBB[b]);
+		n += bins.count[b];
+		if (n == 0 || n == count)
+			continue;
+		float cost = halfArea(minBB, maxBB) * n + rightCost[b + 1];
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = (int)b;
+		}
+	}
+
+	// Split at the best bin boundary, or in the middle if all centers coincide
+	uint32_t mid = begin + count / 2;
+	if (bestSplit >= 0)
+		mid = (uint32_t)(std::partition(state.refs.begin() + begin, state.refs.begin() + end,
+			[&](const BuildItem& ref) {
+				return (int)((ref.center()[axis] - minC) * scale) <= bestSplit;
+			}) - state.refs.begin());
+
+	uint32_t left = state.nextNode.fetch_add(2);
+	nodes[node].first = left;
+	nodes[node].count = 0;
+	if (count >= PARALLEL_ITEMS)
+		ThreadPool::global().run(2, [&](size_t k) {
+			if (k == 0) buildNode(state, left, begin, mid);
+			else buildNode(state, left + 1, mid, end);
+		});
+	else {
+		buildNode(state, left, begin, mid);
+		buildNode(state, left + 1, mid, end);
+	}
+}
+
+// Update the bounds after boxes have moved
+void Bvh::refit(const BoxSet& boxes) {
+	parallelFor(0, items.size(), 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			uint32_t item = items[i];
+			leafBoxes.cx[i] = boxes.cx[item]; leafBoxes.cy[i] = boxes.cy[item]; leafBoxes.cz[i] = boxes.cz[item];
+			leafBoxes.ex[i] = boxes.ex[item]; leafBoxes.ey[i] = boxes.ey[item]; leafBoxes.ez[i] = boxes.ez[item];
+		}
+	});
+
+	// Children always come after their parent
+	for (size_t n = nodes.size(); n-- > 0;) {
+		Node& node = nodes[n];
+		if (node.count > 0) {
+			node.minBB = glm::vec3(FLT_INF);
+			node.maxBB = glm::vec3(-FLT_INF);
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				node.minBB = glm::min(node.minBB, leafMin(i));
+				node.maxBB = glm::max(node.maxBB, leafMax(i));
+			}
+		} else {
+			node.minBB = glm::min(nodes[node.first].minBB, nodes[node.first + 1].minBB);
+			node.maxBB = glm::max(nodes[node.first].maxBB, nodes[node.first + 1].maxBB);
+		}
+	}
+}
+
+// Remove all boxes
+void Bvh::clear() {
+	nodes.clear();
+	items.clear();
+	leafBoxes.resize(0);
+}
+
+// Store the bounds of a leaf slot
+void Bvh::setLeafBox(size_t i, glm::vec3 minBB, glm::vec3 maxBB) {
+	glm::vec3 c = (minBB + maxBB) * 0.5f, e = (maxBB - minBB) * 0.5f;
+	leafBoxes.cx[i] = c.x; leafBoxes.cy[i] = c.y; leafBoxes.cz[i] = c.z;
+	leafBoxes.ex[i] = e.x; leafBoxes.ey[i] = e.y; leafBoxes.ez[i] = e.z;
+}
+
+// Corners of a leaf slot's box
+glm::vec3 Bvh::leafMin(size_t i) const {
+	return glm::vec3(leafBoxes.cx[i] - leafBoxes.ex[i], leafBoxes.cy[i] - leafBoxes.ey[i],
+		leafBoxes.cz[i] - leafBoxes.ez[i]);
+}
+glm::vec3 Bvh::leafMax(size_t i) const {
+	return glm::vec3(leafBoxes.cx[i] + leafBoxes.ex[i], leafBoxes.cy[i] + leafBoxes.ey[i],
+		leafBoxes.cz[i] + leafBoxes.ez[i]);
+}
+
+// Items below a node: from its leftmost leaf to its rightmost one
+void Bvh::itemRange(uint32_t node, uint32_t& begin, uint32_t& end) const {
+	uint32_t n = node;
+	while (nodes[n].count == 0)
+		n = nodes[n].first;
+	begin = nodes[n].first;
+	n = node;
+	while (nodes[n].count == 0)
+		n = nodes[n].first + 1;
+	end = nodes[n].first + nodes[n].count;
+}
+
+// Find the boxes that may intersect a frustum
+void Bvh::queryFrustum(const Frustum& frustum, std::vector<uint32_t>& result) const {
+	if (nodes.empty())
+		return;
+
+	// Planes a node is entirely inside of need no testing below it
+	PackedFrustum packed(frustum);
+	const unsigned int ALL_PLANES = (1 << 6) - 1;
+	struct Entry { uint32_t node; unsigned int planes; };
+	std::vector<Entry> stack;
+	stack.push_back({ 0, ALL_PLANES });
+	while (!stack.empty()) {
+		Entry entry = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[entry.node];
+
+		unsigned int planes = entry.planes;
+		glm::vec3 c = (node.minBB + node.maxBB) * 0.5f, e = (node.maxBB - node.minBB) * 0.5f;
+		bool outside = false;
+		for (int k = 0; k < 6 && !outside; k++) {
+			if (!(planes & (1 << k)))
+				continue;
+			const glm::vec4& p = frustum.planes[k];
+			float distance = glm::dot(glm::vec3(p), c) + p.w;
+			float radius = glm::dot(glm::abs(glm::vec3(p)), e);
+			if (distance + radius < 0.0f)
+				outside = true;
+			else if (distance - radius >= 0.0f)
+				planes &= ~(1u << k);
+		}
+		if (outside)
+			continue;
+
+		if (planes == 0) {
+			// Entirely inside: take everything below without further tests
+			uint32_t begin, end;
+			itemRange(entry.node, begin, end);
+			for (uint32_t i = begin; i < end; i++)
+				result.push_back(items[i]);
+		} else if (node.count > 0) {
+			// Leaves are small enough to test in one go with the culling kernel
+			unsigned int mask = cullBoxes4(packed, leafBoxes, node.first) & ((1u << node.count) - 1);
+			for (uint32_t k = 0; k < node.count; k++)
+				if (mask & (1u << k))
+					result.push_back(items[node.first + k]);
+		} else {
+			stack.push_back({ node.first + 1, planes });
+			stack.push_back({ node.first, planes });
+		}
+	}
+}
+
+// Find the boxes that overlap a box
+void Bvh::queryBox(glm::vec3 minBB, glm::vec3 maxBB, std::vector<uint32_t>& result) const {
+	if (nodes.empty())
+		return;
+	auto overlaps = [&](glm::vec3 bmin, glm::vec3 bmax) {
+		return glm::all(glm::lessThanEqual(bmin, maxBB)) && glm::all(glm::lessThanEqual(minBB, bmax));
+	};
+	std::vector<uint32_t> stack(1, 0);
+	while (!stack.empty()) {
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+		if (!overlaps(node.minBB, node.maxBB))
+			continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++)
+				if (overlaps(leafMin(i), leafMax(i)))
+					result.push_back(items[i]);
+		} else {
+			stack.push_back(node.first + 1);
+			stack.push_back(node.first);
+		}
+	}
+}
+
+// Find the boxes hit by a ray
+void Bvh::queryRay(glm::vec3 origin, glm::vec3 dir, float maxT, std::vector<RayHit>& result) const {
+	if (nodes.empty())
+		return;
+	glm::vec3 invDir = 1.0f / dir;
+	std::vector<uint32_t> stack(1, 0);
+	while (!stack.empty()) {
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+		float entry, exit;
+		slabs(node.minBB, node.maxBB, origin, invDir, maxT, entry, exit);
+		if (entry > exit)
+			continue;
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				slabs(leafMin(i), leafMax(i), origin, invDir, maxT, entry, exit);
+				if (entry <= exit)
+					result.push_back({ items[i], entry });
+			}
+		} else {
+			stack.push_back(node.first + 1);
+			stack.push_back(node.first);
+		}
+	}
+}
+
+// Find the nearest box hit by a ray, visiting nearer children first
+bool Bvh::raycast(glm::vec3 origin, glm::vec3 dir, float maxT, RayHit& hit) const {
+	if (nodes.empty())
+		return false;
+	glm::vec3 invDir = 1.0f / dir;
+	hit.t = maxT;
+	bool found = false;
+	struct Entry { uint32_t node; float t; };
+	std::vector<Entry> stack;
+	float entry, exit;
+	slabs(nodes[0].minBB, nodes[0].maxBB, origin, invDir, maxT, entry, exit);
+	if (entry <= exit)
+		stack.push_back({ 0, entry });
+	while (!stack.empty()) {
+		Entry e = stack.back();
+		stack.pop_back();
+		if (e.t > hit.t)
+			continue;
+		const Node& node = nodes[e.node];
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				slabs(leafMin(i), leafMax(i), origin, invDir, hit.t, entry, exit);
+				if (entry <= exit) {
+					hit.item = items[i];
+					hit.t = entry;
+					found = true;
+				}
+			}
+			continue;
+		}
+		float t[2];
+		bool hits[2];
+		for (int k = 0; k < 2; k++) {
+			const Node& child = nodes[node.first + k];
+			slabs(child.minBB, child.maxBB, origin, invDir, hit.t, t[k], exit);
+			hits[k] = t[k] <= exit;
+		}
+		// Push the far child first so the near one is visited first
+		int nearChild = (hits[1] && (!hits[0] || t[1] < t[0])) ? 1 : 0;
+		if (hits[1 - nearChild])
+			stack.push_back({ node.first + 1 - nearChild, t[1 - nearChild] });
+		if (hits[nearChild])
+			stack.push_back({ node.first + nearChild, t[nearChild] });
+	}
+	return found;
+}
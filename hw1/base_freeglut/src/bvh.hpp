@@ -0,0 +1,68 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "culling.hpp"
+
+// A ray hitting a box
+struct RayHit {
+	uint32_t item;	// Index of the box
+	float t;		// Distance along the ray where it enters the box
+};
+
+// Bounding volume hierarchy over a set of boxes (e.g. Scene::getWorldBounds),
+// so that frustum, box and ray queries only visit the parts of the set they
+// can touch. Built top-down with a binned surface area heuristic, with large
+// subtrees built in parallel. When boxes move, refit() updates the bounds
+// without changing the tree; rebuild if they have moved far.
+class Bvh {
+public:
+	Bvh() {}
+	// Disallow copy, move, & assignment
+	Bvh(const Bvh& other) = delete;
+	Bvh& operator=(const Bvh& other) = delete;
+	Bvh(Bvh&& other) = delete;
+	Bvh& operator=(Bvh&& other) = delete;
+
+	static const unsigned int SAH_BINS = 16;		// Split candidates per axis
+	static const unsigned int MAX_LEAF_ITEMS = 4;	// Larger nodes are always split
+
+	void build(const BoxSet& boxes);
+	// Update the bounds after boxes have moved (same count as the last build)
+	void refit(const BoxSet& boxes);
+	void clear();
+
+	size_t size() const { return items.size(); }		// Number of boxes
+	size_t nodeCount() const { return nodes.size(); }
+
+	// Append the boxes that may intersect a frustum
+	void queryFrustum(const Frustum& frustum, std::vector<uint32_t>& result) const;
+	// Append the boxes that overlap a box
+	void queryBox(glm::vec3 minBB, glm::vec3 maxBB, std::vector<uint32_t>& result) const;
+	// Append the boxes hit by a ray within maxT (in no particular order)
+	void queryRay(glm::vec3 origin, glm::vec3 dir, float maxT, std::vector<RayHit>& result) const;
+	// Nearest box hit by a ray within maxT; returns false if there is none
+	bool raycast(glm::vec3 origin, glm::vec3 dir, float maxT, RayHit& hit) const;
+
+protected:
+	struct Node {
+		glm::vec3 minBB;
+		uint32_t first;		// Left child (right is first + 1), or first item of a leaf
+		glm::vec3 maxBB;
+		uint32_t count;		// Items in a leaf, 0 for inner nodes
+	};
+	struct BuildState;
+	void buildNode(BuildState& state, uint32_t node, uint32_t begin, uint32_t end);
+	void itemRange(uint32_t node, uint32_t& begin, uint32_t& end) const;	// Items below a node
+	void setLeafBox(size_t i, glm::vec3 minBB, glm::vec3 maxBB);
+	glm::vec3 leafMin(size_t i) const;
+	glm::vec3 leafMax(size_t i) const;
+
+	std::vector<Node> nodes;		// Root first; children are allocated in pairs
+	std::vector<uint32_t> items;	// Box index of each leaf slot
+	BoxSet leafBoxes;				// Bounds of the boxes in leaf order, plus 3 of padding
+};
+
+#endif
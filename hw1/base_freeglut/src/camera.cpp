@@ -73,6 +73,9 @@ void Camera::updateViewProj() {
 		//this -> view = LookAt(camPos, glm::vec3(camPos.x, -1.0, camPos.z), camDir);
 	}
 
+	// Keep the frustum in sync for culling
+	frustum = Frustum(proj * view);
+
 
 }
 
@@ -6,6 +6,7 @@
 #include <memory>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "culling.hpp"
 
 enum CameraType {
 	GROUND_VIEW,   // front view
@@ -36,6 +37,7 @@ public:
 	inline float getFovy() { return fovy; }
 	inline glm::mat4 getView() { return view; }
 	inline glm::mat4 getProj() { return proj; }
+	inline const Frustum& getFrustum() { return frustum; }	// World-space view volume
 
 protected:
 	// Camera state
@@ -43,6 +45,7 @@ protected:
 	int width, height;		// Width and height of the window
 	float fovy;				// Vertical field of view in degrees
 	glm::mat4 view, proj;   // veiw and projection matrices
+	Frustum frustum;        // planes of proj * view
 
 	GLfloat rotStep = 2.0f;   // rotation step
 	GLfloat moveStep = 0.2f;  // moving step
@@ -0,0 +1,102 @@
+#define NOMINMAX
+#include "culling.hpp"
+#include <cmath>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CULLING_SSE2
+#include <emmintrin.h>
+#endif
+
+// Frustum that contains everything
+Frustum::Frustum() {
+	for (auto& p : planes)
+		p = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+// Extract the planes from the rows of a view-projection matrix
+Frustum::Frustum(const glm::mat4& viewProj) {
+	glm::mat4 m = glm::transpose(viewProj);		// Rows as columns
+	planes[0] = m[3] + m[0];
+	planes[1] = m[3] - m[0];
+	planes[2] = m[3] + m[1];
+	planes[3] = m[3] - m[1];
+	planes[4] = m[3] + m[2];
+	planes[5] = m[3] - m[2];
+	// Unit normals, so that distances can be compared with box extents
+	for (auto& p : planes) {
+		float length = glm::length(glm::vec3(p));
+		if (length > 0.0f)
+			p /= length;
+	}
+}
+
+// Resize all coordinate arrays
+void BoxSet::resize(size_t count) {
+	cx.resize(count); cy.resize(count); cz.resize(count);
+	ex.resize(count); ey.resize(count); ez.resize(count);
+}
+
+// Bounds of a transformed box: the center is transformed, and each extent
+// grows by the absolute values of the matrix (Arvo 1990)
+void BoxSet::set(size_t i, glm::vec3 minBB, glm::vec3 maxBB, const glm::mat4& xform) {
+	glm::vec3 center = glm::vec3(xform * glm::vec4((minBB + maxBB) * 0.5f, 1.0f));
+	glm::vec3 half = (maxBB - minBB) * 0.5f;
+	glm::mat3 a = glm::mat3(xform);
+	for (int c = 0; c < 3; c++)
+		a[c] = glm::abs(a[c]);
+	glm::vec3 extent = a * half;
+	cx[i] = center.x; cy[i] = center.y; cz[i] = center.z;
+	ex[i] = extent.x; ey[i] = extent.y; ez[i] = extent.z;
+}
+
+namespace {
+
+// Whether a box is outside a plane: even its corner furthest along the
+// normal is behind it
+inline bool outside(const glm::vec4& p, const BoxSet& b, size_t i) {
+	float distance = p.x * b.cx[i] + p.y * b.cy[i] + p.z * b.cz[i] + p.w;
+	float radius = std::abs(p.x) * b.ex[i] + std::abs(p.y) * b.ey[i] + std::abs(p.z) * b.ez[i];
+	return distance + radius < 0.0f;
+}
+
+}
+
+// Repeat each plane coefficient four times
+PackedFrustum::PackedFrustum(const Frustum& frustum) {
+	for (int k = 0; k < 6; k++) {
+		const glm::vec4& p = frustum.planes[k];
+		planes[k] = p;
+		for (int lane = 0; lane < 4; lane++) {
+			x[k][lane] = p.x; y[k][lane] = p.y; z[k][lane] = p.z; w[k][lane] = p.w;
+			ax[k][lane] = std::abs(p.x); ay[k][lane] = std::abs(p.y); az[k][lane] = std::abs(p.z);
+		}
+	}
+}
+
+// Test four boxes at once
+unsigned int cullBoxes4(const PackedFrustum& f, const BoxSet& b, size_t first) {
+#ifdef CULLING_SSE2
+	size_t i = first;
+	__m128 cx = _mm_loadu_ps(&b.cx[i]), cy = _mm_loadu_ps(&b.cy[i]), cz = _mm_loadu_ps(&b.cz[i]);
+	__m128 ex = _mm_loadu_ps(&b.ex[i]), ey = _mm_loadu_ps(&b.ey[i]), ez = _mm_loadu_ps(&b.ez[i]);
+	__m128 out = _mm_setzero_ps();
+	for (int k = 0; k < 6; k++) {
+		__m128 distance = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_load_ps(f.x[k]), cx), _mm_mul_ps(_mm_load_ps(f.y[k]), cy)),
+			_mm_add_ps(_mm_mul_ps(_mm_load_ps(f.z[k]), cz), _mm_load_ps(f.w[k])));
+		__m128 radius = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_load_ps(f.ax[k]), ex), _mm_mul_ps(_mm_load_ps(f.ay[k]), ey)),
+			_mm_mul_ps(_mm_load_ps(f.az[k]), ez));
+		out = _mm_or_ps(out, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+	}
+	return ~_mm_movemask_ps(out) & 0xF;
+#else
+	unsigned int mask = 0;
+	for (unsigned int k = 0; k < 4; k++) {
+		bool in = true;
+		for (auto& p : f.planes)
+			in = in && !outside(p, b, first + k);
+		mask |= (unsigned int)in << k;
+	}
+	return mask;
+#endif
+}
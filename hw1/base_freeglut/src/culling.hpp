@@ -0,0 +1,55 @@
+#ifndef CULLING_HPP
+#define CULLING_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// The six planes bounding a view volume. Normals point inwards, so a point
+// p is inside plane i when dot(planes[i], vec4(p, 1)) >= 0.
+struct Frustum {
+	Frustum();		// Everything is inside
+	// Planes of the clip volume of a view-projection matrix (Gribb &
+	// Hartmann); works for perspective and orthographic projections alike
+	explicit Frustum(const glm::mat4& viewProj);
+
+	glm::vec4 planes[6];	// Left, right, bottom, top, near, far
+};
+
+// World-space axis-aligned boxes stored as separate arrays per coordinate,
+// so that the culling kernel can load several boxes at once
+struct BoxSet {
+	std::vector<float> cx, cy, cz;	// Centers
+	std::vector<float> ex, ey, ez;	// Half extents
+
+	size_t size() const { return cx.size(); }
+	void resize(size_t count);
+	// Set a box to the bounds of a model-space box under a transform
+	void set(size_t i, glm::vec3 minBB, glm::vec3 maxBB, const glm::mat4& xform);
+};
+
+// Frustum planes with every coefficient repeated for four lanes, so that
+// four boxes can be tested at once
+struct PackedFrustum {
+	explicit PackedFrustum(const Frustum& frustum);
+
+	alignas(16) float x[6][4], y[6][4], z[6][4], w[6][4];	// Plane equations
+	alignas(16) float ax[6][4], ay[6][4], az[6][4];			// Absolute values of the normals
+	glm::vec4 planes[6];									// Unpacked planes
+};
+
+// Objects drawn and culled in a frame
+struct CullStats {
+	size_t drawn;
+	size_t culled;
+	size_t drawCalls;	// Draw calls issued for the drawn objects
+	CullStats() : drawn(0), culled(0), drawCalls(0) {}
+};
+
+// Test the four boxes starting at first, using SSE2 where available; bit k
+// of the result is set if box first + k may intersect the frustum. The box
+// arrays must have at least first + 4 entries.
+unsigned int cullBoxes4(const PackedFrustum& frustum, const BoxSet& boxes, size_t first);
+
+#endif
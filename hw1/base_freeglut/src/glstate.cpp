@@ -1,5 +1,8 @@
 #define NOMINMAX
 #include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
 #include "glstate.hpp"
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -8,12 +11,19 @@
 // Constructor
 GLState::GLState() :
 	shader(0),
-	xformLoc(0) {}
+	firstObjectLoc(0),
+	frameBuf(0),
+	objectBuf(0),
+	objectTex(0),
+	maxObjects(0) {}
 
 // Destructor
 GLState::~GLState() {
 	// Release OpenGL resources
 	if (shader)	glDeleteProgram(shader);
+	if (frameBuf) glDeleteBuffers(1, &frameBuf);
+	if (objectBuf) glDeleteBuffers(1, &objectBuf);
+	if (objectTex) glDeleteTextures(1, &objectTex);
 }
 
 // Called when OpenGL context is created (some time after construction)
@@ -25,6 +35,24 @@ void GLState::initializeGL() {
 
 	// Initialize OpenGL state
 	initShaders();
+	glGenBuffers(1, &frameBuf);
+	glGenBuffers(1, &objectBuf);
+
+	// Shaders read the object records through a buffer texture (binding the
+	// buffer first creates it, which glTexBuffer requires)
+	glBindBuffer(GL_TEXTURE_BUFFER, objectBuf);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &objectTex);
+	glBindTexture(GL_TEXTURE_BUFFER, objectTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, objectBuf);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	// Buffer textures may be as small as 65536 texels, so scenes with more
+	// objects than that holds are drawn in several uploads
+	GLint maxTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	maxObjects = (size_t)maxTexels / (sizeof(ObjectRecord) / sizeof(glm::vec4));
+	if (maxObjects == 0)
+		throw std::runtime_error("Buffer textures are too small for object records");
 
 	// Create the scene
 	scene = std::unique_ptr<Scene>(new Scene());
@@ -35,23 +63,106 @@ void GLState::paintGL() {
 	// Clear the color and depth buffers
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// Set shader to draw with
-	glUseProgram(shader);
-
 	// Construct a transformation matrix for the camera
-	glm::mat4 xform(1.0f), proj, view;
-
-	auto objects = scene->getSceneObjects();
-	for (auto& meshObj : objects) {
-		glm::mat4 modelMat = meshObj->getModelMat();
-		proj = (whichCam == GROUND_VIEW) ? camGround.getProj() : camOverhead.getProj();
-		view = (whichCam == GROUND_VIEW) ? camGround.getView() : camOverhead.getView();
-		xform = proj * view * modelMat;  // opengl does matrix multiplication from right to left
-		glUniformMatrix4fv(xformLoc, 1, GL_FALSE, glm::value_ptr(xform));
-		// Draw the mesh
-		meshObj->draw();
+	glm::mat4 proj, view;
+
+	Camera& cam = (whichCam == GROUND_VIEW) ? camGround : camOverhead;
+	proj = cam.getProj();
+	view = cam.getView();
+	// Pixels a world unit covers: everywhere for an orthographic projection,
+	// at unit depth for a perspective one
+	bool perspective = (proj[3][3] != 1.0f);
+	float pixelsPerUnit = proj[1][1] * cam.getH() / 2.0f;
+
+	// Skip objects outside the view volume; the hierarchy returns them out of
+	// order, so sort to keep the draw order stable
+	auto& objects = scene->getSceneObjects();
+	auto& modelMats = scene->getModelMats();
+	auto& meshes = scene->getMeshes();
+	auto& meshIndices = scene->getMeshIndices();
+	drawList.clear();
+	scene->getBvh().queryFrustum(cam.getFrustum(), drawList);
+	std::sort(drawList.begin(), drawList.end());
+	cullStats.drawn = drawList.size();
+	cullStats.culled = objects.size() - cullStats.drawn;
+
+	// Group the visible objects by mesh and level of detail
+	drawItems.clear();
+	for (uint32_t i : drawList) {
+		auto& meshObj = objects[i];
+		const glm::mat4& modelMat = modelMats[i];
+		// Draw the coarsest level of detail that looks the same from here,
+		// judging (in perspective) by the distance to the nearest point of
+		// the bounding sphere
+		auto meshBB = meshObj->boundingBox();
+		float diagonal = glm::length(glm::mat3(modelMat) * (meshBB.second - meshBB.first));
+		float diagonalPixels = diagonal * pixelsPerUnit;
+		if (perspective) {
+			glm::vec3 center = glm::vec3(view * modelMat * glm::vec4((meshBB.first + meshBB.second) / 2.0f, 1.0f));
+			diagonalPixels /= glm::max(glm::length(center) - diagonal / 2.0f, 0.1f);
+		}
+		unsigned int lod = selectLod(meshObj->getLods(), diagonalPixels);
+		drawItems.push_back({ meshIndices[i], lod, i });
+	}
+	std::sort(drawItems.begin(), drawItems.end(), [](const DrawItem& a, const DrawItem& b) {
+		return a.mesh != b.mesh ? a.mesh < b.mesh : (a.lod != b.lod ? a.lod < b.lod : a.object < b.object);
+	});
+
+	// Write the record of every visible object in draw order, so that each
+	// group reads consecutive records, one per instance. Groups are split at
+	// multiples of maxObjects, so each lies within one upload.
+	batches.clear();
+	objectData.resize(drawItems.size());
+	for (size_t first = 0, last; first < drawItems.size(); first = last) {
+		const DrawItem& item = drawItems[first];
+		for (last = first + 1; last < drawItems.size(); last++)
+			if (drawItems[last].mesh != item.mesh || drawItems[last].lod != item.lod || last % maxObjects == 0)
+				break;
+		batches.push_back({ item.mesh, item.lod, (uint32_t)first, (uint32_t)(last - first) });
+
+		const PositionTransform& posXform = meshes[item.mesh]->getPositionTransform();
+		for (size_t k = first; k < last; k++) {
+			ObjectRecord& record = objectData[k];
+			record.model = modelMats[drawItems[k].object];
+			record.posScale = glm::vec4(posXform.scale, 0.0f);
+			record.posOffset = glm::vec4(posXform.offset, 0.0f);
+		}
+	}
+	cullStats.drawCalls = batches.size();
+
+	// Upload the frame's data, replacing last frame's rather than waiting for
+	// the GPU to finish with it
+	FrameBlock frame;
+	frame.viewProj = proj * view;  // opengl does matrix multiplication from right to left
+	glBindBuffer(GL_UNIFORM_BUFFER, frameBuf);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(frame), &frame, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, frameBuf);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, objectTex);
+
+	// Each draw only needs to say where its records start. The records go up
+	// maxObjects at a time (all at once unless the scene is huge).
+	glUseProgram(shader);
+	size_t uploaded = SIZE_MAX;		// First record of the current upload
+	for (auto& batch : batches) {
+		size_t begin = batch.first / maxObjects * maxObjects;
+		if (begin != uploaded) {
+			size_t count = std::min(objectData.size() - begin, maxObjects);
+			glBindBuffer(GL_TEXTURE_BUFFER, objectBuf);
+			glBufferData(GL_TEXTURE_BUFFER, count * sizeof(ObjectRecord), &objectData[begin], GL_STREAM_DRAW);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+			uploaded = begin;
+		}
+		glUniform1i(firstObjectLoc, (GLint)(batch.first - uploaded));
+		auto& meshObj = meshes[batch.mesh];
+		if (batch.count > 1)
+			meshObj->drawInstanced(batch.count, batch.lod);
+		else
+			meshObj->draw(batch.lod);
 	}
 
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
 	glUseProgram(0);
 }
 
@@ -65,16 +176,14 @@ void GLState::resizeGL(int w, int h) {
 
 // Create shaders and associated state
 void GLState::initShaders() {
-	// Compile and link shader files
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
-
-	// Get uniform locations
-	xformLoc = glGetUniformLocation(shader, "xform");
+	// Compile and link shader files (or load the program saved by an earlier run)
+	shader = buildProgram({ { GL_VERTEX_SHADER, "shaders/v.glsl" },
+		{ GL_FRAGMENT_SHADER, "shaders/f.glsl" } });
+
+	// Get uniform locations, and attach the frame block and object records
+	firstObjectLoc = glGetUniformLocation(shader, "firstObject");
+	glUniformBlockBinding(shader, glGetUniformBlockIndex(shader, "Frame"), FRAME_BLOCK_BINDING);
+	glUseProgram(shader);
+	glUniform1i(glGetUniformLocation(shader, "objects"), 0);
+	glUseProgram(0);
 }
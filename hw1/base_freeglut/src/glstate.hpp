@@ -32,16 +32,53 @@ public:
 	inline void switchCam() {  // switch between the two cameras
 		whichCam = (whichCam == GROUND_VIEW) ? OVERHEAD_VIEW : GROUND_VIEW;
 	}
+	// Objects drawn and culled in the last frame
+	const CullStats& getCullStats() const { return cullStats; }
 
 protected:
 	// Initialization
 	void initShaders();
 
 	std::unique_ptr<Scene> scene;	// Pointer to the scene object
+	std::vector<uint32_t> drawList;	// Objects that passed culling this frame
+
+	// A visible object and the level of detail it's drawn at
+	struct DrawItem {
+		uint32_t mesh;			// Index into Scene::getMeshes()
+		unsigned int lod;
+		uint32_t object;
+	};
+	// Objects sharing a mesh and level of detail, drawn with one call
+	struct DrawBatch {
+		uint32_t mesh;
+		unsigned int lod;
+		uint32_t first;			// First record in objectData
+		uint32_t count;
+	};
+	std::vector<DrawItem> drawItems;		// Visible objects, grouped
+	std::vector<DrawBatch> batches;			// Draws this frame
+
+	// Constants of the whole frame (the Frame uniform block, std140 layout)
+	struct FrameBlock {
+		glm::mat4 viewProj;		// World-to-clip transform
+	};
+	static const GLuint FRAME_BLOCK_BINDING = 0;
+	// What the shaders read for one object (six RGBA32F texels)
+	struct ObjectRecord {
+		glm::mat4 model;		// Model-to-world transform
+		glm::vec4 posScale;		// Stored-to-model-space position mapping (xyz)
+		glm::vec4 posOffset;
+	};
+	std::vector<ObjectRecord> objectData;	// Record of each visible object, in draw order
+	CullStats cullStats;			// Objects drawn and culled in the last frame
 
 	// OpenGL state
 	GLuint shader;		// GPU shader program
-	GLuint xformLoc;	// Transformation matrix location
+	GLuint firstObjectLoc;	// Location of the index of a draw's first object record
+	GLuint frameBuf;		// Frame block
+	GLuint objectBuf;		// Object records of this frame's draws
+	GLuint objectTex;		// Buffer texture over objectBuf
+	size_t maxObjects;		// Most records the buffer texture can address at once
 
 	// cameras:
 	Camera camGround, camOverhead;
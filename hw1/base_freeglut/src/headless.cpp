@@ -0,0 +1,84 @@
+// Renders the scene without a window, for machines with no display (build
+// and batch hosts; Mesa's llvmpipe stands in for a GPU). Draws it into an
+// offscreen framebuffer and writes the final frame as a PPM image; with more
+// than one frame it also times them.
+//
+// Usage: headless [options]
+//   -o file.ppm     Image to write (default: headless.ppm)
+//   -s WxH          Image size (default: 800x800)
+//   -f frames       Frames to draw and time (default: 1)
+//   -overhead       Look through the overhead camera
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include "offscreen.hpp"
+#include "glstate.hpp"
+
+// Value of an option that takes one
+std::string optionValue(int argc, char** argv, int& i) {
+	if (i + 1 >= argc)
+		throw std::runtime_error(std::string("Missing value for ") + argv[i]);
+	return argv[++i];
+}
+
+int main(int argc, char** argv) {
+	std::string imageFile = "headless.ppm";
+	int width = 800, height = 800;
+	int frames = 1;
+	bool overhead = false;
+
+	try {
+		// Read the options
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "-o")
+				imageFile = optionValue(argc, argv, i);
+			else if (arg == "-s") {
+				std::string size = optionValue(argc, argv, i);
+				if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2)
+					throw std::runtime_error("Image size must look like 800x800, not " + size);
+			} else if (arg == "-f")
+				frames = std::max(1, std::stoi(optionValue(argc, argv, i)));
+			else if (arg == "-overhead")
+				overhead = true;
+			else
+				throw std::runtime_error("Unknown option " + arg);
+		}
+
+		// Create the context first so that it outlives the OpenGL state
+		OffscreenContext context(width, height);
+		std::cout << "Rendering " << width << "x" << height << " with " << context.getRenderer() << std::endl;
+
+		auto glState = std::unique_ptr<GLState>(new GLState());
+		glState->initializeGL();
+		glState->resizeGL(width, height);
+		if (overhead)
+			glState->switchCam();
+
+		// Draw one frame to settle, then draw and time the rest
+		glState->paintGL();
+		glFinish();
+		auto start = std::chrono::steady_clock::now();
+		for (int f = 0; f < frames; f++)
+			glState->paintGL();
+		glFinish();
+		double frameMs = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count() / frames;
+		if (frames > 1)
+			std::cout << "Drew " << frames << " frames in " << frameMs << " ms each" << std::endl;
+
+		context.writeImage(imageFile);
+		std::cout << "Wrote " << imageFile << std::endl;
+		glState.reset();
+
+	} catch (const std::exception& e) {
+		std::cerr << "Fatal error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -116,6 +116,12 @@ void keyPress(unsigned char key, int x, int y) {	// TODO
 		glState->getCamera(glState->getCamType()).moveBackward();
 		glutPostRedisplay();
 		break;
+	case 'c': {  // print culling counters
+		const CullStats& stats = glState->getCullStats();
+		std::cout << "Drew " << stats.drawn << " objects in " << stats.drawCalls
+			<< " draw calls, culled " << stats.culled << std::endl;
+		break;
+	}
 	}
 }
 
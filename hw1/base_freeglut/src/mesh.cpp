@@ -1,100 +1,211 @@
 #define NOMINMAX
 #include "mesh.hpp"
+#include "meshcache.hpp"
+#include <chrono>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include <fstream>
 #include <iostream>
 #include <sstream>
 
-// Helper functions
-int indexOfNumberLetter(std::string& str, int offset);
-int lastIndexOfNumberLetter(std::string& str);
-std::vector<std::string> split(const std::string &s, char delim);
+// Point a vertex attribute at positions stored in a vertex format
+static void positionAttrib(GLuint index, VertexFormat format, GLsizei stride, size_t offset) {
+	glEnableVertexAttribArray(index);
+	if (format == VERTEXFORMAT_QUANTIZED)
+		glVertexAttribPointer(index, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (GLvoid*)offset);
+	else if (format == VERTEXFORMAT_HALF)
+		glVertexAttribPointer(index, 3, GL_HALF_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+	else
+		glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+}
+
+// Point a vertex attribute at normals stored in a vertex format
+static void normalAttrib(GLuint index, VertexFormat format, GLsizei stride, size_t offset) {
+	glEnableVertexAttribArray(index);
+	if (format == VERTEXFORMAT_FLOAT)
+		glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+	else	// Packed types always have 4 components; the shader ignores w
+		glVertexAttribPointer(index, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (GLvoid*)offset);
+}
+
+// Whether the buffers of a cache agree with each other: whole vertices and
+// indices, indices within the vertices and levels of detail within the
+// indices. A stale or damaged cache could otherwise make draws (or unpacking)
+// read past a buffer.
+static bool cacheConsistent(const MeshCache& cache, size_t vertexSize) {
+	if (cache.vertexBytes() % vertexSize != 0)
+		return false;
+	size_t vertexCount = cache.vertexBytes() / vertexSize;
+	size_t indexSize = indexSizeFor(vertexCount);
+	if (cache.indexBytes() % indexSize != 0)
+		return false;
+	size_t indexCount = cache.indexBytes() / indexSize;
+	return indicesFit(cache.indexData(), indexCount, indexSize, vertexCount) &&
+		lodsFit(cache.extraData(), cache.extraBytes(), indexCount);
+}
 
 // Constructor - load mesh from file
-Mesh::Mesh(std::string filename, bool keepLocalGeometry) {
+Mesh::Mesh(std::string filename, bool keepLocalGeometry, unsigned int optimize,
+	VertexFormat format) {
 	minBB = glm::vec3(std::numeric_limits<float>::max());
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
-	modelMat = glm::mat4(1.0f);  // initialize with an identity matrix
-
 	vao = 0;
 	vbuf = 0;
+	ibuf = 0;
 	vcount = 0;
-	load(filename, keepLocalGeometry);
+	icount = 0;
+	itype = GL_UNSIGNED_INT;
+	vertexFormat = format;
+	load(filename, keepLocalGeometry, optimize, format);
+}
+
+// Draw the mesh at a level of detail
+void Mesh::draw(unsigned int lod) const {
+	glBindVertexArray(vao);
+	if (lod < lods.size()) {
+		size_t indexSize = (itype == GL_UNSIGNED_SHORT) ? 2 : 4;
+		glDrawElements(GL_TRIANGLES, (GLsizei)lods[lod].indexCount, itype,
+			(GLvoid*)(lods[lod].indexOffset * indexSize));
+	} else if (icount > 0)
+		glDrawElements(GL_TRIANGLES, icount, itype, NULL);
+	else
+		glDrawArrays(GL_TRIANGLES, 0, vcount);
+	glBindVertexArray(0);
 }
 
-// Draw the mesh
-void Mesh::draw() {
+// Draw copies of the mesh
+void Mesh::drawInstanced(GLsizei instances, unsigned int lod) const {
 	glBindVertexArray(vao);
-	glDrawArrays(GL_TRIANGLES, 0, vcount);
+	if (lod < lods.size()) {
+		size_t indexSize = (itype == GL_UNSIGNED_SHORT) ? 2 : 4;
+		glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)lods[lod].indexCount, itype,
+			(GLvoid*)(lods[lod].indexOffset * indexSize), instances);
+	} else if (icount > 0)
+		glDrawElementsInstanced(GL_TRIANGLES, icount, itype, NULL, instances);
+	else
+		glDrawArraysInstanced(GL_TRIANGLES, 0, vcount, instances);
 	glBindVertexArray(0);
 }
 
-// Load a wavefront OBJ file
-void Mesh::load(std::string filename, bool keepLocalGeometry) {
+// Load a wavefront OBJ file (or its binary cache)
+void Mesh::load(std::string filename, bool keepLocalGeometry, unsigned int optimize,
+	VertexFormat format) {
 	// Release resources
 	release();
+	vertexFormat = format;
 
-	std::ifstream file(filename);
-	if (!file.is_open()) {
-		std::stringstream ss;
-		ss << "Error reading " << filename << ": failed to open file";
-		throw std::runtime_error(ss.str());
+	// Use the binary cache if it's up to date
+	auto start = std::chrono::steady_clock::now();
+	MeshCache cache;
+	bool cached = cache.open(filename, cacheFormat(optimize, format));
+	if (cached && !cacheConsistent(cache, vertexSize(format))) {
+		std::cerr << "Warning: ignoring the cache of " << filename << ": its buffers don't match" << std::endl;
+		cache.close();
+		cached = false;
 	}
-
-	// Store vertex and normal data while reading
-	std::vector<glm::vec3> raw_vertices;
-	std::vector<glm::vec3> raw_normals;
-	std::vector<unsigned int> v_elements;
-	std::vector<unsigned int> n_elements;
-
-	std::string line;
-	while (getline(file, line)) {
-		if (line.substr(0, 2) == "v ") {
-			// Read position data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_vertices.push_back(vert);
-
-			// Update bounding box
-			minBB = glm::min(minBB, vert);
-			maxBB = glm::max(maxBB, vert);
-		} else if (line.substr(0, 3) == "vn ") {
-			// Read normal data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			raw_normals.push_back(glm::vec3(stof(values[0]), stof(values[1]), stof(values[2])));
-
-		} else if (line.substr(0, 2) == "f ") {
-			// Read face data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			for (int i = 0; i < int(values.size()) - 2; i++) {
-				// Split up vertex indices
-				std::vector<std::string> v1 = split(values[0], '/');		// Triangle fan for ngons
-				std::vector<std::string> v2 = split(values[i+1], '/');
-				std::vector<std::string> v3 = split(values[i+2], '/');
-
-				// Store position indices
-				v_elements.push_back(stoul(v1[0]) - 1);
-				v_elements.push_back(stoul(v2[0]) - 1);
-				v_elements.push_back(stoul(v3[0]) - 1);
-
-				// Check for normals
-				if (v1.size() >= 3 && v1[2].length() > 0) {
-					n_elements.push_back(stoul(v1[2]) - 1);
-					n_elements.push_back(stoul(v2[2]) - 1);
-					n_elements.push_back(stoul(v3[2]) - 1);
-				}
-			}
+	if (cached) {
+		minBB = cache.minBB();
+		maxBB = cache.maxBB();
+		posXform = positionTransform(format, minBB, maxBB);
+		const unsigned char* cached = (const unsigned char*)cache.vertexData();
+		size_t count = cache.vertexBytes() / vertexSize(format);
+		size_t indexSize = indexSizeFor(count);
+		size_t indexCount = cache.indexBytes() / indexSize;
+		upload(cached, count, cache.indexData(), indexCount, indexSize);
+		if (keepLocalGeometry) {
+			vertices = unpack(cached, count, format, minBB, maxBB);
+			indices.resize(indexCount);
+			for (size_t i = 0; i < indexCount; i++)
+				indices[i] = (indexSize == 2) ? ((const uint16_t*)cache.indexData())[i]
+					: ((const uint32_t*)cache.indexData())[i];
 		}
+		const MeshLod* cachedLods = (const MeshLod*)cache.extraData();
+		lods.assign(cachedLods, cachedLods + cache.extraBytes() / sizeof(MeshLod));
+
+		loadStats.bytes = cache.vertexBytes() + cache.indexBytes();
+		loadStats.threads = 1;
+		loadStats.seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		std::cout << "Loaded " << filename << " from cache: " << loadStats.bytes / 1024 << " KB in "
+			<< loadStats.seconds * 1000.0 << " ms" << std::endl;
+		return;
+	}
+
+	// Parse the file, compute normals, merge shared vertices and optimize
+	Geometry geom = build(filename, optimize, format, &loadStats);
+	optimizeStats = geom.passes;
+	lods = geom.lods;
+	minBB = geom.minBB;
+	maxBB = geom.maxBB;
+	posXform = positionTransform(format, minBB, maxBB);
+	std::vector<unsigned char> packed = pack(geom.vertices, format, minBB, maxBB, &quantError);
+	size_t indexSize = indexSizeFor(geom.vertices.size());
+	std::vector<uint16_t> shortIndices;
+	const void* elements = geom.indices.data();
+	if (indexSize == sizeof(uint16_t)) {
+		shortIndices = narrowIndices(geom.indices);
+		elements = shortIndices.data();
 	}
-	file.close();
+	size_t indexBytes = geom.indices.size() * indexSize;
+
+	std::cout << "Loaded " << filename << ": " << loadStats.bytes / 1024 << " KB in "
+		<< loadStats.seconds * 1000.0 << " ms (" << loadStats.throughput() << " MB/s, "
+		<< loadStats.threads << " threads); " << geom.vertices.size() << " vertices, "
+		<< (packed.size() + indexBytes) / 1024 << " KB" << (geom.indices.empty() ? " (not indexed)" : "")
+		<< std::endl;
+	if (!geom.passes.empty()) {
+		std::cout << "  ACMR/ATVR";
+		for (auto& p : geom.passes)
+			std::cout << (&p == &geom.passes[0] ? " " : ", ") << p.pass << " "
+				<< p.cache.acmr << "/" << p.cache.atvr;
+		std::cout << std::endl;
+	}
+	if (!lods.empty()) {
+		std::cout << "  LODs";
+		for (auto& l : lods)
+			std::cout << (&l == &lods[0] ? " " : ", ") << l.indexCount / 3
+				<< " tris (error " << l.error << ")";
+		std::cout << std::endl;
+	}
+	if (format != VERTEXFORMAT_FLOAT) {
+		std::cout << "  " << vertexSize(format) << " bytes/vertex (" << sizeof(Vertex)
+			<< " as floats); position error " << quantError.maxPosition << " of bounding box, normal error "
+			<< quantError.maxNormal << " deg max, " << quantError.meanNormal << " deg mean" << std::endl;
+		if (quantError.visible())
+			std::cerr << "Warning: " << filename << " loses visible precision in this vertex format" << std::endl;
+	}
+
+	// Save the result for next time
+	try {
+		MeshCache::write(filename, cacheFormat(optimize, format), minBB, maxBB,
+			packed.data(), packed.size(), elements, indexBytes,
+			lods.data(), lods.size() * sizeof(MeshLod));
+	} catch (const std::exception& e) {
+		std::cerr << "Warning: " << e.what() << std::endl;
+	}
+
+	upload(packed.data(), geom.vertices.size(), elements, geom.indices.size(), indexSize);
+
+	// Keep local copy of geometry if requested
+	if (keepLocalGeometry) {
+		vertices = std::move(geom.vertices);
+		indices = std::move(geom.indices);
+	}
+}
+
+// Build the indexed geometry for an OBJ file
+Mesh::Geometry Mesh::build(const std::string& filename, unsigned int optimize,
+	VertexFormat format, ObjLoadStats* stats) {
+	Geometry geom;
+
+	// Parse the file
+	ObjData obj = parseObj(filename, stats);
+	std::vector<glm::vec3>& raw_vertices = obj.positions;
+	std::vector<glm::vec3>& raw_normals = obj.normals;
+	std::vector<unsigned int>& v_elements = obj.v_elements;
+	std::vector<unsigned int>& n_elements = obj.n_elements;
+	geom.minBB = obj.minBB;
+	geom.maxBB = obj.maxBB;
 
 	// Check if the file was invalid
 	if (raw_vertices.empty() || v_elements.empty()) {
@@ -104,7 +215,7 @@ void Mesh::load(std::string filename, bool keepLocalGeometry) {
 	}
 
 	// Create vertex array
-	vertices = std::vector<Vertex>(v_elements.size());
+	std::vector<Vertex> vertices(v_elements.size());
 	for (int i = 0; i < int(v_elements.size()); i += 3) {
 		// Store positions
 		vertices[i+0].pos = raw_vertices[v_elements[i+0]];
@@ -126,7 +237,160 @@ void Mesh::load(std::string filename, bool keepLocalGeometry) {
 			vertices[i+2].norm = normal;
 		}
 	}
-	vcount = (GLsizei)vertices.size();
+
+	// Merge vertices shared between triangles and reorder them for the GPU
+	indexVertices(vertices, geom.vertices, geom.indices);
+	geom.passes = optimizeMesh(geom.vertices, geom.indices, optimize);
+	if (optimize & MESHOPT_LOD) {
+		buildLods(geom, n_elements.empty());
+		if (geom.lods.size() > 1)
+			return geom;
+		geom.lods.clear();
+		geom.indices.resize(v_elements.size());	// Just the full mesh
+	}
+
+	// Go back to one vertex per corner (in the optimized triangle order) if
+	// indexing saves nothing, e.g. when every triangle has its own face normal
+	size_t indexedBytes = geom.vertices.size() * vertexSize(format) +
+		geom.indices.size() * indexSizeFor(geom.vertices.size());
+	if (indexedBytes >= vertices.size() * vertexSize(format)) {
+		for (size_t i = 0; i < geom.indices.size(); i++)
+			vertices[i] = geom.vertices[geom.indices[i]];
+		geom.vertices = std::move(vertices);
+		geom.indices.clear();
+	}
+	return geom;
+}
+
+// Append simplified levels of detail
+void Mesh::buildLods(Geometry& geom, bool flatNormals) {
+	// Simplify positions only: vertices that differ just in their normal
+	// are welded, or creases would tear apart
+	std::vector<glm::vec3> corners(geom.indices.size());
+	for (size_t i = 0; i < geom.indices.size(); i++)
+		corners[i] = geom.vertices[geom.indices[i]].pos;
+	std::vector<glm::vec3> positions;
+	std::vector<unsigned int> posIndices, sources;
+	indexVertices(corners, positions, posIndices);
+	geom.lods = buildLodChain(positions, posIndices, &sources);
+
+	// Vertices at each welded position
+	std::vector<unsigned int> firstVertex(positions.size() + 1, 0), vertexList(geom.vertices.size());
+	std::vector<unsigned int> vertexPos(geom.vertices.size());
+	for (size_t i = 0; i < geom.indices.size(); i++)
+		vertexPos[geom.indices[i]] = posIndices[i];
+	for (auto p : vertexPos)
+		firstVertex[p + 1]++;
+	for (size_t p = 0; p < positions.size(); p++)
+		firstVertex[p + 1] += firstVertex[p];
+	std::vector<unsigned int> fill(firstVertex.begin(), firstVertex.end() - 1);
+	for (size_t v = 0; v < vertexPos.size(); v++)
+		vertexList[fill[vertexPos[v]]++] = (unsigned int)v;
+
+	// Give the corners of coarser levels vertices. A corner keeps the normal
+	// of the corner it came from, taken from the vertex at its new position
+	// that is closest to it. Meshes without normals in the file get new
+	// vertices with the face normals of the simplified triangles.
+	size_t fullCount = geom.indices.size();
+	std::vector<Vertex> flatCorners;
+	for (size_t i = fullCount; i < posIndices.size(); i += 3) {
+		size_t source = sources[i / 3] * 3;
+		if (flatNormals) {
+			Vertex v[3];
+			for (int c = 0; c < 3; c++)
+				v[c].pos = positions[posIndices[i + c]];
+			glm::vec3 normal = glm::normalize(glm::cross(v[1].pos - v[0].pos, v[2].pos - v[0].pos));
+			for (int c = 0; c < 3; c++) {
+				v[c].norm = normal;
+				flatCorners.push_back(v[c]);
+			}
+			continue;
+		}
+		for (int c = 0; c < 3; c++) {
+			unsigned int p = posIndices[i + c];
+			unsigned int from = geom.indices[source + c];
+			unsigned int best = vertexList[firstVertex[p]];
+			float bestDot = -2.0f;
+			for (unsigned int k = firstVertex[p]; k < firstVertex[p + 1]; k++) {
+				float d = glm::dot(geom.vertices[vertexList[k]].norm, geom.vertices[from].norm);
+				if (d > bestDot) {
+					bestDot = d;
+					best = vertexList[k];
+				}
+			}
+			geom.indices.push_back(best);
+		}
+	}
+	if (flatNormals && !flatCorners.empty()) {
+		std::vector<Vertex> added;
+		std::vector<unsigned int> addedIndices;
+		indexVertices(flatCorners, added, addedIndices);
+		unsigned int base = (unsigned int)geom.vertices.size();
+		geom.vertices.insert(geom.vertices.end(), added.begin(), added.end());
+		for (auto index : addedIndices)
+			geom.indices.push_back(base + index);
+	}
+}
+
+// Build an OBJ file's indexed geometry and write it to the binary cache
+void Mesh::bake(const std::string& filename, unsigned int optimize, VertexFormat format) {
+	Geometry geom = build(filename, optimize, format);
+	std::vector<unsigned char> packed = pack(geom.vertices, format, geom.minBB, geom.maxBB);
+	size_t indexSize = indexSizeFor(geom.vertices.size());
+	std::vector<uint16_t> shortIndices;
+	const void* elements = geom.indices.data();
+	if (indexSize == sizeof(uint16_t)) {
+		shortIndices = narrowIndices(geom.indices);
+		elements = shortIndices.data();
+	}
+	MeshCache::write(filename, cacheFormat(optimize, format), geom.minBB, geom.maxBB,
+		packed.data(), packed.size(), elements, geom.indices.size() * indexSize,
+		geom.lods.data(), geom.lods.size() * sizeof(MeshLod));
+}
+
+// Pack float vertices into the buffer layout of a vertex format
+std::vector<unsigned char> Mesh::pack(const std::vector<Vertex>& verts, VertexFormat format,
+	glm::vec3 minBB, glm::vec3 maxBB, QuantizationError* error) {
+	PositionTransform xf = positionTransform(format, minBB, maxBB);
+	size_t posSize = positionSize(format);
+	std::vector<unsigned char> packed(verts.size() * vertexSize(format));
+	float diagonal = glm::length(maxBB - minBB);
+
+	unsigned char* out = packed.data();
+	for (auto& v : verts) {
+		packPosition(format, v.pos, xf, out);
+		packNormal(format, v.norm, out + posSize);
+		if (error) {
+			error->addPosition(v.pos, unpackPosition(format, out, xf), diagonal);
+			error->addNormal(v.norm, unpackNormal(format, out + posSize));
+		}
+		out += vertexSize(format);
+	}
+	return packed;
+}
+
+// Unpack vertices stored in a vertex format
+std::vector<Mesh::Vertex> Mesh::unpack(const unsigned char* packed, size_t count,
+	VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB) {
+	PositionTransform xf = positionTransform(format, minBB, maxBB);
+	size_t posSize = positionSize(format);
+	std::vector<Vertex> verts(count);
+	for (auto& v : verts) {
+		v.pos = unpackPosition(format, packed, xf);
+		v.norm = unpackNormal(format, packed + posSize);
+		packed += vertexSize(format);
+	}
+	return verts;
+}
+
+// Send vertices and indices to OpenGL
+void Mesh::upload(const void* verts, size_t vertexCount,
+	const void* elements, size_t indexCount, size_t indexSize) {
+	vcount = (GLsizei)vertexCount;
+	icount = (GLsizei)indexCount;
+	itype = (indexSize == sizeof(uint16_t)) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	GLsizei stride = (GLsizei)vertexSize(vertexFormat);
+	size_t posSize = positionSize(vertexFormat);
 
 	// Load vertices into OpenGL
 	glGenVertexArrays(1, &vao);
@@ -134,19 +398,21 @@ void Mesh::load(std::string filename, bool keepLocalGeometry) {
 
 	glGenBuffers(1, &vbuf);
 	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, vertexCount * stride, verts, GL_STATIC_DRAW);
+
+	positionAttrib(0, vertexFormat, stride, 0);
+	normalAttrib(1, vertexFormat, stride, posSize);
 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
+	// Load indices (the binding is stored in the VAO)
+	if (indexCount > 0) {
+		glGenBuffers(1, &ibuf);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibuf);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * indexSize, elements, GL_STATIC_DRAW);
+	}
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Delete local copy of geometry
-	if (!keepLocalGeometry)
-		vertices.clear();
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 // Release resources
@@ -155,31 +421,13 @@ void Mesh::release() {
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
 	vertices.clear();
+	indices.clear();
+	optimizeStats.clear();
+	lods.clear();
+	quantError = QuantizationError();
 	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
 	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
+	if (ibuf) { glDeleteBuffers(1, &ibuf); ibuf = 0; }
 	vcount = 0;
-}
-
-int indexOfNumberLetter(std::string& str, int offset) {
-	for (int i = offset; i < int(str.length()); ++i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return (int)str.length();
-}
-int lastIndexOfNumberLetter(std::string& str) {
-	for (int i = int(str.length()) - 1; i >= 0; --i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return 0;
-}
-std::vector<std::string> split(const std::string &s, char delim) {
-	std::vector<std::string> elems;
-
-	std::stringstream ss(s);
-    std::string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-
-    return elems;
+	icount = 0;
 }
@@ -4,12 +4,17 @@
 #include <string>
 #include <vector>
 #include <utility>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
+#include "objloader.hpp"
+#include "meshproc.hpp"
 
 class Mesh {
 public:
-	Mesh(std::string filename, bool keepLocalGeometry = false);
+	// optimize is a combination of MeshOptimize flags
+	Mesh(std::string filename, bool keepLocalGeometry = false,
+		unsigned int optimize = MESHOPT_ALL, VertexFormat format = VERTEXFORMAT_QUANTIZED);
 	~Mesh() { release(); }
 	// Disallow copy, move, & assignment
 	Mesh(const Mesh& other) = delete;
@@ -21,34 +26,102 @@ public:
 	std::pair<glm::vec3, glm::vec3> boundingBox() const
 	{ return std::make_pair(minBB, maxBB); }
 
-	void load(std::string filename, bool keepLocalGeometry = false);
-	void draw();
+	void load(std::string filename, bool keepLocalGeometry = false,
+		unsigned int optimize = MESHOPT_ALL, VertexFormat format = VERTEXFORMAT_QUANTIZED);
+	// Draw a level of detail (0 is the full mesh; see getLods())
+	void draw(unsigned int lod = 0) const;
+	// Draw several copies of a level of detail; shaders tell them apart by gl_InstanceID
+	void drawInstanced(GLsizei instances, unsigned int lod = 0) const;
 
-	// access:
-	inline void setModelMat(const glm::mat4 model) { modelMat = model; }
-	inline glm::mat4 getModelMat() { return modelMat; }
+	// Levels of detail in the index buffer, from the full mesh to the
+	// coarsest (empty if the mesh wasn't loaded with MESHOPT_LOD)
+	const std::vector<MeshLod>& getLods() const { return lods; }
+
+	// Timing of the last load
+	const ObjLoadStats& getLoadStats() const { return loadStats; }
+	// Vertex cache efficiency before and after each optimization pass of the
+	// last load (empty if it came from the binary cache)
+	const std::vector<MeshPassStats>& getOptimizeStats() const { return optimizeStats; }
+	// Error of the vertex format packing in the last load (zero if it came from the cache)
+	const QuantizationError& getQuantizationError() const { return quantError; }
+
+	// Layout of the vertex buffer; shaders get positions as stored and must
+	// map them to model space with getPositionTransform()
+	VertexFormat getVertexFormat() const { return vertexFormat; }
+	const PositionTransform& getPositionTransform() const { return posXform; }
+	// GPU memory taken by the vertex and index buffers
+	size_t getGpuBytes() const
+	{ return (size_t)vcount * vertexSize(vertexFormat) + (size_t)icount * (itype == GL_UNSIGNED_SHORT ? 2 : 4); }
+
+	// Parse an OBJ file and write its vertex and index arrays to the binary cache
+	static void bake(const std::string& filename, unsigned int optimize = MESHOPT_ALL,
+		VertexFormat format = VERTEXFORMAT_QUANTIZED);
 
 	// Mesh vertex format
 	struct Vertex {
 		glm::vec3 pos;		// Position
 		glm::vec3 norm;		// Normal
 	};
+	// Indexed geometry built from a file
+	struct Geometry {
+		std::vector<Vertex> vertices;		// Unique vertices
+		std::vector<unsigned int> indices;	// Three per triangle, all levels of detail
+		std::vector<MeshLod> lods;			// Levels of detail in indices
+		glm::vec3 minBB;					// Bounding box
+		glm::vec3 maxBB;
+		std::vector<MeshPassStats> passes;	// Results of the optimization passes
+	};
 	// Local geometry data
 	std::vector<Vertex> vertices;
+	std::vector<unsigned int> indices;
+
+	// Format id of cached vertex arrays; bump whenever Vertex or the way
+	// it is computed changes so that stale caches are rebuilt
+	static const uint32_t CACHE_FORMAT = 3;
 
 protected:
 	void release();		// Release OpenGL resources
+	// Create OpenGL resources from vertices packed in vertexFormat
+	// (indexSize is 2 or 4 bytes)
+	void upload(const void* verts, size_t vertexCount,
+		const void* elements, size_t indexCount, size_t indexSize);
+
+	// Parse an OBJ file and build its indexed geometry
+	static Geometry build(const std::string& filename, unsigned int optimize,
+		VertexFormat format, ObjLoadStats* stats = nullptr);
+	// Append simplified levels of detail to indexed geometry
+	static void buildLods(Geometry& geom, bool flatNormals);
+	// Convert between float vertices and a packed vertex format
+	static std::vector<unsigned char> pack(const std::vector<Vertex>& verts, VertexFormat format,
+		glm::vec3 minBB, glm::vec3 maxBB, QuantizationError* error = nullptr);
+	static std::vector<Vertex> unpack(const unsigned char* packed, size_t count,
+		VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB);
+	// Bytes per vertex in a vertex format
+	static size_t vertexSize(VertexFormat format)
+	{ return positionSize(format) + normalSize(format); }
+	// Cache format id for a set of optimization passes and a vertex format
+	static uint32_t cacheFormat(unsigned int optimize, VertexFormat format)
+	{ return CACHE_FORMAT | (optimize << 16) | ((uint32_t)format << 24); }
 
 	// Bounding box
 	glm::vec3 minBB;
 	glm::vec3 maxBB;
 
-	glm::mat4 modelMat = glm::mat4(1.0f);  // the model matrix; apply this matrix to the model to transfer local coordinates to world coordinates
+	ObjLoadStats loadStats;	// Size and parse time of the source file
+	std::vector<MeshPassStats> optimizeStats;	// Results of the optimization passes
+	QuantizationError quantError;	// Error of the vertex format packing
+	std::vector<MeshLod> lods;		// Levels of detail in the index buffer
+
+	VertexFormat vertexFormat;		// Layout of the vertex buffer
+	PositionTransform posXform;		// Stored-to-model-space position mapping
 
 	// OpenGL resources
 	GLuint vao;		// Vertex array object
 	GLuint vbuf;	// Vertex buffer
+	GLuint ibuf;	// Index buffer
 	GLsizei vcount;	// Number of vertices
+	GLsizei icount;	// Number of indices
+	GLenum itype;	// Index type (GL_UNSIGNED_SHORT or GL_UNSIGNED_INT)
 
 private:
 };
@@ -0,0 +1,50 @@
+// Pre-builds the binary caches (.mcache) for OBJ models so that the viewer
+// never has to parse them at run time.
+//
+// Usage: meshbake [file.obj | directory]...   (default: models)
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "mesh.hpp"
+#include "meshcache.hpp"
+namespace fs = std::filesystem;
+
+int main(int argc, char** argv) {
+	std::vector<std::string> args(argv + 1, argv + argc);
+	if (args.empty())
+		args.push_back("models");
+
+	// Collect .obj files from the arguments
+	std::vector<std::string> objFiles;
+	for (auto& arg : args) {
+		if (fs::is_directory(arg)) {
+			for (auto& di : fs::directory_iterator(arg)) {
+				if (di.is_regular_file() && di.path().extension() == ".obj")
+					objFiles.push_back(di.path().string());
+			}
+		} else
+			objFiles.push_back(arg);
+	}
+	std::sort(objFiles.begin(), objFiles.end());
+
+	int failures = 0;
+	for (auto& objFile : objFiles) {
+		try {
+			auto start = std::chrono::steady_clock::now();
+			Mesh::bake(objFile);
+			double seconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+			std::cout << "Baked " << MeshCache::cachePath(objFile) << " ("
+				<< fs::file_size(MeshCache::cachePath(objFile)) / 1024 << " KB) in "
+				<< seconds * 1000.0 << " ms" << std::endl;
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			failures++;
+		}
+	}
+
+	return failures == 0 ? 0 : 1;
+}
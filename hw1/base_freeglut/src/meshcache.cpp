@@ -0,0 +1,231 @@
+#define NOMINMAX
+#include "meshcache.hpp"
+#include "parallel.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+namespace fs = std::filesystem;
+
+namespace {
+
+const char MAGIC[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+const uint32_t VERSION = 2;
+const size_t HASH_BLOCK_BYTES = 1 << 22;	// Files are hashed in 4 MB blocks
+
+const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t mixLane(uint64_t acc, uint64_t word) {
+	return rotl(acc + word * PRIME2, 31) * PRIME1;
+}
+
+inline uint64_t avalanche(uint64_t h) {
+	h ^= h >> 33; h *= PRIME2;
+	h ^= h >> 29; h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Hash a block of bytes, four 64-bit lanes at a time
+uint64_t hashBlock(const char* data, size_t size, uint64_t seed) {
+	uint64_t lanes[4] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		uint64_t w[4];
+		memcpy(w, data + i, 32);
+		lanes[0] = mixLane(lanes[0], w[0]);
+		lanes[1] = mixLane(lanes[1], w[1]);
+		lanes[2] = mixLane(lanes[2], w[2]);
+		lanes[3] = mixLane(lanes[3], w[3]);
+	}
+	uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+	for (; i < size; i++)
+		h = rotl(h ^ ((uint64_t)(unsigned char)data[i] * PRIME3), 11) * PRIME1;
+	return avalanche(h + size);
+}
+
+// Modification time of a file as a plain integer
+int64_t modificationTime(const std::string& filename) {
+	return (int64_t)fs::last_write_time(filename).time_since_epoch().count();
+}
+
+inline uint64_t alignUp(uint64_t offset) { return (offset + 15) & ~(uint64_t)15; }
+
+// Whether [offset, offset + bytes) lies within a file of the given size,
+// without overflowing on a damaged header
+inline bool fitsIn(uint64_t offset, uint64_t bytes, uint64_t size) {
+	return bytes <= size && offset <= size - bytes;
+}
+
+}
+
+// Hash a file's contents
+uint64_t MeshCache::hashFile(const std::string& filename) {
+	MappedFile source(filename);
+	size_t blocks = (source.size() + HASH_BLOCK_BYTES - 1) / HASH_BLOCK_BYTES;
+	std::vector<uint64_t> blockHashes(blocks);
+	ThreadPool::global().run(blocks, [&](size_t b) {
+		size_t offset = b * HASH_BLOCK_BYTES;
+		size_t size = std::min(HASH_BLOCK_BYTES, source.size() - offset);
+		blockHashes[b] = hashBlock(source.data() + offset, size, b);
+	});
+	return hashBlock((const char*)blockHashes.data(), blocks * sizeof(uint64_t), source.size());
+}
+
+// Hash a source file, trusting its cache if the file is unchanged
+uint64_t MeshCache::hashSource(const std::string& sourceFile) {
+	std::string path = cachePath(sourceFile);
+	std::error_code ec;
+	if (fs::is_regular_file(path, ec)) {
+		try {
+			MappedFile cacheFile(path);
+			const Header* h = (const Header*)cacheFile.data();
+			if (cacheFile.size() >= sizeof(Header) &&
+				memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+				h->version == VERSION &&
+				h->sourceSize == (uint64_t)fs::file_size(sourceFile) &&
+				h->sourceMtime == modificationTime(sourceFile))
+				return h->sourceHash;
+		} catch (const std::exception&) {
+			// Fall back to reading the source
+		}
+	}
+	return hashFile(sourceFile);
+}
+
+// Map and validate the cache for a source file
+bool MeshCache::open(const std::string& sourceFile, uint32_t format) {
+	close();
+	std::string path = cachePath(sourceFile);
+	std::error_code ec;
+	if (!fs::is_regular_file(path, ec) || !fs::is_regular_file(sourceFile, ec))
+		return false;
+
+	// Map the cache and check the header and the extent of the buffers
+	auto map = [&]() -> const Header* {
+		try {
+			file = std::unique_ptr<MappedFile>(new MappedFile(path));
+		} catch (const std::exception&) {
+			return nullptr;
+		}
+		const Header* h = (const Header*)file->data();
+		bool valid = file->size() >= sizeof(Header) &&
+			memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+			h->version == VERSION &&
+			h->format == format &&
+			fitsIn(h->vertexOffset, h->vertexBytes, file->size()) &&
+			fitsIn(h->indexOffset, h->indexBytes, file->size()) &&
+			fitsIn(h->extraOffset, h->extraBytes, file->size());
+		return valid ? h : nullptr;
+	};
+	const Header* h = map();
+	bool valid = (h != nullptr);
+
+	// Check that the source hasn't changed since the cache was written
+	if (valid && h->sourceSize != (uint64_t)fs::file_size(sourceFile, ec))
+		valid = false;
+	if (valid && h->sourceMtime != modificationTime(sourceFile)) {
+		// Touched but maybe not modified (e.g. a fresh checkout): compare contents
+		valid = h->sourceHash == hashFile(sourceFile);
+		if (valid) {
+			// Remember the new time so the next open doesn't need to hash. The
+			// file is unmapped meanwhile, since Windows won't let it be opened
+			// for writing while mapped.
+			int64_t mtime = modificationTime(sourceFile);
+			file.reset();
+			std::fstream out(path, std::ios::in | std::ios::out | std::ios::binary);
+			out.seekp(offsetof(Header, sourceMtime));
+			out.write((const char*)&mtime, sizeof(mtime));
+			out.close();
+			if (!out)
+				std::cerr << "Warning: failed to update " << path << "; its source will be hashed again next time" << std::endl;
+			h = map();
+			valid = (h != nullptr);
+		}
+	}
+
+	if (!valid) {
+		close();
+		return false;
+	}
+	header = h;
+	return true;
+}
+
+// Unmap the cache
+void MeshCache::close() {
+	header = nullptr;
+	file.reset();
+}
+
+const void* MeshCache::vertexData() const { return file->data() + header->vertexOffset; }
+size_t MeshCache::vertexBytes() const { return (size_t)header->vertexBytes; }
+const void* MeshCache::indexData() const { return file->data() + header->indexOffset; }
+size_t MeshCache::indexBytes() const { return (size_t)header->indexBytes; }
+const void* MeshCache::extraData() const { return file->data() + header->extraOffset; }
+size_t MeshCache::extraBytes() const { return (size_t)header->extraBytes; }
+glm::vec3 MeshCache::minBB() const { return glm::vec3(header->minBB[0], header->minBB[1], header->minBB[2]); }
+glm::vec3 MeshCache::maxBB() const { return glm::vec3(header->maxBB[0], header->maxBB[1], header->maxBB[2]); }
+
+// Write the cache for a source file
+void MeshCache::write(const std::string& sourceFile, uint32_t format,
+	glm::vec3 minBB, glm::vec3 maxBB,
+	const void* vertices, size_t vertexBytes,
+	const void* indices, size_t indexBytes,
+	const void* extra, size_t extraBytes) {
+
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.format = format;
+	h.sourceSize = (uint64_t)fs::file_size(sourceFile);
+	h.sourceMtime = modificationTime(sourceFile);
+	h.sourceHash = hashFile(sourceFile);
+	for (int i = 0; i < 3; i++) {
+		h.minBB[i] = minBB[i];
+		h.maxBB[i] = maxBB[i];
+	}
+	h.vertexOffset = alignUp(sizeof(Header));
+	h.vertexBytes = vertexBytes;
+	h.indexOffset = alignUp(h.vertexOffset + vertexBytes);
+	h.indexBytes = indexBytes;
+	h.extraOffset = alignUp(h.indexOffset + indexBytes);
+	h.extraBytes = extraBytes;
+
+	// Write to a temporary file, then move it into place so that readers
+	// never see a partially written cache
+	std::string path = cachePath(sourceFile);
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			std::stringstream ss;
+			ss << "Error writing " << tmpPath << ": failed to open file";
+			throw std::runtime_error(ss.str());
+		}
+		const char zeros[16] = {};
+		out.write((const char*)&h, sizeof(h));
+		out.write(zeros, h.vertexOffset - sizeof(h));
+		out.write((const char*)vertices, vertexBytes);
+		out.write(zeros, h.indexOffset - (h.vertexOffset + vertexBytes));
+		if (indexBytes > 0)
+			out.write((const char*)indices, indexBytes);
+		out.write(zeros, h.extraOffset - (h.indexOffset + indexBytes));
+		if (extraBytes > 0)
+			out.write((const char*)extra, extraBytes);
+		if (!out) {
+			std::stringstream ss;
+			ss << "Error writing " << tmpPath;
+			throw std::runtime_error(ss.str());
+		}
+	}
+	fs::rename(tmpPath, path);
+}
@@ -0,0 +1,888 @@
+#define NOMINMAX
+#include "meshproc.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <glm/gtc/packing.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MESHPROC_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Triangle corners using each vertex, stored as one flat array with offsets
+struct Adjacency {
+	std::vector<unsigned int> offsets;	// Start of each vertex's list (vertexCount + 1)
+	std::vector<unsigned int> corners;	// Corner numbers (triangle * 3 + corner), ascending
+};
+
+Adjacency buildAdjacency(const std::vector<unsigned int>& indices, size_t vertexCount) {
+	Adjacency adj;
+	adj.offsets.assign(vertexCount + 1, 0);
+	for (auto index : indices)
+		adj.offsets[index + 1]++;
+	for (size_t v = 0; v < vertexCount; v++)
+		adj.offsets[v + 1] += adj.offsets[v];
+
+	adj.corners.resize(indices.size());
+	std::vector<unsigned int> fill(adj.offsets.begin(), adj.offsets.end() - 1);
+	for (size_t i = 0; i < indices.size(); i++)
+		adj.corners[fill[indices[i]]++] = (unsigned int)i;
+	return adj;
+}
+
+// Coefficients of acos(x) ~ sqrt(1 - x) * poly(x) on [0, 1], error below
+// 2e-8 radians (Abramowitz & Stegun 4.4.46)
+const float ACOS_COEFFS[8] = { 1.5707963050f, -0.2145988016f, 0.0889789874f, -0.0501743046f,
+	0.0308918810f, -0.0170881256f, 0.0066700901f, -0.0012624911f };
+const float PI = 3.14159265358979f;
+
+// Arc cosine (the same approximation as the SIMD version, so that both
+// paths give the same normals)
+inline float acosApprox(float x) {
+	float ax = std::fabs(x);
+	float p = ACOS_COEFFS[7];
+	for (int i = 6; i >= 0; i--)
+		p = p * ax + ACOS_COEFFS[i];
+	float r = std::sqrt(1.0f - ax) * p;
+	return x < 0.0f ? PI - r : r;
+}
+
+// Unit normal of a triangle times its angle at a corner, from the edges
+// leaving that corner (in winding order); degenerate triangles give zero
+inline glm::vec3 cornerNormal(glm::vec3 u, glm::vec3 w) {
+	glm::vec3 n = glm::cross(u, w);
+	float nn = glm::dot(n, n), uw = glm::dot(u, u) * glm::dot(w, w);
+	if (!(nn > 0.0f && uw > 0.0f))
+		return glm::vec3(0.0f);
+	float angle = acosApprox(glm::clamp(glm::dot(u, w) / std::sqrt(uw), -1.0f, 1.0f));
+	return n * (angle / std::sqrt(nn));
+}
+
+#ifdef MESHPROC_SSE2
+// Arc cosine of four values
+inline __m128 acos4(__m128 x) {
+	__m128 negative = _mm_cmplt_ps(x, _mm_setzero_ps());
+	__m128 ax = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+	__m128 p = _mm_set1_ps(ACOS_COEFFS[7]);
+	for (int i = 6; i >= 0; i--)
+		p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(ACOS_COEFFS[i]));
+	__m128 r = _mm_mul_ps(_mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), ax)), p);
+	__m128 flipped = _mm_sub_ps(_mm_set1_ps(PI), r);
+	return _mm_or_ps(_mm_and_ps(negative, flipped), _mm_andnot_ps(negative, r));
+}
+
+inline __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+inline __m128 clamp4(__m128 x) {
+	return _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(1.0f)), _mm_set1_ps(-1.0f));
+}
+
+// cornerNormal for four corners at once
+void cornerNormals4(const glm::vec3* p, const glm::vec3* next, const glm::vec3* prev, glm::vec3* out) {
+	// Transpose the edges into one register per coordinate
+	alignas(16) float e[2][3][4];	// [edge][axis][corner]
+	for (int c = 0; c < 4; c++) {
+		glm::vec3 u = next[c] - p[c], w = prev[c] - p[c];
+		for (int k = 0; k < 3; k++) {
+			e[0][k][c] = u[k];
+			e[1][k][c] = w[k];
+		}
+	}
+	__m128 ux = _mm_load_ps(e[0][0]), uy = _mm_load_ps(e[0][1]), uz = _mm_load_ps(e[0][2]);
+	__m128 wx = _mm_load_ps(e[1][0]), wy = _mm_load_ps(e[1][1]), wz = _mm_load_ps(e[1][2]);
+
+	// Same operation order as glm::cross and glm::dot
+	__m128 nx = _mm_sub_ps(_mm_mul_ps(uy, wz), _mm_mul_ps(wy, uz));
+	__m128 ny = _mm_sub_ps(_mm_mul_ps(uz, wx), _mm_mul_ps(wz, ux));
+	__m128 nz = _mm_sub_ps(_mm_mul_ps(ux, wy), _mm_mul_ps(wx, uy));
+	__m128 nn = dot4(nx, ny, nz, nx, ny, nz);
+	__m128 uw = _mm_mul_ps(dot4(ux, uy, uz, ux, uy, uz), dot4(wx, wy, wz, wx, wy, wz));
+	__m128 zero = _mm_setzero_ps();
+	__m128 valid = _mm_and_ps(_mm_cmpgt_ps(nn, zero), _mm_cmpgt_ps(uw, zero));
+
+	__m128 angle = acos4(clamp4(_mm_div_ps(dot4(ux, uy, uz, wx, wy, wz), _mm_sqrt_ps(uw))));
+	__m128 scale = _mm_and_ps(valid, _mm_div_ps(angle, _mm_sqrt_ps(nn)));
+
+	alignas(16) float n[3][4];
+	_mm_store_ps(n[0], _mm_mul_ps(nx, scale));
+	_mm_store_ps(n[1], _mm_mul_ps(ny, scale));
+	_mm_store_ps(n[2], _mm_mul_ps(nz, scale));
+	for (int c = 0; c < 4; c++)
+		out[c] = glm::vec3(n[0][c], n[1][c], n[2][c]);
+}
+#endif
+
+// FIFO cache that tracks when each vertex was last loaded
+class CacheSim {
+public:
+	CacheSim(size_t vertexCount, unsigned int cacheSize) :
+		stamps(vertexCount, 0), time(cacheSize + 1), size(cacheSize) {}
+
+	// Returns true on a miss (the vertex has to be transformed)
+	bool access(unsigned int v) {
+		if (time - stamps[v] <= size)
+			return false;
+		stamps[v] = time++;
+		return true;
+	}
+	// Forget all cached vertices
+	void flush() { time += size + 1; }
+
+protected:
+	std::vector<unsigned int> stamps;	// Time each vertex entered the cache
+	unsigned int time;					// Number of misses so far (plus offset)
+	unsigned int size;					// Number of entries
+};
+
+// Order of triangles for the post-transform cache (Tipsify)
+std::vector<unsigned int> vertexCacheOrder(const std::vector<unsigned int>& indices,
+	size_t vertexCount, std::vector<unsigned int>* clusters, unsigned int cacheSize) {
+	size_t triCount = indices.size() / 3;
+	Adjacency adj = buildAdjacency(indices, vertexCount);
+
+	// Number of triangles not yet emitted that use each vertex
+	std::vector<unsigned int> live(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+		live[v] = adj.offsets[v + 1] - adj.offsets[v];
+
+	std::vector<unsigned int> stamps(vertexCount, 0);	// Cache entry times
+	unsigned int time = cacheSize + 1;
+	std::vector<bool> emitted(triCount, false);
+	std::vector<unsigned int> deadEnd;		// Recently used vertices, most recent last
+	std::vector<unsigned int> candidates;	// Vertices of the last fan
+	std::vector<unsigned int> order;
+	order.reserve(triCount);
+	if (clusters)
+		clusters->clear();
+
+	size_t cursor = 0;	// Next vertex to try when everything near the cache is used up
+	long long fan = 0;	// Vertex whose triangles are emitted next
+	bool newCluster = true;
+	while (fan >= 0 && vertexCount > 0) {
+		if (newCluster && clusters)
+			clusters->push_back((unsigned int)order.size());
+		newCluster = false;
+
+		// Emit all remaining triangles around the fan vertex
+		candidates.clear();
+		for (unsigned int a = adj.offsets[fan]; a < adj.offsets[fan + 1]; a++) {
+			unsigned int t = adj.corners[a] / 3;
+			if (emitted[t])
+				continue;
+			order.push_back(t);
+			for (int c = 0; c < 3; c++) {
+				unsigned int v = indices[t * 3 + c];
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - stamps[v] > cacheSize)
+					stamps[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Pick the candidate that will still be in the cache after its
+		// remaining triangles are emitted, preferring the oldest one
+		long long next = -1;
+		long long best = -1;
+		for (auto v : candidates) {
+			if (live[v] == 0)
+				continue;
+			long long priority = 0;
+			if (time - stamps[v] + 2 * live[v] <= cacheSize)
+				priority = time - stamps[v];
+			if (priority > best) {
+				best = priority;
+				next = v;
+			}
+		}
+
+		// Dead end: fall back to a recently used vertex, then to the next unused one
+		if (next < 0) {
+			newCluster = true;
+			while (!deadEnd.empty() && next < 0) {
+				unsigned int v = deadEnd.back();
+				deadEnd.pop_back();
+				if (live[v] > 0)
+					next = v;
+			}
+			while (next < 0 && cursor < vertexCount) {
+				if (live[cursor] > 0)
+					next = (long long)cursor;
+				cursor++;
+			}
+		}
+		fan = next;
+	}
+	return order;
+}
+
+// Sum of squared distances to a set of weighted planes,
+// Q(p) = p.A.p + 2 b.p + c with A symmetric
+struct Quadric {
+	double a00, a11, a22, a01, a02, a12;
+	double b0, b1, b2;
+	double c;
+	double w;	// Total weight of the planes
+
+	Quadric() : a00(0), a11(0), a22(0), a01(0), a02(0), a12(0), b0(0), b1(0), b2(0), c(0), w(0) {}
+	// Plane dot(n, p) + d = 0 (n unit length) with a weight
+	Quadric(glm::dvec3 n, double d, double weight) :
+		a00(weight * n.x * n.x), a11(weight * n.y * n.y), a22(weight * n.z * n.z),
+		a01(weight * n.x * n.y), a02(weight * n.x * n.z), a12(weight * n.y * n.z),
+		b0(weight * d * n.x), b1(weight * d * n.y), b2(weight * d * n.z),
+		c(weight * d * d), w(weight) {}
+
+	Quadric& operator+=(const Quadric& q) {
+		a00 += q.a00; a11 += q.a11; a22 += q.a22;
+		a01 += q.a01; a02 += q.a02; a12 += q.a12;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		w += q.w;
+		return *this;
+	}
+
+	// Weighted mean squared distance from a point to the planes
+	double error(glm::vec3 point) const {
+		if (w <= 0.0)
+			return 0.0;
+		double x = point.x, y = point.y, z = point.z;
+		double e = a00 * x * x + a11 * y * y + a22 * z * z +
+			2.0 * (a01 * x * y + a02 * x * z + a12 * y * z) +
+			2.0 * (b0 * x + b1 * y + b2 * z) + c;
+		return std::max(e, 0.0) / w;
+	}
+};
+
+// How a vertex may move during simplification
+enum VertexKind : unsigned char {
+	VERTEX_INTERIOR,	// Surrounded by triangles: may collapse onto any neighbor
+	VERTEX_BORDER,		// On one open boundary: may only slide along it
+	VERTEX_LOCKED,		// On a non-manifold edge or where boundaries meet: never moves
+};
+
+// Weight of the planes that hold open boundaries in place, relative to the
+// triangles next to them
+const double BORDER_WEIGHT = 10.0;
+
+// Vertex after corner in its triangle (next = 1) or before it (next = 2)
+inline unsigned int cornerVertex(const std::vector<unsigned int>& indices, unsigned int corner, int next) {
+	return indices[corner - corner % 3 + (corner + next) % 3];
+}
+
+// Number of triangles with the directed edge a -> b
+unsigned int countEdge(const Adjacency& adj, const std::vector<unsigned int>& indices,
+	unsigned int a, unsigned int b) {
+	unsigned int count = 0;
+	for (unsigned int i = adj.offsets[a]; i < adj.offsets[a + 1]; i++)
+		count += cornerVertex(indices, adj.corners[i], 1) == b;
+	return count;
+}
+
+// Whether the edge between a and b has a triangle on only one side
+inline bool isBorderEdge(const Adjacency& adj, const std::vector<unsigned int>& indices,
+	unsigned int a, unsigned int b) {
+	return countEdge(adj, indices, a, b) + countEdge(adj, indices, b, a) == 1;
+}
+
+// Whether moving vertex from onto vertex to keeps the surface manifold (the
+// only vertices next to both are those of the triangles on the edge) and
+// turns no remaining triangle over. ring and shared are scratch space.
+bool isValidCollapse(const Adjacency& adj, const std::vector<unsigned int>& indices,
+	const std::vector<glm::vec3>& positions, unsigned int from, unsigned int to,
+	std::vector<unsigned int>& ring, std::vector<unsigned int>& shared) {
+	ring.clear();
+	shared.clear();
+	for (unsigned int i = adj.offsets[to]; i < adj.offsets[to + 1]; i++) {
+		unsigned int corner = adj.corners[i];
+		ring.push_back(cornerVertex(indices, corner, 1));
+		ring.push_back(cornerVertex(indices, corner, 2));
+	}
+
+	for (unsigned int i = adj.offsets[from]; i < adj.offsets[from + 1]; i++) {
+		unsigned int corner = adj.corners[i];
+		unsigned int next = cornerVertex(indices, corner, 1), prev = cornerVertex(indices, corner, 2);
+		if (next == to || prev == to) {
+			// Triangle on the edge: goes away
+			shared.push_back(next == to ? prev : next);
+			continue;
+		}
+
+		// Remaining triangle: must keep facing the same way
+		glm::vec3 p = positions[from], q = positions[to];
+		glm::vec3 before = glm::cross(positions[next] - p, positions[prev] - p);
+		glm::vec3 after = glm::cross(positions[next] - q, positions[prev] - q);
+		if (glm::dot(before, after) <= 0.0f)
+			return false;
+	}
+
+	// Link condition
+	for (unsigned int i = adj.offsets[from]; i < adj.offsets[from + 1]; i++) {
+		unsigned int corner = adj.corners[i];
+		for (int k = 1; k <= 2; k++) {
+			unsigned int v = cornerVertex(indices, corner, k);
+			if (v != to && std::find(ring.begin(), ring.end(), v) != ring.end() &&
+				std::find(shared.begin(), shared.end(), v) == shared.end())
+				return false;
+		}
+	}
+	return true;
+}
+
+}
+
+// Simulate a FIFO post-transform cache over an index list
+VertexCacheStats analyzeVertexCache(const std::vector<unsigned int>& indices,
+	size_t vertexCount, unsigned int cacheSize) {
+	CacheSim cache(vertexCount, cacheSize);
+	size_t misses = 0;
+	for (auto index : indices)
+		misses += cache.access(index);
+
+	VertexCacheStats stats;
+	stats.acmr = indices.empty() ? 0.0f : (float)misses / (float)(indices.size() / 3);
+	stats.atvr = vertexCount == 0 ? 0.0f : (float)misses / (float)vertexCount;
+	return stats;
+}
+
+// Angle-weighted vertex normals
+std::vector<glm::vec3> computeSmoothNormals(const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& indices) {
+	Adjacency adj = buildAdjacency(indices, positions.size());
+	std::vector<glm::vec3> normals(positions.size());
+
+	// Each vertex gathers from its own corners, so no two threads write the
+	// same normal and the sum order doesn't depend on the thread count
+	parallelFor(0, positions.size(), 1 << 14, [&](size_t begin, size_t end) {
+		// Corner contributions are computed in batches that may span vertices
+		const size_t BATCH = 256;
+		glm::vec3 p[BATCH], next[BATCH], prev[BATCH], weighted[BATCH];
+		size_t v = begin;
+		glm::vec3 sum(0.0f);
+		for (size_t a = adj.offsets[begin]; a < adj.offsets[end]; a += BATCH) {
+			size_t count = std::min(BATCH, (size_t)adj.offsets[end] - a);
+			for (size_t k = 0; k < count; k++) {
+				unsigned int corner = adj.corners[a + k];
+				unsigned int first = corner - corner % 3;
+				p[k] = positions[indices[corner]];
+				next[k] = positions[indices[first + (corner + 1) % 3]];
+				prev[k] = positions[indices[first + (corner + 2) % 3]];
+			}
+			size_t k = 0;
+#ifdef MESHPROC_SSE2
+			for (; k + 4 <= count; k += 4)
+				cornerNormals4(&p[k], &next[k], &prev[k], &weighted[k]);
+#endif
+			for (; k < count; k++)
+				weighted[k] = cornerNormal(next[k] - p[k], prev[k] - p[k]);
+
+			// Add the contributions up per vertex
+			for (k = 0; k < count; k++) {
+				while (adj.offsets[v + 1] <= a + k) {
+					float length = glm::length(sum);
+					normals[v++] = length > 0.0f ? sum / length : glm::vec3(0.0f);
+					sum = glm::vec3(0.0f);
+				}
+				sum += weighted[k];
+			}
+		}
+		for (; v < end; v++) {
+			float length = glm::length(sum);
+			normals[v] = length > 0.0f ? sum / length : glm::vec3(0.0f);
+			sum = glm::vec3(0.0f);
+		}
+	});
+	return normals;
+}
+
+// Reorder triangles for the post-transform cache
+void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount,
+	std::vector<unsigned int>* clusters, unsigned int cacheSize) {
+	std::vector<unsigned int> order = vertexCacheOrder(indices, vertexCount, clusters, cacheSize);
+	std::vector<unsigned int> output(indices.size());
+	for (size_t i = 0; i < order.size(); i++)
+		for (int c = 0; c < 3; c++)
+			output[i * 3 + c] = indices[order[i] * 3 + c];
+	indices.swap(output);
+}
+
+// Reorder clusters of triangles to draw outward-facing ones first
+void optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& clusters, float threshold, unsigned int cacheSize) {
+	size_t triCount = indices.size() / 3;
+	if (triCount == 0)
+		return;
+
+	// Split each cluster where its ACMR so far is within threshold of the
+	// ACMR of the whole cluster; past that point, a new cluster costs little
+	std::vector<unsigned int> hard(clusters);
+	if (hard.empty() || hard[0] != 0)
+		hard.insert(hard.begin(), 0);
+	hard.push_back((unsigned int)triCount);
+
+	std::vector<unsigned int> soft;
+	CacheSim cache(positions.size(), cacheSize);
+	for (size_t c = 0; c + 1 < hard.size(); c++) {
+		unsigned int begin = hard[c], end = hard[c + 1];
+		if (begin == end)
+			continue;
+
+		cache.flush();
+		size_t misses = 0;
+		for (unsigned int t = begin; t < end; t++)
+			for (int k = 0; k < 3; k++)
+				misses += cache.access(indices[t * 3 + k]);
+		float limit = threshold * (float)misses / (float)(end - begin);
+
+		cache.flush();
+		soft.push_back(begin);
+		size_t runMisses = 0;
+		unsigned int runStart = begin;
+		for (unsigned int t = begin; t < end; t++) {
+			for (int k = 0; k < 3; k++)
+				runMisses += cache.access(indices[t * 3 + k]);
+			if (t + 1 < end && (float)runMisses <= limit * (float)(t + 1 - runStart)) {
+				soft.push_back(t + 1);
+				cache.flush();
+				runMisses = 0;
+				runStart = t + 1;
+			}
+		}
+	}
+	soft.push_back((unsigned int)triCount);
+
+	// Area-weighted center of the mesh
+	glm::dvec3 meshCenter(0.0);
+	double meshArea = 0.0;
+	for (size_t t = 0; t < triCount; t++) {
+		const glm::vec3& p0 = positions[indices[t * 3 + 0]];
+		const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+		const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+		double area = glm::length(glm::cross(p1 - p0, p2 - p0));
+		meshCenter += glm::dvec3(p0 + p1 + p2) * (area / 3.0);
+		meshArea += area;
+	}
+	if (meshArea > 0.0)
+		meshCenter /= meshArea;
+
+	// Sort clusters by how much they face away from the center
+	size_t clusterCount = soft.size() - 1;
+	std::vector<float> sortKey(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++) {
+		glm::vec3 center(0.0f), normal(0.0f);
+		float area = 0.0f;
+		for (unsigned int t = soft[c]; t < soft[c + 1]; t++) {
+			const glm::vec3& p0 = positions[indices[t * 3 + 0]];
+			const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+			const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+			glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+			float a = glm::length(n);
+			center += (p0 + p1 + p2) * (a / 3.0f);
+			normal += n;
+			area += a;
+		}
+		float normalLength = glm::length(normal);
+		if (area > 0.0f && normalLength > 0.0f)
+			sortKey[c] = glm::dot(center / area - glm::vec3(meshCenter), normal / normalLength);
+		else
+			sortKey[c] = 0.0f;
+	}
+
+	std::vector<unsigned int> order(clusterCount);
+	for (size_t c = 0; c < clusterCount; c++)
+		order[c] = (unsigned int)c;
+	std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return sortKey[a] > sortKey[b];
+	});
+
+	std::vector<unsigned int> output;
+	output.reserve(indices.size());
+	for (auto c : order)
+		output.insert(output.end(), indices.begin() + soft[c] * 3, indices.begin() + soft[c + 1] * 3);
+	indices.swap(output);
+}
+
+// Simplify by quadric edge collapse
+std::vector<unsigned int> simplifyMesh(const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& input, size_t targetIndexCount, float maxError,
+	float* resultError, std::vector<unsigned int>* sourceTriangles) {
+	std::vector<unsigned int> indices(input);
+	std::vector<unsigned int> sources(indices.size() / 3);
+	for (size_t t = 0; t < sources.size(); t++)
+		sources[t] = (unsigned int)t;
+	size_t vertexCount = positions.size();
+	Adjacency adj = buildAdjacency(indices, vertexCount);
+
+	// Classify vertices by the edges around them
+	std::vector<unsigned char> kinds(vertexCount, VERTEX_INTERIOR);
+	std::vector<unsigned char> borderEdges(vertexCount, 0);
+	for (unsigned int corner = 0; corner < indices.size(); corner++) {
+		unsigned int a = indices[corner], b = cornerVertex(indices, corner, 1);
+		unsigned int forward = countEdge(adj, indices, a, b), backward = countEdge(adj, indices, b, a);
+		if (forward > 1 || backward > 1) {
+			kinds[a] = kinds[b] = VERTEX_LOCKED;
+		} else if (backward == 0) {
+			borderEdges[a] = (unsigned char)std::min(borderEdges[a] + 1, 255);
+			borderEdges[b] = (unsigned char)std::min(borderEdges[b] + 1, 255);
+		}
+	}
+	for (size_t v = 0; v < vertexCount; v++)
+		if (kinds[v] != VERTEX_LOCKED && borderEdges[v] > 0)
+			kinds[v] = borderEdges[v] == 2 ? VERTEX_BORDER : VERTEX_LOCKED;
+
+	// Area-weighted planes of the triangles around each vertex, plus planes
+	// through open boundaries that keep them from shrinking
+	std::vector<Quadric> quadrics(vertexCount);
+	for (size_t i = 0; i < indices.size(); i += 3) {
+		glm::dvec3 p0(positions[indices[i]]), p1(positions[indices[i + 1]]), p2(positions[indices[i + 2]]);
+		glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+		double length = glm::length(n);
+		if (length <= 0.0)
+			continue;
+		n /= length;
+		Quadric q(n, -glm::dot(n, p0), length * 0.5);
+		for (int k = 0; k < 3; k++)
+			quadrics[indices[i + k]] += q;
+
+		for (int k = 0; k < 3; k++) {
+			unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+			if (countEdge(adj, indices, b, a) != 0)
+				continue;
+			glm::dvec3 pa(positions[a]), edge = glm::dvec3(positions[b]) - pa;
+			glm::dvec3 m = glm::cross(edge, n);
+			double mLength = glm::length(m);
+			if (mLength <= 0.0)
+				continue;
+			m /= mLength;
+			Quadric border(m, -glm::dot(m, pa), glm::dot(edge, edge) * BORDER_WEIGHT);
+			quadrics[a] += border;
+			quadrics[b] += border;
+		}
+	}
+
+	// Whether a vertex may move onto a neighbor at all
+	auto canCollapse = [&](unsigned int from, unsigned int to) {
+		if (kinds[from] == VERTEX_LOCKED)
+			return false;
+		if (kinds[from] == VERTEX_BORDER)
+			return isBorderEdge(adj, indices, from, to);
+		return true;
+	};
+
+	struct Collapse {
+		unsigned int from, to;
+		double cost;	// Squared distance error
+	};
+	std::vector<Collapse> collapses;
+	std::vector<uint64_t> order;		// Sort key and index of each collapse to try
+	std::vector<unsigned int> remap(vertexCount);
+	std::vector<bool> touched(vertexCount);
+	std::vector<unsigned int> ring, shared;
+	double maxCost = (double)maxError * (double)maxError;
+	double worst = 0.0;
+
+	// Collapse in passes: sort the candidate edges by cost, then take the
+	// cheapest ones that don't share any triangles with each other
+	size_t targetTriangles = targetIndexCount / 3;
+	while (indices.size() / 3 > targetTriangles) {
+		// Every edge once (interior edges show up in two triangles)
+		collapses.clear();
+		for (unsigned int corner = 0; corner < indices.size(); corner++) {
+			unsigned int a = indices[corner], b = cornerVertex(indices, corner, 1);
+			if (a < b || countEdge(adj, indices, b, a) == 0)
+				collapses.push_back({ a, b, 0.0 });
+		}
+
+		// Cost of the better direction of each edge
+		const double NEVER = std::numeric_limits<double>::infinity();
+		parallelFor(0, collapses.size(), 1 << 12, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				Collapse& c = collapses[i];
+				Quadric q = quadrics[c.from];
+				q += quadrics[c.to];
+				double forward = canCollapse(c.from, c.to) ? q.error(positions[c.to]) : NEVER;
+				double backward = canCollapse(c.to, c.from) ? q.error(positions[c.from]) : NEVER;
+				if (backward < forward) {
+					std::swap(c.from, c.to);
+					c.cost = backward;
+				} else
+					c.cost = forward;
+			}
+		});
+		// Sort by cost as 64-bit keys: the bits of a non-negative float
+		// order the same way as its value
+		order.clear();
+		for (size_t i = 0; i < collapses.size(); i++) {
+			if (!(collapses[i].cost <= maxCost))
+				continue;
+			float cost = (float)collapses[i].cost;
+			uint32_t bits;
+			memcpy(&bits, &cost, sizeof(bits));
+			order.push_back(((uint64_t)bits << 32) | i);
+		}
+		// Usually only the cheapest ones get a chance before the pass is
+		// done, so sort the rest only if none of those work out
+		size_t tries = std::min(order.size(), (indices.size() / 3 - targetTriangles) * 3 / 2 + 64);
+		std::nth_element(order.begin(), order.begin() + tries - (tries > 0), order.end());
+		std::sort(order.begin(), order.begin() + tries);
+
+		for (size_t v = 0; v < vertexCount; v++)
+			remap[v] = (unsigned int)v;
+		std::fill(touched.begin(), touched.end(), false);
+		size_t triangles = indices.size() / 3;
+		size_t applied = 0;
+		for (size_t i = 0; i < order.size(); i++) {
+			if (i == tries) {
+				if (applied > 0)
+					break;
+				std::sort(order.begin() + tries, order.end());
+			}
+			const Collapse& c = collapses[(uint32_t)order[i]];
+			if (triangles <= targetTriangles)
+				break;
+			if (touched[c.from] || touched[c.to])
+				continue;
+			if (!isValidCollapse(adj, indices, positions, c.from, c.to, ring, shared))
+				continue;
+
+			// Nothing around either vertex may change again in this pass
+			for (unsigned int a = adj.offsets[c.from]; a < adj.offsets[c.from + 1]; a++) {
+				unsigned int corner = adj.corners[a];
+				touched[cornerVertex(indices, corner, 1)] = true;
+				touched[cornerVertex(indices, corner, 2)] = true;
+			}
+			touched[c.from] = touched[c.to] = true;
+
+			remap[c.from] = c.to;
+			quadrics[c.to] += quadrics[c.from];
+			triangles -= shared.size();
+			worst = std::max(worst, c.cost);
+			applied++;
+		}
+		if (applied == 0)
+			break;
+
+		// Drop the triangles that collapsed
+		size_t kept = 0;
+		for (size_t t = 0; t < indices.size() / 3; t++) {
+			unsigned int a = remap[indices[t * 3]], b = remap[indices[t * 3 + 1]], c = remap[indices[t * 3 + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			indices[kept * 3] = a;
+			indices[kept * 3 + 1] = b;
+			indices[kept * 3 + 2] = c;
+			sources[kept++] = sources[t];
+		}
+		indices.resize(kept * 3);
+		sources.resize(kept);
+		adj = buildAdjacency(indices, vertexCount);
+	}
+
+	if (resultError)
+		*resultError = (float)std::sqrt(worst);
+	if (sourceTriangles)
+		sourceTriangles->swap(sources);
+	return indices;
+}
+
+// Build levels of detail by repeated simplification
+std::vector<MeshLod> buildLodChain(const std::vector<glm::vec3>& positions,
+	std::vector<unsigned int>& indices, std::vector<unsigned int>* sourceTriangles) {
+	std::vector<MeshLod> lods;
+	lods.push_back({ 0, (uint32_t)indices.size(), 0.0f });
+	std::vector<unsigned int> sources(indices.size() / 3);
+	for (size_t t = 0; t < sources.size(); t++)
+		sources[t] = (unsigned int)t;
+
+	glm::vec3 minBB(std::numeric_limits<float>::max()), maxBB(std::numeric_limits<float>::lowest());
+	for (auto index : indices) {
+		minBB = glm::min(minBB, positions[index]);
+		maxBB = glm::max(maxBB, positions[index]);
+	}
+	float diagonal = indices.empty() ? 0.0f : glm::length(maxBB - minBB);
+
+	// Each level starts from the previous one, so errors add up
+	std::vector<unsigned int> level(indices), levelSources;
+	float error = 0.0f;
+	while (diagonal > 0.0f && lods.size() < MAX_LODS && level.size() / 3 >= 2 * MIN_LOD_TRIANGLES) {
+		float levelError = 0.0f;
+		std::vector<unsigned int> triangleSources;
+		std::vector<unsigned int> next = simplifyMesh(positions, level, level.size() / 6 * 3,
+			(MAX_LOD_ERROR - error) * diagonal, &levelError, &triangleSources);
+		// Stop once simplification stalls
+		if (next.empty() || next.size() * 4 > level.size() * 3)
+			break;
+		error += levelError / diagonal;
+
+		// Reorder the level for the vertex cache
+		std::vector<unsigned int> order = vertexCacheOrder(next, positions.size(), nullptr, VERTEX_CACHE_SIZE);
+		level.resize(next.size());
+		levelSources.resize(order.size());
+		for (size_t i = 0; i < order.size(); i++) {
+			for (int c = 0; c < 3; c++)
+				level[i * 3 + c] = next[order[i] * 3 + c];
+			levelSources[i] = sources[triangleSources[order[i]] + lods.back().indexOffset / 3];
+		}
+
+		lods.push_back({ (uint32_t)indices.size(), (uint32_t)level.size(), error });
+		indices.insert(indices.end(), level.begin(), level.end());
+		sources.insert(sources.end(), levelSources.begin(), levelSources.end());
+	}
+
+	if (sourceTriangles)
+		sourceTriangles->swap(sources);
+	return lods;
+}
+
+// Pick the coarsest level whose error stays within maxPixelError
+unsigned int selectLod(const std::vector<MeshLod>& lods, float diagonalPixels, float maxPixelError) {
+	unsigned int level = 0;
+	while (level + 1 < lods.size() && lods[level + 1].error * diagonalPixels <= maxPixelError)
+		level++;
+	return level;
+}
+
+// Check stored indices against their vertex buffer
+bool indicesFit(const void* indices, size_t indexCount, size_t indexSize, size_t vertexCount) {
+	unsigned int maxIndex = 0;
+	if (indexSize == sizeof(uint16_t)) {
+		const uint16_t* idx = (const uint16_t*)indices;
+		for (size_t i = 0; i < indexCount; i++)
+			maxIndex = std::max<unsigned int>(maxIndex, idx[i]);
+	} else {
+		const uint32_t* idx = (const uint32_t*)indices;
+		for (size_t i = 0; i < indexCount; i++)
+			maxIndex = std::max<unsigned int>(maxIndex, idx[i]);
+	}
+	return indexCount == 0 || maxIndex < vertexCount;
+}
+
+// Check stored levels of detail against their index buffer
+bool lodsFit(const void* lods, size_t lodBytes, size_t indexCount) {
+	if (lodBytes % sizeof(MeshLod) != 0)
+		return false;
+	for (size_t i = 0; i < lodBytes / sizeof(MeshLod); i++) {
+		MeshLod lod;
+		memcpy(&lod, (const char*)lods + i * sizeof(MeshLod), sizeof(MeshLod));
+		if (lod.indexOffset > indexCount || lod.indexCount > indexCount - lod.indexOffset)
+			return false;
+	}
+	return true;
+}
+
+// Bytes taken by a position
+size_t positionSize(VertexFormat format) {
+	return format == VERTEXFORMAT_FLOAT ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+}
+
+// Bytes taken by a normal
+size_t normalSize(VertexFormat format) {
+	return format == VERTEXFORMAT_FLOAT ? 3 * sizeof(float) : sizeof(uint32_t);
+}
+
+// Mapping from stored to model-space positions
+PositionTransform positionTransform(VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB) {
+	PositionTransform xf;
+	switch (format) {
+	case VERTEXFORMAT_QUANTIZED:
+		// Normalized shorts arrive in [0, 1]; stretch them over the bounding box
+		xf.scale = maxBB - minBB;
+		xf.offset = minBB;
+		break;
+	case VERTEXFORMAT_HALF:
+		// Half floats are most precise near zero, so store offsets from the center
+		xf.scale = glm::vec3(1.0f);
+		xf.offset = (minBB + maxBB) * 0.5f;
+		break;
+	default:
+		xf.scale = glm::vec3(1.0f);
+		xf.offset = glm::vec3(0.0f);
+		break;
+	}
+	return xf;
+}
+
+// Encode a position
+void packPosition(VertexFormat format, glm::vec3 pos, const PositionTransform& xf, unsigned char* out) {
+	if (format == VERTEXFORMAT_FLOAT) {
+		memcpy(out, &pos, 3 * sizeof(float));
+		return;
+	}
+	glm::vec4 stored(0.0f);
+	for (int i = 0; i < 3; i++)
+		stored[i] = xf.scale[i] != 0.0f ? (pos[i] - xf.offset[i]) / xf.scale[i] : 0.0f;
+	uint64_t packed = (format == VERTEXFORMAT_QUANTIZED) ?
+		glm::packUnorm4x16(stored) : glm::packHalf4x16(stored);
+	memcpy(out, &packed, sizeof(packed));
+}
+
+// Decode a position
+glm::vec3 unpackPosition(VertexFormat format, const unsigned char* in, const PositionTransform& xf) {
+	if (format == VERTEXFORMAT_FLOAT) {
+		glm::vec3 pos;
+		memcpy(&pos, in, 3 * sizeof(float));
+		return pos;
+	}
+	uint64_t packed;
+	memcpy(&packed, in, sizeof(packed));
+	glm::vec4 stored = (format == VERTEXFORMAT_QUANTIZED) ?
+		glm::unpackUnorm4x16(packed) : glm::unpackHalf4x16(packed);
+	return xf.offset + xf.scale * glm::vec3(stored);
+}
+
+// Encode a normal
+void packNormal(VertexFormat format, glm::vec3 norm, unsigned char* out) {
+	if (format == VERTEXFORMAT_FLOAT) {
+		memcpy(out, &norm, 3 * sizeof(float));
+		return;
+	}
+	// Degenerate triangles leave NaN normals; store those as zero
+	if (!std::isfinite(norm.x) || !std::isfinite(norm.y) || !std::isfinite(norm.z))
+		norm = glm::vec3(0.0f);
+	uint32_t packed = glm::packSnorm3x10_1x2(glm::vec4(norm, 0.0f));
+	memcpy(out, &packed, sizeof(packed));
+}
+
+// Decode a normal
+glm::vec3 unpackNormal(VertexFormat format, const unsigned char* in) {
+	if (format == VERTEXFORMAT_FLOAT) {
+		glm::vec3 norm;
+		memcpy(&norm, in, 3 * sizeof(float));
+		return norm;
+	}
+	uint32_t packed;
+	memcpy(&packed, in, sizeof(packed));
+	return glm::vec3(glm::unpackSnorm3x10_1x2(packed));
+}
+
+// Record the error of one position
+void QuantizationError::addPosition(glm::vec3 original, glm::vec3 decoded, float diagonal) {
+	if (diagonal > 0.0f)
+		maxPosition = std::max(maxPosition, glm::length(decoded - original) / diagonal);
+}
+
+// Record the angle between an original and a decoded normal
+void QuantizationError::addNormal(glm::vec3 original, glm::vec3 decoded) {
+	glm::dvec3 a(original), b(decoded);
+	double lengths = glm::length(a) * glm::length(b);
+	if (!(lengths > 0.0))
+		return;
+	// atan2 stays accurate for tiny angles, unlike acos of the dot product
+	double degrees = glm::degrees(std::atan2(glm::length(glm::cross(a, b)), glm::dot(a, b)));
+	maxNormal = std::max(maxNormal, (float)degrees);
+	meanNormal += (float)((degrees - meanNormal) / (double)(++normalCount));
+}
+
+// Copy 32-bit indices into 16-bit ones
+std::vector<uint16_t> narrowIndices(const std::vector<unsigned int>& indices) {
+	std::vector<uint16_t> narrow(indices.size());
+	for (size_t i = 0; i < indices.size(); i++)
+		narrow[i] = (uint16_t)indices[i];
+	return narrow;
+}
@@ -0,0 +1,107 @@
+#define NOMINMAX
+#include "meshregistry.hpp"
+#include "meshcache.hpp"
+#include <algorithm>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+// Registry shared by the whole program
+MeshRegistry& MeshRegistry::global() {
+	static MeshRegistry registry;
+	return registry;
+}
+
+// Identify a file by where it really is and what it contains
+MeshRegistry::Key MeshRegistry::makeKey(const std::string& filename, unsigned int optimize,
+	VertexFormat format) {
+	return { fs::weakly_canonical(filename).string(), MeshCache::hashSource(filename), optimize, format };
+}
+
+// Find a live mesh
+MeshRegistry::Handle MeshRegistry::find(const Key& key) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(key);
+	return it != entries.end() ? it->second.mesh.lock() : nullptr;
+}
+
+// Find a live mesh or load it, once
+MeshRegistry::Handle MeshRegistry::acquire(const Key& key,
+	const std::function<std::unique_ptr<Mesh>()>& load) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		auto it = entries.find(key);
+		if (it == entries.end())
+			break;
+		if (it->second.loading) {
+			loaded.wait(lock);
+			continue;
+		}
+		if (Handle mesh = it->second.mesh.lock())
+			return mesh;
+		entries.erase(it);
+		break;
+	}
+	entries[key] = { std::weak_ptr<const Mesh>(), 0, true };
+
+	// Load without holding the lock, so other keys can be served meanwhile
+	lock.unlock();
+	Handle mesh;
+	try {
+		mesh = Handle(load());
+	} catch (...) {
+		lock.lock();
+		entries.erase(key);
+		loaded.notify_all();
+		throw;
+	}
+	lock.lock();
+
+	Entry& entry = entries[key];
+	entry.mesh = mesh;
+	entry.bytes = mesh->getGpuBytes();
+	entry.loading = false;
+	peakBytes = std::max(peakBytes, prune());
+	loaded.notify_all();
+	return mesh;
+}
+
+// Find a live mesh or construct it from its file
+MeshRegistry::Handle MeshRegistry::acquire(const std::string& filename, unsigned int optimize,
+	VertexFormat format) {
+	return acquire(makeKey(filename, optimize, format), [&] {
+		return std::unique_ptr<Mesh>(new Mesh(filename, false, optimize, format));
+	});
+}
+
+// Count live meshes
+size_t MeshRegistry::getCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	prune();
+	return entries.size();
+}
+
+// Sum the GPU memory of live meshes
+size_t MeshRegistry::getGpuBytes() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return prune();
+}
+
+// Peak GPU memory of live meshes
+size_t MeshRegistry::getPeakGpuBytes() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return peakBytes;
+}
+
+// Forget released meshes (with the lock held)
+size_t MeshRegistry::prune() {
+	size_t bytes = 0;
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (!it->second.loading && it->second.mesh.expired())
+			it = entries.erase(it);
+		else {
+			bytes += it->second.bytes;
+			++it;
+		}
+	}
+	return bytes;
+}
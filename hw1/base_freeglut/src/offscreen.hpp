@@ -0,0 +1,44 @@
+#ifndef OFFSCREEN_HPP
+#define OFFSCREEN_HPP
+
+#include <string>
+#include <vector>
+#include "gl_core_3_3.h"
+
+// OpenGL 3.3 core context without a window, for machines with no display
+// (and no GPU: Mesa's llvmpipe works). Made with EGL, without any surface if
+// the driver allows it and with a small pbuffer otherwise. Frames are drawn
+// into a framebuffer object of the requested size, which stays bound.
+class OffscreenContext {
+public:
+	OffscreenContext(int width, int height);
+	~OffscreenContext();
+	// Disallow copy, move, & assignment
+	OffscreenContext(const OffscreenContext& other) = delete;
+	OffscreenContext& operator=(const OffscreenContext& other) = delete;
+	OffscreenContext(OffscreenContext&& other) = delete;
+	OffscreenContext& operator=(OffscreenContext&& other) = delete;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	// Renderer in use (GL_RENDERER), e.g. "llvmpipe"
+	std::string getRenderer() const;
+
+	// RGB pixels of the framebuffer, top row first
+	std::vector<unsigned char> readPixels() const;
+	// Write the framebuffer as a binary PPM image
+	void writeImage(const std::string& filename) const;
+
+protected:
+	void release();
+
+	int width, height;		// Size of the framebuffer
+	void* display;			// EGL display, context and surface (if any)
+	void* context;
+	void* surface;
+	GLuint fbo;				// Framebuffer drawn into
+	GLuint colorRb;			// Its color and depth renderbuffers
+	GLuint depthRb;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "parallel.hpp"
+#include <exception>
+
+// Start the worker threads
+ThreadPool::ThreadPool(unsigned int threads) :
+	stopping(false) {
+
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	// The thread calling run() does a share of the work too
+	for (unsigned int i = 1; i < threads; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+// Stop and join the worker threads
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	taskAdded.notify_all();
+	for (auto& w : workers)
+		w.join();
+}
+
+// Pool shared by the whole program
+ThreadPool& ThreadPool::global() {
+	static ThreadPool pool;
+	return pool;
+}
+
+// Run a batch of tasks and wait for them
+void ThreadPool::run(size_t count, const std::function<void(size_t)>& fn) {
+	if (count == 0) return;
+	if (count == 1 || workers.empty()) {
+		for (size_t i = 0; i < count; i++)
+			fn(i);
+		return;
+	}
+
+	Batch batch = { &fn, count, 0, count, nullptr };
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batches.push_back(&batch);
+	}
+	taskAdded.notify_all();
+
+	// Help out until every task in this batch has finished
+	std::unique_lock<std::mutex> lock(mutex);
+	while (batch.remaining > 0) {
+		if (!runOne(batch, lock))
+			taskDone.wait(lock, [&]() { return batch.remaining == 0; });
+	}
+	lock.unlock();
+
+	if (batch.error)
+		std::rethrow_exception(batch.error);
+}
+
+// Worker thread body
+void ThreadPool::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		taskAdded.wait(lock, [this]() { return stopping || !batches.empty(); });
+		if (stopping && batches.empty())
+			return;
+		runOne(*batches.front(), lock);
+	}
+}
+
+// Hand out the next task of a batch and run it with the lock released
+bool ThreadPool::runOne(Batch& batch, std::unique_lock<std::mutex>& lock) {
+	if (batch.next >= batch.count)
+		return false;
+	size_t i = batch.next++;
+	if (batch.next == batch.count)
+		batches.erase(std::find(batches.begin(), batches.end(), &batch));
+	lock.unlock();
+
+	std::exception_ptr error;
+	try {
+		(*batch.fn)(i);
+	} catch (...) {
+		error = std::current_exception();
+	}
+
+	lock.lock();
+	if (error && !batch.error)
+		batch.error = error;
+	if (--batch.remaining == 0)
+		taskDone.notify_all();
+	return true;
+}
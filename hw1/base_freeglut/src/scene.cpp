@@ -3,9 +3,11 @@
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <map>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "scene.hpp"
+#include "util.hpp"
 using namespace std;
 namespace fs = std::filesystem;
 
@@ -22,6 +24,12 @@ void Scene::parseScene() {  // TODO: rewrite
 		istr.open(sceneFile);
 		istr >> nObj;
 
+		// Files listed more than once are loaded once (by the registry) and
+		// drawn instanced. Each filename goes to the registry only the first
+		// time, since identifying a file takes a few system calls.
+		MeshRegistry& registry = MeshRegistry::global();
+		std::map<const Mesh*, uint32_t> loaded;
+		std::map<std::string, uint32_t> named;	// Mesh index of each filename seen
 		while (objects.size() < nObj) {
 			// Skip any lines that don't contain ".obj" (e.g. whitespace)
 			string line;
@@ -31,10 +39,18 @@ void Scene::parseScene() {  // TODO: rewrite
 				found = line.find(".obj");
 			}
 
-			// Load the mesh
+			// Load the mesh, unless an earlier object already did
 			string objFilename = trim(line);
-			auto mesh = std::shared_ptr<Mesh>(new Mesh((modelsDir / objFilename).string()));  // construct the mesh
-			objects.push_back(mesh);  // store the mesh
+			auto name = named.find(objFilename);
+			if (name == named.end()) {
+				auto mesh = registry.acquire((modelsDir / objFilename).string(), meshOptimize, vertexFormat);
+				auto index = loaded.emplace(mesh.get(), (uint32_t)meshes.size()).first;
+				if (index->second == meshes.size())
+					meshes.push_back(mesh);
+				name = named.emplace(objFilename, index->second).first;
+			}
+			meshIndices.push_back(name->second);
+			objects.push_back(meshes[name->second]);  // store the mesh
 
 			// TODO: read the rotation and translation of the mesh
 			
@@ -48,7 +64,7 @@ void Scene::parseScene() {  // TODO: rewrite
 			for (int row = 0; row < 3; row++) {
 				istr >> model[3][row];
 			}
-			(*mesh).setModelMat(model);
+			modelMats.push_back(model);
 		}
 	}
 	catch (const std::exception& e) {
@@ -57,6 +73,42 @@ void Scene::parseScene() {  // TODO: rewrite
 		ss << "Failed to read " << sceneFile << ": " << e.what();
 		throw std::runtime_error(ss.str());
 	}
+	updateBounds();
+
+	size_t meshBytes = 0;
+	for (auto& mesh : meshes)
+		meshBytes += mesh->getGpuBytes();
+	std::cout << "Scene: " << objects.size() << " objects, " << meshes.size() << " meshes, "
+		<< meshBytes / 1024 << " KB of mesh buffers (peak " << MeshRegistry::global().getPeakGpuBytes() / 1024
+		<< " KB); peak memory " << getPeakResidentBytes() / (1024 * 1024) << " MB" << std::endl;
+}
+
+// Recompute the world-space bounding boxes from the model matrices
+void Scene::updateBounds() {
+	bounds.resize(objects.size());
+	for (size_t i = 0; i < objects.size(); i++) {
+		auto meshBB = objects[i]->boundingBox();
+		bounds.set(i, meshBB.first, meshBB.second, modelMats[i]);
+	}
+	bvh.build(bounds);
+	bvhStale = false;
+}
+
+// Move an object and its bounding box
+void Scene::setObjectTransform(size_t i, const glm::mat4& model) {
+	modelMats[i] = model;
+	auto meshBB = objects[i]->boundingBox();
+	bounds.set(i, meshBB.first, meshBB.second, model);
+	bvhStale = true;
+}
+
+// Refit the hierarchy to moved objects before handing it out
+const Bvh& Scene::getBvh() {
+	if (bvhStale) {
+		bvh.refit(bounds);
+		bvhStale = false;
+	}
+	return bvh;
 }
 
 void Scene::printMat3(const glm::mat3 mat) {
@@ -7,15 +7,34 @@
 #include <iostream>
 #include <glm/glm.hpp>
 #include "mesh.hpp"
+#include "meshregistry.hpp"
+#include "culling.hpp"
+#include "bvh.hpp"
 #include "gl_core_3_3.h"
 
 class Scene {
 public:
 	// ctor and dtor:
-	Scene() { parseScene(); }
+	// optimize is a combination of MeshOptimize flags for the loaded objects,
+	// format the layout of their vertex buffers
+	Scene(unsigned int optimize = MESHOPT_ALL, VertexFormat format = VERTEXFORMAT_QUANTIZED) :
+		meshOptimize(optimize), vertexFormat(format), bvhStale(false) { parseScene(); }
 	~Scene() { objects.clear(); }
 	// access:
-	inline std::vector<std::shared_ptr<Mesh>>& getSceneObjects() { return objects; }
+	// Mesh of each object; objects loaded from the same file share one
+	inline std::vector<MeshRegistry::Handle>& getSceneObjects() { return objects; }
+	// Model matrix of each object, in the same order
+	inline const std::vector<glm::mat4>& getModelMats() const { return modelMats; }
+	// Distinct meshes, and the index into them of each object's mesh
+	inline const std::vector<MeshRegistry::Handle>& getMeshes() const { return meshes; }
+	inline const std::vector<uint32_t>& getMeshIndices() const { return meshIndices; }
+	// World-space bounding boxes of the objects, in the same order
+	inline const BoxSet& getWorldBounds() const { return bounds; }
+	void updateBounds();  // call after changing model matrices directly; rebuilds the BVH
+	// Move an object; the BVH is refit the next time it is asked for
+	void setObjectTransform(size_t i, const glm::mat4& model);
+	// Hierarchy over getWorldBounds() for frustum, box and ray queries
+	const Bvh& getBvh();
 	// output:
 	static void printMat3(const glm::mat3 mat);
 	static void printMat4(const glm::mat4 mat);
@@ -31,7 +50,15 @@ protected:
 	void parseScene();  // TODO: read ./models/scene.txt to get the rotation & translation matrices of the .obj models
 
 	unsigned int nObj;  // number of objects in the scene
-	std::vector<std::shared_ptr<Mesh>> objects;  // mesh objects in the scene
+	unsigned int meshOptimize;  // optimization passes applied to loaded meshes
+	VertexFormat vertexFormat;  // vertex buffer layout of loaded meshes
+	std::vector<MeshRegistry::Handle> objects;  // mesh objects in the scene
+	std::vector<glm::mat4> modelMats;  // model matrix of each object
+	std::vector<MeshRegistry::Handle> meshes;  // distinct meshes
+	std::vector<uint32_t> meshIndices;  // index into meshes of each object
+	BoxSet bounds;  // world-space bounding boxes of the objects
+	Bvh bvh;  // hierarchy over the bounding boxes
+	bool bvhStale;  // whether objects moved since the BVH was last fit
 };
 
 #endif
@@ -1,5 +1,8 @@
 #version 330
 
+const int NORMALMODE_FACE = 0;			// Flat normals
+const int NORMALMODE_SMOOTH = 1;		// Smooth normals
+
 const int SHADINGMODE_NORMALS = 0;		// Show normals as colors
 const int SHADINGMODE_PHONG = 1;		// Phong shading + illumination
 const int SHADINGMODE_GOURAUD = 2;		// Gouraud shading
@@ -7,75 +10,115 @@ const int SHADINGMODE_GOURAUD = 2;		// Gouraud shading
 const int LIGHTTYPE_POINT = 0;			// Point light
 const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
 
+smooth in vec3 modelPos;	// Interpolated position in model-space
 smooth in vec3 fragPos;		// Interpolated position in world-space
-smooth in vec3 fragNorm;	// Interpolated normal in world-space
+smooth in vec3 fragNorm;	// Interpolated smoothed normal in world-space
 
 out vec3 outCol;	// Final pixel color
 
-// Light information
-struct LightData {
-	bool enabled;	// Whether the light is on
-	int type;		// Type of light (0 = point, 1 = directional)
-	vec3 pos;		// World-space position/direction of light source
-	vec3 color;		// Color of light
-};
+// Enabled lights, two texels each: position (or direction) and type, then
+// color and range (0 = unbounded). The first numGlobalLights reach every
+// fragment; the rest are point lights listed by the clusters they reach.
+uniform samplerBuffer lightData;
+#ifdef NUM_GLOBAL_LIGHTS
+const int numGlobalLights = NUM_GLOBAL_LIGHTS;
+#else
+uniform int numGlobalLights;
+#endif
 
-// Array of lights
-const int MAX_LIGHTS = 8;
-layout (std140) uniform LightBlock {
-	LightData lights [MAX_LIGHTS];
+// Clusters: the view volume cut into screen tiles and exponential depth
+// slices, each with an offset and count into the list of light indices
+uniform usamplerBuffer clusterData;
+uniform usamplerBuffer lightIndices;
+uniform ivec3 clusterDims;		// Clusters along x, y and z
+uniform vec2 tileScale;			// Tiles per pixel along x and y
+uniform vec2 depthRange;		// Near and far plane distances
+uniform float sliceScale;		// Slice = log(depth / near) * sliceScale
+
+// Material of the object
+layout (std140) uniform MaterialBlock {
+	vec3 objColor;		// Object color
+	float ambStr;		// Ambient strength
+	float diffStr;		// Diffuse strength
+	float specStr;		// Specular strength
+	float specExp;		// Specular exponent
 };
 
+// Drawing modes. Programs specialized for a combination of modes get them
+// as constants, so the compiler drops the code of the other modes; the
+// fallback program reads them from uniforms.
+#ifdef NORMAL_MODE
+const int normalMode = NORMAL_MODE;
+#else
+uniform int normalMode;			// Face normals or smooth normals
+#endif
+#ifdef SHADING_MODE
+const int shadingMode = SHADING_MODE;
+#else
 uniform int shadingMode;		// Which shading mode
+#endif
+uniform mat4 modelMat;			// Model-to-world transform matrix
 uniform vec3 camPos;			// World-space camera position
-uniform vec3 objColor;			// Object color
-uniform float ambStr;			// Ambient strength
-uniform float diffStr;			// Diffuse strength
-uniform float specStr;			// Specular strength
-uniform float specExp;			// Specular exponent
+
+// Light reaching the fragment from packed light i (diffuse plus specular)
+vec3 illuminate(int i, vec3 norm, vec3 toCam) {
+	vec4 posType = texelFetch(lightData, 2 * i);
+	vec4 colorRange = texelFetch(lightData, 2 * i + 1);
+	vec3 toLight;
+	float atten = 1.0;
+	if (int(posType.w) == LIGHTTYPE_POINT) {
+		toLight = posType.xyz - fragPos;
+		// Fade out smoothly towards the edge of the range
+		if (colorRange.w > 0.0) {
+			float d = length(toLight) / colorRange.w;
+			float f = clamp(1.0 - d * d * d * d, 0.0, 1.0);
+			atten = f * f;
+		}
+	} else
+		toLight = posType.xyz;
+
+	vec3 diffuse = objColor * diffStr * colorRange.rgb * max(dot(toLight, norm), 0.0);
+	vec3 toRef = reflect(-normalize(toLight), normalize(norm));
+	vec3 specular = specStr * colorRange.rgb * pow(max(dot(toRef, toCam), 0.0), specExp);
+	return atten * (diffuse + specular);
+}
+
+// Cluster containing the fragment
+int findCluster() {
+	// View-space depth from the window-space depth
+	float ndcZ = 2.0 * gl_FragCoord.z - 1.0;
+	float n = depthRange.x, f = depthRange.y;
+	float depth = 2.0 * n * f / (f + n - ndcZ * (f - n));
+	ivec3 cell = ivec3(ivec2(gl_FragCoord.xy * tileScale), int(log(depth / n) * sliceScale));
+	cell = clamp(cell, ivec3(0), clusterDims - 1);
+	return (cell.z * clusterDims.y + cell.y) * clusterDims.x + cell.x;
+}
 
 void main() {
+	// Choose which normals to use. Face normals are not stored per vertex:
+	// the screen-space derivatives of the position span the triangle's plane.
+	vec3 norm = fragNorm;
+	if (normalMode == NORMALMODE_FACE)
+		norm = vec3(modelMat * vec4(normalize(cross(dFdx(modelPos), dFdy(modelPos))), 0.0));
+
 	if (shadingMode == SHADINGMODE_NORMALS)
-		outCol = normalize(fragNorm) * 0.5 + vec3(0.5);
+		outCol = normalize(norm) * 0.5 + vec3(0.5);
 
 	else if (shadingMode == SHADINGMODE_PHONG) {
-		// TODO ====================================================================
-		// Implement Phong illumination
+		vec3 toCam = normalize(camPos - fragPos);
 
 		//Ambient
-		outCol += ambStr * objColor;
-
-		//Diffuse
-		for (int i = 0; i < MAX_LIGHTS; i++) {
-			if (!lights[i].enabled) continue;
-			if (lights[i].type == 0) {
-				//point light
-				vec3 toLight = lights[i].pos - fragPos;
-				outCol += objColor * diffStr * lights[i].color * max(dot(toLight, fragNorm), 0.0);
-			} else {
-				//directional light
-				outCol += objColor * diffStr * lights[i].color * max(dot(lights[i].pos, fragNorm), 0.0);
-			}
-		}
+		outCol = ambStr * objColor;
+
+		//Diffuse and specular, from the lights that reach everywhere...
+		for (int i = 0; i < numGlobalLights; i++)
+			outCol += illuminate(i, norm, toCam);
+
+		// ...and from those whose range reaches this cluster
+		uvec2 list = texelFetch(clusterData, findCluster()).xy;
+		for (uint k = 0u; k < list.y; k++)
+			outCol += illuminate(int(texelFetch(lightIndices, int(list.x + k)).x), norm, toCam);
 
-		//Specular
-		for (int i = 0; i < MAX_LIGHTS; i++) {
-			if (!lights[i].enabled) continue;
-			if (lights[i].type == 0) {
-				//point light
-				vec3 toLight = normalize(lights[i].pos - fragPos);
-				vec3 toCam = normalize(camPos - fragPos);
-				vec3 toRef = reflect(-toLight, normalize(fragNorm));
-				outCol += specStr * lights[i].color * pow(max(dot(toRef, toCam), 0.0), specExp);
-			} else {
-				//directional light
-				vec3 toLight = normalize(lights[i].pos);
-				vec3 toCam = normalize(camPos - fragPos);
-				vec3 toRef = reflect(-toLight, normalize(fragNorm));
-				outCol += specStr * lights[i].color * pow(max(dot(toRef, toCam), 0.0), specExp);
-			
-			}
-		}
 	} else if (shadingMode == SHADINGMODE_GOURAUD) {
 		// TODO (Extra credit) =====================================================
 		// Use Gouraud shading color
@@ -1,9 +1,9 @@
 #version 330
 
-uniform vec3 color;	// Icon color
+flat in vec3 iconColor;	// Icon color
 
 out vec3 outCol;	// Final pixel color
 
 void main() {
-	outCol = color;
+	outCol = iconColor;
 }
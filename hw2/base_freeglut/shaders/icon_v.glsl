@@ -1,10 +1,34 @@
 #version 330
 
-layout(location = 0) in vec2 pos;		// Icon vertex positions
+const int LIGHTTYPE_DIRECTIONAL = 1;	// Directional light
 
-uniform mat4 xform;				// Model-to-clip space transform
+layout(location = 0) in vec2 pointPos;	// Point icon vertex
+layout(location = 1) in vec2 dirPos;	// Directional icon vertex
+// Per instance: the light the icon stands for
+layout(location = 2) in float lightType;
+layout(location = 3) in vec3 lightPos;
+layout(location = 4) in vec3 lightColor;
+
+flat out vec3 iconColor;	// Icon color
+
+uniform mat4 viewProj;			// World-to-clip transform matrix
+uniform vec2 iconScale;			// Icon size in NDC units along x and y
+uniform int vertexCounts[2];	// Vertices of the point and directional icons
 
 void main() {
-	// Transform vertex position
-	gl_Position = xform * vec4(pos, 0.0, 1.0);
+	iconColor = lightColor;
+	int type = int(lightType);
+
+	// Both icons are drawn with as many vertices as the larger one; move
+	// the spare vertices out of the view volume so their lines are clipped
+	if (gl_VertexID >= vertexCounts[type]) {
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		return;
+	}
+	vec2 pos = (type == LIGHTTYPE_DIRECTIONAL) ? dirPos : pointPos;
+
+	// Offset the icon from the light position in NDC space, then return to
+	// clip space by multiplying by W
+	vec4 clipPos = viewProj * vec4(lightPos, 1.0);
+	gl_Position = vec4(clipPos.xy + pos * iconScale * clipPos.w, clipPos.zw);
 }
@@ -0,0 +1,143 @@
+#define NOMINMAX
+#include <cstring>
+#include <glm/gtc/type_ptr.hpp>
+#include "glcache.hpp"
+
+// Cache of the program's OpenGL context
+GLStateCache& GLStateCache::global() {
+	static GLStateCache cache;
+	return cache;
+}
+
+// Switch programs
+void GLStateCache::useProgram(GLuint prog) {
+	if (!issue(prog != program))
+		return;
+	glUseProgram(prog);
+	program = prog;
+	uniforms = prog ? &programUniforms[prog] : nullptr;
+}
+
+// Bind a vertex array object
+void GLStateCache::bindVertexArray(GLuint array) {
+	if (!issue(array != vao))
+		return;
+	glBindVertexArray(array);
+	vao = array;
+}
+
+// Bind a buffer to a target
+void GLStateCache::bindBuffer(GLenum target, GLuint buffer) {
+	GLuint* bound = (target == GL_ARRAY_BUFFER) ? &arrayBuf :
+		(target == GL_UNIFORM_BUFFER) ? &uniformBuf : nullptr;
+	if (!issue(!bound || *bound != buffer))
+		return;
+	glBindBuffer(target, buffer);
+	if (bound)
+		*bound = buffer;
+}
+
+// Bind a buffer to an indexed binding point (which also binds the target)
+void GLStateCache::bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+	bool tracked = (target == GL_UNIFORM_BUFFER);
+	if (tracked && index >= uniformBases.size())
+		uniformBases.resize(index + 1, 0);
+	if (!issue(!tracked || uniformBases[index] != buffer || uniformBuf != buffer))
+		return;
+	glBindBufferBase(target, index, buffer);
+	if (tracked) {
+		uniformBases[index] = buffer;
+		uniformBuf = buffer;
+	}
+}
+
+// Whether a value changes a location of the program in use
+bool GLStateCache::changes(GLint loc, const void* value, size_t size) {
+	if (loc < 0 || !uniforms)
+		return loc >= 0;
+	if ((size_t)loc >= uniforms->size())
+		uniforms->resize(loc + 1, UniformValue{ 0, {} });
+	UniformValue& cached = (*uniforms)[loc];
+	if (cached.size == size && std::memcmp(cached.data, value, size) == 0)
+		return false;
+	cached.size = size;
+	std::memcpy(cached.data, value, size);
+	return true;
+}
+
+// Set an int (or sampler) uniform
+void GLStateCache::uniform(GLint loc, int value) {
+	if (issue(changes(loc, &value, sizeof(value))))
+		glUniform1i(loc, value);
+}
+
+// Set a float uniform
+void GLStateCache::uniform(GLint loc, float value) {
+	if (issue(changes(loc, &value, sizeof(value))))
+		glUniform1f(loc, value);
+}
+
+// Set a vec2 uniform
+void GLStateCache::uniform(GLint loc, const glm::vec2& value) {
+	if (issue(changes(loc, glm::value_ptr(value), sizeof(value))))
+		glUniform2fv(loc, 1, glm::value_ptr(value));
+}
+
+// Set a vec3 uniform
+void GLStateCache::uniform(GLint loc, const glm::vec3& value) {
+	if (issue(changes(loc, glm::value_ptr(value), sizeof(value))))
+		glUniform3fv(loc, 1, glm::value_ptr(value));
+}
+
+// Set a mat4 uniform
+void GLStateCache::uniform(GLint loc, const glm::mat4& value) {
+	if (issue(changes(loc, glm::value_ptr(value), sizeof(value))))
+		glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+// Delete a program; OpenGL keeps one in use until another is chosen
+void GLStateCache::deleteProgram(GLuint prog) {
+	if (!prog) return;
+	glDeleteProgram(prog);
+	if (prog == program) {
+		glUseProgram(0);
+		program = 0;
+		uniforms = nullptr;
+	}
+	programUniforms.erase(prog);
+}
+
+// Delete a vertex array object, which unbinds it
+void GLStateCache::deleteVertexArray(GLuint array) {
+	if (!array) return;
+	glDeleteVertexArrays(1, &array);
+	if (array == vao)
+		vao = 0;
+}
+
+// Delete a buffer, which unbinds it everywhere
+void GLStateCache::deleteBuffer(GLuint buffer) {
+	if (!buffer) return;
+	glDeleteBuffers(1, &buffer);
+	if (buffer == arrayBuf) arrayBuf = 0;
+	if (buffer == uniformBuf) uniformBuf = 0;
+	for (auto& base : uniformBases)
+		if (base == buffer) base = 0;
+}
+
+// Forget everything
+void GLStateCache::invalidate() {
+	program = 0;
+	vao = 0;
+	arrayBuf = 0;
+	uniformBuf = 0;
+	for (auto& base : uniformBases)
+		base = UNKNOWN;
+	programUniforms.clear();
+	uniforms = nullptr;
+	// Make the context match what we now believe
+	glUseProgram(0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
@@ -0,0 +1,82 @@
+#ifndef GLCACHE_HPP
+#define GLCACHE_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+
+// OpenGL calls made and skipped over some period (e.g. a frame)
+struct GLCallStats {
+	size_t issued;		// Calls passed on to OpenGL
+	size_t skipped;		// Calls dropped because they would change nothing
+	GLCallStats() : issued(0), skipped(0) {}
+};
+
+// Remembers what is bound in the OpenGL context, and the uniform values of
+// each program, so that calls which would not change anything never reach
+// the driver. Only works if every bind of the tracked kinds goes through the
+// cache; objects must be deleted through it too, since OpenGL unbinds them.
+// Not thread-safe, like the context it mirrors.
+class GLStateCache {
+public:
+	GLStateCache() : program(0), vao(0), arrayBuf(0), uniformBuf(0), uniforms(nullptr) {}
+	// Disallow copy, move, & assignment
+	GLStateCache(const GLStateCache& other) = delete;
+	GLStateCache& operator=(const GLStateCache& other) = delete;
+	GLStateCache(GLStateCache&& other) = delete;
+	GLStateCache& operator=(GLStateCache&& other) = delete;
+
+	// Cache of the program's OpenGL context
+	static GLStateCache& global();
+
+	// Bindings
+	void useProgram(GLuint prog);
+	void bindVertexArray(GLuint array);
+	void bindBuffer(GLenum target, GLuint buffer);	// Array and uniform buffers are tracked
+	void bindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+	// Uniforms of the program in use; locations of -1 are ignored like in OpenGL
+	void uniform(GLint loc, int value);
+	void uniform(GLint loc, float value);
+	void uniform(GLint loc, const glm::vec2& value);
+	void uniform(GLint loc, const glm::vec3& value);
+	void uniform(GLint loc, const glm::mat4& value);
+
+	// Delete objects, forgetting them if they are bound
+	void deleteProgram(GLuint prog);
+	void deleteVertexArray(GLuint array);
+	void deleteBuffer(GLuint buffer);
+	// Forget everything, e.g. after OpenGL state was changed behind our back
+	void invalidate();
+
+	// Calls since the last resetStats()
+	const GLCallStats& getStats() const { return stats; }
+	void resetStats() { stats = GLCallStats(); }
+
+protected:
+	// Last value uploaded to a uniform location
+	struct UniformValue {
+		size_t size;		// Bytes of data, 0 if unknown
+		float data[16];
+	};
+	typedef std::vector<UniformValue> UniformValues;	// Indexed by location
+	static const GLuint UNKNOWN = ~0u;		// Binding we no longer know
+
+	// Whether a value changes a location (and remember it if so)
+	bool changes(GLint loc, const void* value, size_t size);
+	// Count a call; returns whether it must be issued
+	bool issue(bool needed) { (needed ? stats.issued : stats.skipped)++; return needed; }
+
+	GLuint program;			// Program in use
+	GLuint vao;				// Vertex array bound
+	GLuint arrayBuf;		// Buffer bound to GL_ARRAY_BUFFER
+	GLuint uniformBuf;		// Buffer bound to GL_UNIFORM_BUFFER
+	std::vector<GLuint> uniformBases;	// Buffer bound to each uniform binding point
+	std::unordered_map<GLuint, UniformValues> programUniforms;
+	UniformValues* uniforms;	// Values of the program in use
+	GLCallStats stats;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include "util.hpp"
+#include "glcache.hpp"
 
 // Constructor
 GLState::GLState() :
@@ -14,22 +15,45 @@ GLState::GLState() :
 	fovy(45.0f),
 	camCoords(0.0f, 0.0f, 1.5f),
 	camRotating(false),
-	shader(0),
-	modelMatLoc(0),
-	viewProjMatLoc(0),
+	mesh(nullptr),
+	meshOptimize(MESHOPT_ALL),
+	vertexFormat(VERTEXFORMAT_QUANTIZED),
+	shader(nullptr),
+	materialDirty(true),
+	materialUbo(0) {}
+
+// ShaderProgram constructor
+GLState::ShaderProgram::ShaderProgram() :
+	program(0),
 	normalModeLoc(0),
 	shadingModeLoc(0),
+	modelMatLoc(0),
+	viewProjMatLoc(0),
+	posScaleLoc(0),
+	posOffsetLoc(0),
 	camPosLoc(0),
-	objColorLoc(0),
-	ambStrLoc(0),
-	diffStrLoc(0),
-	specStrLoc(0),
-	specExpLoc(0) {}
+	numGlobalLightsLoc(0),
+	tileScaleLoc(0),
+	depthRangeLoc(0),
+	sliceScaleLoc(0) {}
+
+// MaterialData constructor
+GLState::MaterialData::MaterialData() :
+	objColor(0.0f),
+	ambStr(0.0f),
+	diffStr(0.0f),
+	specStr(0.0f),
+	specExp(0.0f),
+	padding0(0.0f) {}
 
 // Destructor
 GLState::~GLState() {
 	// Release OpenGL resources
-	if (shader)	glDeleteProgram(shader);
+	GLStateCache& gl = GLStateCache::global();
+	for (auto& entry : shaders)
+		gl.deleteProgram(entry.second.program);
+	if (fallbackShader.program) gl.deleteProgram(fallbackShader.program);
+	if (materialUbo) gl.deleteBuffer(materialUbo);
 }
 
 // Called when OpenGL context is created (some time after construction)
@@ -42,13 +66,15 @@ void GLState::initializeGL() {
 
 	// Initialize OpenGL state
 	initShaders();
+	initMaterial();
+	lightClusters.initializeGL();
 
 	// Set drawing state
 	setNormalMode(NORMALMODE_SMOOTH);
 	setShadingMode(SHADINGMODE_PHONG);
 
 	// Create lights
-	lights.resize(Light::MAX_LIGHTS);
+	lights.resize(MIN_LIGHTS);
 
 	// Set initialized state
 	init = true;
@@ -59,14 +85,24 @@ void GLState::paintGL() {
 	// Clear the color and depth buffers
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	// Set shader to draw with
-	glUseProgram(shader);
+	// Count this frame's state changes
+	GLStateCache& gl = GLStateCache::global();
+	lastCallStats = gl.getStats();
+	gl.resetStats();
+
+	// Bring the shader state up to date, and set the program to draw with
+	uploadState();
+	collectShaders();
+	shader = &selectShader();
+	gl.useProgram(shader->program);
+	gl.uniform(shader->normalModeLoc, (int)normalMode);
+	gl.uniform(shader->shadingModeLoc, (int)shadingMode);
 
 	// Construct a transformation matrix for the camera
 	glm::mat4 viewProjMat(1.0f);
 	// Perspective projection
 	float aspect = (float)width / (float)height;
-	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, 0.1f, 100.0f);
+	glm::mat4 proj = glm::perspective(glm::radians(fovy), aspect, Z_NEAR, Z_FAR);
 	// Camera viewpoint
 	glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -camCoords.z));
 	view = glm::rotate(view, glm::radians(camCoords.y), glm::vec3(1.0f, 0.0f, 0.0f));
@@ -81,23 +117,56 @@ void GLState::paintGL() {
 			glm::vec3(1.0f / glm::length(meshBB.second - meshBB.first)));
 		modelMat = glm::translate(modelMat, -(meshBB.first + meshBB.second) / 2.0f);
 		// Upload transform matrices to shader
-		glUniformMatrix4fv(modelMatLoc, 1, GL_FALSE, glm::value_ptr(modelMat));
-		glUniformMatrix4fv(viewProjMatLoc, 1, GL_FALSE, glm::value_ptr(viewProjMat));
+		gl.uniform(shader->modelMatLoc, modelMat);
+		gl.uniform(shader->viewProjMatLoc, viewProjMat);
+		// Upload the mapping from stored to model-space positions
+		const PositionTransform& posXform = mesh->getPositionTransform();
+		gl.uniform(shader->posScaleLoc, posXform.scale);
+		gl.uniform(shader->posOffsetLoc, posXform.offset);
 
 		// Get camera position and upload to shader
 		glm::vec3 camPos = glm::vec3(glm::inverse(view)[3]);
-		glUniform3fv(camPosLoc, 1, glm::value_ptr(camPos));
-
-		// Draw the mesh
-		mesh->draw();
+		gl.uniform(shader->camPosLoc, camPos);
+		if (shadingMode != SHADINGMODE_NORMALS)
+			bindLights(view, proj);
+
+		// Draw the coarsest level of detail that looks the same from here:
+		// the mesh has a unit diagonal, and its nearest point is about half
+		// of that closer than its center
+		float pixelsPerUnit = height / (2.0f * glm::tan(glm::radians(fovy) / 2.0f));
+		float diagonalPixels = pixelsPerUnit / glm::max(camCoords.z - 0.5f, 0.1f);
+		mesh->draw(selectLod(mesh->getLods(), diagonalPixels));
 	}
 
-	glUseProgram(0);
-
 	// Draw enabled light icons (if in lighting mode)
 	if (shadingMode != SHADINGMODE_NORMALS)
-		for (auto& l : lights)
-			if (l.getEnabled()) l.drawIcon(viewProjMat);
+		Light::drawIcons(viewProjMat);
+}
+
+// Bin the lights for this view and point the shader at them
+void GLState::bindLights(const glm::mat4& view, const glm::mat4& proj) {
+	lightClusters.build(Light::getPackedLights(), Light::getGlobalCount(), view, proj, Z_NEAR, Z_FAR);
+	lightClusters.upload();
+
+	GLStateCache& gl = GLStateCache::global();
+	gl.uniform(shader->numGlobalLightsLoc, (int)Light::getGlobalCount());
+	gl.uniform(shader->tileScaleLoc, glm::vec2((float)LightClusters::DIM_X / width,
+		(float)LightClusters::DIM_Y / height));
+	gl.uniform(shader->depthRangeLoc, glm::vec2(Z_NEAR, Z_FAR));
+	gl.uniform(shader->sliceScaleLoc, lightClusters.getSliceScale());
+
+	glActiveTexture(GL_TEXTURE0 + LIGHT_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, Light::getLightTexture());
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, lightClusters.getClusterTexture());
+	glActiveTexture(GL_TEXTURE0 + INDEX_TEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, lightClusters.getIndexTexture());
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Keep count lights; new ones start disabled
+void GLState::setNumLights(unsigned int count) {
+	lights.resize(count);
 }
 
 // Called when window is resized
@@ -108,99 +177,56 @@ void GLState::resizeGL(int w, int h) {
 	glViewport(0, 0, w, h);
 }
 
-// Set the normal mode (face or smooth)
+// Set the normal mode (face or smooth); the next frame switches programs
 void GLState::setNormalMode(NormalMode nm) {
 	normalMode = nm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(normalModeLoc, (int)normalMode);
-	glUseProgram(0);
 }
 
-// Set the shading mode (normals or lighting)
+// Set the shading mode (normals or lighting); the next frame switches programs
 void GLState::setShadingMode(ShadingMode sm) {
 	shadingMode = sm;
-
-	// Update mode in shader
-	glUseProgram(shader);
-	glUniform1i(shadingModeLoc, (int)shadingMode);
-	glUseProgram(0);
-}
-
-// Get object color
-glm::vec3 GLState::getObjectColor() const {
-	glm::vec3 objColor;
-	glGetUniformfv(shader, objColorLoc, glm::value_ptr(objColor));
-	return objColor;
-}
-
-// Get ambient strength
-float GLState::getAmbientStrength() const {
-	float ambStr;
-	glGetUniformfv(shader, ambStrLoc, &ambStr);
-	return ambStr;
-}
-
-// Get diffuse strength
-float GLState::getDiffuseStrength() const {
-	float diffStr;
-	glGetUniformfv(shader, diffStrLoc, &diffStr);
-	return diffStr;
-}
-
-// Get specular strength
-float GLState::getSpecularStrength() const {
-	float specStr;
-	glGetUniformfv(shader, specStrLoc, &specStr);
-	return specStr;
-}
-
-// Get specular exponent
-float GLState::getSpecularExponent() const {
-	float specExp;
-	glGetUniformfv(shader, specExpLoc, &specExp);
-	return specExp;
 }
 
 // Set object color
 void GLState::setObjectColor(glm::vec3 color) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform3fv(objColorLoc, 1, glm::value_ptr(color));
-	glUseProgram(0);
+	material.objColor = color;
+	materialDirty = true;
 }
 
 // Set ambient strength
 void GLState::setAmbientStrength(float ambStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(ambStrLoc, ambStr);
-	glUseProgram(0);
+	material.ambStr = ambStr;
+	materialDirty = true;
 }
 
 // Set diffuse strength
 void GLState::setDiffuseStrength(float diffStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(diffStrLoc, diffStr);
-	glUseProgram(0);
+	material.diffStr = diffStr;
+	materialDirty = true;
 }
 
 // Set specular strength
 void GLState::setSpecularStrength(float specStr) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(specStrLoc, specStr);
-	glUseProgram(0);
+	material.specStr = specStr;
+	materialDirty = true;
 }
 
 // Set specular exponent
 void GLState::setSpecularExponent(float specExp) {
-	// Update value in shader
-	glUseProgram(shader);
-	glUniform1f(specExpLoc, specExp);
-	glUseProgram(0);
+	material.specExp = specExp;
+	materialDirty = true;
+}
+
+// Upload the material and lights, each in one upload however many of their
+// fields changed
+void GLState::uploadState() {
+	GLStateCache& gl = GLStateCache::global();
+	if (materialDirty) {
+		gl.bindBuffer(GL_UNIFORM_BUFFER, materialUbo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(MaterialData), &material);
+		materialDirty = false;
+	}
+	Light::flushLights();
 }
 
 // Start rotating the camera (click + drag)
@@ -238,42 +264,186 @@ void GLState::offsetCamera(float offset) {
 
 // Display a given .obj file
 void GLState::showObjFile(const std::string& filename) {
-	// Load the .obj file if it's not already loaded
-	if (!mesh || meshFilename != filename) {
-		mesh = std::unique_ptr<Mesh>(new Mesh(filename));
+	// Nothing to do if the file is already shown or on its way
+	if (filename == requestedFilename && (mesh || meshLoader.busy()))
+		return;
+	requestedFilename = filename;
+
+	// Show the file right away if it's still on the GPU
+	if (MeshRegistry::Handle resident = meshes.find(filename, meshOptimize, vertexFormat)) {
+		meshLoader.cancel();
+		mesh = resident;
 		meshFilename = filename;
+		return;
 	}
+	meshLoader.request(filename, false, meshOptimize, vertexFormat);
 }
 
-// Create shaders and associated state
+// Load files in the background ahead of time
+void GLState::prefetchObjFiles(const std::vector<std::string>& filenames) {
+	std::vector<std::string> missing;
+	for (auto& filename : filenames)
+		if (!meshes.contains(filename, meshOptimize, vertexFormat))
+			missing.push_back(filename);
+	meshLoader.prefetch(missing, meshOptimize, vertexFormat);
+}
+
+// Swap in the object from the background load once it's ready
+bool GLState::update() {
+	std::unique_ptr<Mesh::Prepared> data;
+	try {
+		data = meshLoader.poll();
+	} catch (const std::exception&) {
+		// Keep showing the previous object
+		requestedFilename = meshFilename;
+		throw;
+	}
+	if (!data)
+		return false;
+
+	// Upload on this thread, which owns the OpenGL context, unless the file
+	// is already on the GPU (e.g. shown earlier under another path spelling)
+	MeshRegistry::Key key = { data->sourcePath, data->sourceHash, data->optimize, data->format };
+	mesh = meshes.insert(data->filename, data->optimize, data->format,
+		MeshRegistry::global().acquire(key, [&] { return std::unique_ptr<Mesh>(new Mesh(*data)); }));
+	meshFilename = data->filename;
+	return true;
+}
+
+// Stages of the object shader
+static std::vector<ShaderStage> objectShaderStages() {
+	return { { GL_VERTEX_SHADER, "shaders/v.glsl" }, { GL_FRAGMENT_SHADER, "shaders/f.glsl" } };
+}
+
+// Key of the program specialized for a combination of modes and global lights
+static unsigned int shaderKey(int shadingMode, int normalMode, unsigned int numGlobalLights) {
+	return (shadingMode * 2 + normalMode) * (GLState::MAX_SPECIALIZED_LIGHTS + 2) + numGlobalLights;
+}
+
+// Build the fallback program, which draws in any mode, and queue the
+// programs specialized for every combination of modes and global lights.
+// Drivers that build in the background start on all of them at once; on
+// others, building one is as slow as waiting for it, so collectShaders
+// starts them one per frame instead.
 void GLState::initShaders() {
-	// Compile and link shader files
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
-
-	// Get uniform locations
-	modelMatLoc = glGetUniformLocation(shader, "modelMat");
-	viewProjMatLoc = glGetUniformLocation(shader, "viewProjMat");
-	normalModeLoc = glGetUniformLocation(shader, "normalMode");
-	shadingModeLoc = glGetUniformLocation(shader, "shadingMode");
-	camPosLoc = glGetUniformLocation(shader, "camPos");
-	objColorLoc = glGetUniformLocation(shader, "objColor");
-	ambStrLoc = glGetUniformLocation(shader, "ambStr");
-	diffStrLoc = glGetUniformLocation(shader, "diffStr");
-	specStrLoc = glGetUniformLocation(shader, "specStr");
-	specExpLoc = glGetUniformLocation(shader, "specExp");
-
-	// Bind lights uniform block to binding index
-	glUseProgram(shader);
-	GLuint lightBlockIndex = glGetUniformBlockIndex(shader, "LightBlock");
-	glUniformBlockBinding(shader, lightBlockIndex, Light::BIND_PT);
-	glUseProgram(0);
+	fallbackShader = makeShaderProgram(buildProgram(objectShaderStages()));
+	shader = &fallbackShader;
+
+	// Only lit programs loop over the global lights. Past the specialized
+	// counts, one program reads the count from a uniform.
+	bool parallel = ProgramBatch::isParallel();
+	for (int sm = SHADINGMODE_NORMALS; sm <= SHADINGMODE_GOURAUD; sm++) {
+		for (int nm = NORMALMODE_FACE; nm <= NORMALMODE_SMOOTH; nm++) {
+			unsigned int maxLights = (sm == SHADINGMODE_NORMALS) ? 0 : MAX_SPECIALIZED_LIGHTS + 1;
+			for (unsigned int n = 0; n <= maxLights; n++) {
+				std::vector<std::string> defines;
+				defines.push_back("NORMAL_MODE " + std::to_string(nm));
+				defines.push_back("SHADING_MODE " + std::to_string(sm));
+				if (sm != SHADINGMODE_NORMALS && n <= MAX_SPECIALIZED_LIGHTS)
+					defines.push_back("NUM_GLOBAL_LIGHTS " + std::to_string(n));
+				if (parallel)
+					pendingShaders[shaderKey(sm, nm, n)] = shaderBatch.add(objectShaderStages(), defines);
+				else
+					unbuiltShaders[shaderKey(sm, nm, n)] = defines;
+			}
+		}
+	}
+	shaderBatch.submit();
+}
+
+// Take the specialized programs that finished building. If the driver only
+// builds a program when asked for its status, take one per frame so that
+// no frame waits for more than one, and only then start the next, preferring
+// the one the current modes need.
+void GLState::collectShaders() {
+	size_t budget = ProgramBatch::isParallel() ? pendingShaders.size() : 1;
+	for (auto it = pendingShaders.begin(); it != pendingShaders.end() && budget > 0;) {
+		if (shaderBatch.isReady(it->second)) {
+			shaders[it->first] = makeShaderProgram(shaderBatch.take(it->second));
+			it = pendingShaders.erase(it);
+			budget--;
+		} else
+			++it;
+	}
+
+	if (pendingShaders.empty() && !unbuiltShaders.empty()) {
+		auto next = unbuiltShaders.find(currentShaderKey());
+		if (next == unbuiltShaders.end())
+			next = unbuiltShaders.begin();
+		pendingShaders[next->first] = shaderBatch.add(objectShaderStages(), next->second);
+		unbuiltShaders.erase(next);
+		shaderBatch.submit();
+	}
+}
+
+// Key of the program specialized for the current drawing modes and number
+// of global lights
+unsigned int GLState::currentShaderKey() const {
+	unsigned int numGlobalLights = 0;
+	if (shadingMode != SHADINGMODE_NORMALS)
+		numGlobalLights = glm::min((unsigned int)Light::getGlobalCount(), MAX_SPECIALIZED_LIGHTS + 1);
+	return shaderKey(shadingMode, normalMode, numGlobalLights);
+}
+
+// Program specialized for the current drawing modes and number of global
+// lights, or the fallback program if that one isn't built yet
+GLState::ShaderProgram& GLState::selectShader() {
+	unsigned int key = currentShaderKey();
+	auto found = shaders.find(key);
+	if (found != shaders.end())
+		return found->second;
+
+	auto pending = pendingShaders.find(key);
+	if (pending != pendingShaders.end() && shaderBatch.isReady(pending->second)) {
+		ShaderProgram& sp = shaders[key] = makeShaderProgram(shaderBatch.take(pending->second));
+		pendingShaders.erase(pending);
+		return sp;
+	}
+	return fallbackShader;
+}
+
+// Get the uniform locations of a program and set its fixed uniforms
+GLState::ShaderProgram GLState::makeShaderProgram(GLuint program) {
+	ShaderProgram sp;
+	sp.program = program;
+
+	// Get uniform locations (uniforms a combination doesn't use are -1)
+	sp.normalModeLoc = glGetUniformLocation(sp.program, "normalMode");
+	sp.shadingModeLoc = glGetUniformLocation(sp.program, "shadingMode");
+	sp.modelMatLoc = glGetUniformLocation(sp.program, "modelMat");
+	sp.viewProjMatLoc = glGetUniformLocation(sp.program, "viewProjMat");
+	sp.posScaleLoc = glGetUniformLocation(sp.program, "posScale");
+	sp.posOffsetLoc = glGetUniformLocation(sp.program, "posOffset");
+	sp.camPosLoc = glGetUniformLocation(sp.program, "camPos");
+	sp.numGlobalLightsLoc = glGetUniformLocation(sp.program, "numGlobalLights");
+	sp.tileScaleLoc = glGetUniformLocation(sp.program, "tileScale");
+	sp.depthRangeLoc = glGetUniformLocation(sp.program, "depthRange");
+	sp.sliceScaleLoc = glGetUniformLocation(sp.program, "sliceScale");
+
+	// Bind material uniform block to binding index
+	GLuint materialBlockIndex = glGetUniformBlockIndex(sp.program, "MaterialBlock");
+	if (materialBlockIndex != GL_INVALID_INDEX)
+		glUniformBlockBinding(sp.program, materialBlockIndex, MATERIAL_BIND_PT);
+
+	// Light and cluster buffer textures, and the cluster grid
+	GLStateCache& gl = GLStateCache::global();
+	gl.useProgram(sp.program);
+	gl.uniform(glGetUniformLocation(sp.program, "lightData"), LIGHT_TEX_UNIT);
+	gl.uniform(glGetUniformLocation(sp.program, "clusterData"), CLUSTER_TEX_UNIT);
+	gl.uniform(glGetUniformLocation(sp.program, "lightIndices"), INDEX_TEX_UNIT);
+	glUniform3i(glGetUniformLocation(sp.program, "clusterDims"),
+		LightClusters::DIM_X, LightClusters::DIM_Y, LightClusters::DIM_Z);
+	return sp;
+}
+
+// Create the material uniform buffer
+void GLState::initMaterial() {
+	GLStateCache& gl = GLStateCache::global();
+	glGenBuffers(1, &materialUbo);
+	gl.bindBuffer(GL_UNIFORM_BUFFER, materialUbo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialData), &material, GL_DYNAMIC_DRAW);
+	gl.bindBufferBase(GL_UNIFORM_BUFFER, MATERIAL_BIND_PT, materialUbo);
+	materialDirty = false;
 }
 
 
@@ -353,9 +523,11 @@ void GLState::readConfig(std::string filename) {
 		ss >> numLights;
 		if (numLights == 0)
 			throw std::runtime_error("Must have at least 1 light");
-		if (numLights >= Light::MAX_LIGHTS)
+		if (numLights > Light::MAX_LIGHTS)
 			throw std::runtime_error("Cannot create more than "
 				+ std::to_string(Light::MAX_LIGHTS) + " lights");
+		if (numLights > lights.size())
+			lights.resize(numLights);
 
 		for (unsigned int i = 0; i < lights.size(); i++) {
 			// Read properties of each light
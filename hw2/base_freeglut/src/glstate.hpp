@@ -3,11 +3,17 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <memory>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
 #include "mesh.hpp"
+#include "meshloader.hpp"
+#include "meshresidency.hpp"
 #include "light.hpp"
+#include "glcache.hpp"
+#include "lightclusters.hpp"
+#include "util.hpp"
 
 // Manages OpenGL state, e.g. camera transform, objects, shaders
 class GLState {
@@ -44,13 +50,26 @@ public:
 	ShadingMode getShadingMode() const { return shadingMode; }
 	void setNormalMode(NormalMode nm);
 	void setShadingMode(ShadingMode sm);
-
-	// Object properties
-	float getAmbientStrength() const;
-	float getDiffuseStrength() const;
-	float getSpecularStrength() const;
-	float getSpecularExponent() const;
-	glm::vec3 getObjectColor() const;
+	// Specialized shader programs built so far, and still to build
+	size_t getNumShaderPrograms() const { return shaders.size(); }
+	size_t getNumPendingShaders() const { return pendingShaders.size() + unbuiltShaders.size(); }
+
+	static const int MATERIAL_BIND_PT = 1;	// Binding index of the material block
+	static const unsigned int MIN_LIGHTS = 8;	// Lights created up front (number keys select them)
+	// Most global lights a program is specialized for; beyond that, programs
+	// read the count from a uniform
+	static const unsigned int MAX_SPECIALIZED_LIGHTS = 8;
+	// Texture units of the light and cluster buffer textures
+	static const int LIGHT_TEX_UNIT = 0;
+	static const int CLUSTER_TEX_UNIT = 1;
+	static const int INDEX_TEX_UNIT = 2;
+
+	// Object properties (kept here and uploaded by the next paintGL)
+	float getAmbientStrength() const { return material.ambStr; }
+	float getDiffuseStrength() const { return material.diffStr; }
+	float getSpecularStrength() const { return material.specStr; }
+	float getSpecularExponent() const { return material.specExp; }
+	glm::vec3 getObjectColor() const { return material.objColor; }
 	void setAmbientStrength(float ambStr);
 	void setDiffuseStrength(float diffStr);
 	void setSpecularStrength(float specStr);
@@ -62,6 +81,9 @@ public:
 	unsigned int getNumLights() const { return (unsigned int)lights.size(); }
 	Light& getLight(int index) { return lights.at(index); }
 	const Light& getLight(int index) const { return lights[index]; }
+	void setNumLights(unsigned int count);
+	// Light binning work of the last frame
+	const ClusterStats& getClusterStats() const { return lightClusters.getStats(); }
 
 	// Camera control
 	bool isCamRotating() const { return camRotating; }
@@ -70,14 +92,42 @@ public:
 	void rotateCamera(glm::vec2 mousePos);
 	void offsetCamera(float offset);
 
-	// Set object to display
+	// Set object to display. The file is loaded in the background; the
+	// previous object stays on screen until update() swaps the new one in.
 	void showObjFile(const std::string& filename);
+	// Finish a background load if it's ready (call every frame). Returns
+	// true if the object changed; rethrows the error if loading failed.
+	bool update();
+	bool isLoading() const { return meshLoader.busy(); }
+	// Load these files in the background ahead of time (e.g. the menu
+	// entries next to the shown one); files already on the GPU are skipped
+	void prefetchObjFiles(const std::vector<std::string>& filenames);
+	// GPU memory that objects no longer shown may keep using
+	size_t getMeshBudget() const { return meshes.getBudget(); }
+	void setMeshBudget(size_t bytes) { meshes.setBudget(bytes); }
+	// Mesh optimization passes (MeshOptimize flags) applied to loaded objects
+	unsigned int getMeshOptimize() const { return meshOptimize; }
+	void setMeshOptimize(unsigned int passes) { meshOptimize = passes; }
+	// Vertex buffer layout of loaded objects
+	VertexFormat getVertexFormat() const { return vertexFormat; }
+	void setVertexFormat(VertexFormat format) { vertexFormat = format; }
+	// OpenGL calls issued and skipped by the state cache over the last frame
+	const GLCallStats& getGLCallStats() const { return lastCallStats; }
 
 protected:
 	bool init;						// Whether we've been initialized yet
 
 	// Initialization
 	void initShaders();
+	struct ShaderProgram;
+	ShaderProgram makeShaderProgram(GLuint program);	// Look up locations, set samplers
+	unsigned int currentShaderKey() const;	// Specialization for the current modes and lights
+	ShaderProgram& selectShader();	// Program for the current modes and lights
+	void collectShaders();			// Take programs that finished building, start the next
+	void initMaterial();
+	void bindLights(const glm::mat4& view, const glm::mat4& proj);
+	// Upload the state the setters changed since the last frame
+	void uploadState();
 
 	// Drawing modes
 	NormalMode normalMode;
@@ -86,6 +136,8 @@ protected:
 	// Camera state
 	int width, height;		// Width and height of the window
 	float fovy;				// Vertical field of view in degrees
+	static constexpr float Z_NEAR = 0.1f;	// Near and far plane distances
+	static constexpr float Z_FAR = 100.0f;
 	glm::vec3 camCoords;	// Camera spherical coordinates
 	bool camRotating;		// Whether camera is currently rotating
 	glm::vec2 initCamRot;	// Initial camera rotation on click
@@ -93,21 +145,55 @@ protected:
 
 	// Mesh and lights
 	std::string meshFilename;		// Name of the obj file being shown
-	std::unique_ptr<Mesh> mesh;		// Pointer to mesh object
+	std::string requestedFilename;	// Name of the obj file last asked for
+	MeshRegistry::Handle mesh;		// Mesh being shown
+	MeshResidency meshes;			// Recently shown meshes kept on the GPU
+	MeshLoader meshLoader;			// Loads obj files in the background
+	unsigned int meshOptimize;		// Optimization passes for loaded meshes
+	VertexFormat vertexFormat;		// Vertex buffer layout of loaded meshes
 	std::vector<Light> lights;		// Lights
-
-	// Shader state
-	GLuint shader;			// GPU shader program
-	GLuint modelMatLoc;		// Model-to-world matrix location
-	GLuint viewProjMatLoc;	// World-to-clip matrix location
-	GLuint normalModeLoc;	// Normal mode location
-	GLuint shadingModeLoc;	// Shading mode location
-	GLuint camPosLoc;		// Camera position location
-	GLuint objColorLoc;		// Object color
-	GLuint ambStrLoc;		// Ambient strength location
-	GLuint diffStrLoc;		// Diffuse strength location
-	GLuint specStrLoc;		// Specular strength location
-	GLuint specExpLoc;		// Specular exponent location
+	LightClusters lightClusters;	// Lights with a range, binned for the current view
+
+	// Shader state. The shaders are specialized at compile time for the
+	// drawing modes and the number of global lights. Programs for every
+	// combination are built in the background from startup; until the one
+	// needed is ready, the fallback program (which reads the modes from
+	// uniforms) draws instead.
+	struct ShaderProgram {
+		ShaderProgram();
+		GLuint program;			// GPU shader program
+		GLuint normalModeLoc;	// Normal mode location (fallback only)
+		GLuint shadingModeLoc;	// Shading mode location (fallback only)
+		GLuint modelMatLoc;		// Model-to-world matrix location
+		GLuint viewProjMatLoc;	// World-to-clip matrix location
+		GLuint posScaleLoc;		// Position dequantization scale location
+		GLuint posOffsetLoc;	// Position dequantization offset location
+		GLuint camPosLoc;		// Camera position location
+		GLuint numGlobalLightsLoc;	// Number of lights without a range location
+		GLuint tileScaleLoc;	// Cluster tiles per pixel location
+		GLuint depthRangeLoc;	// Near and far plane location
+		GLuint sliceScaleLoc;	// Cluster depth slice scale location
+	};
+	std::map<unsigned int, ShaderProgram> shaders;	// Built programs by specialization key
+	std::map<unsigned int, size_t> pendingShaders;	// Programs still building (ids in shaderBatch)
+	std::map<unsigned int, std::vector<std::string>> unbuiltShaders;	// Definitions of programs not started yet
+	ProgramBatch shaderBatch;		// Builds the specialized programs
+	ShaderProgram fallbackShader;	// Handles any combination
+	ShaderProgram* shader;			// Program of the current frame
+
+	// Material properties, arranged for UBO storage (std140 layout)
+	struct MaterialData {
+		MaterialData();
+		glm::vec3 objColor;	// Object color
+		float ambStr;		// Ambient strength
+		float diffStr;		// Diffuse strength
+		float specStr;		// Specular strength
+		float specExp;		// Specular exponent
+		float padding0;
+	} material;
+	bool materialDirty;		// Whether material changed since the last upload
+	GLuint materialUbo;		// Uniform buffer holding the material
+	GLCallStats lastCallStats;	// State changes of the last frame
 };
 
 #endif
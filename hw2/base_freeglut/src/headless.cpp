@@ -0,0 +1,111 @@
+// Renders the viewer without a window, for machines with no display (build
+// and batch hosts; Mesa's llvmpipe stands in for a GPU). Reads a config file
+// like the viewer, draws it into an offscreen framebuffer and writes the
+// final frame as a PPM image; with more than one frame it also times them.
+//
+// Usage: headless [config.txt] [options]
+//   -o file.ppm     Image to write (default: headless.ppm)
+//   -s WxH          Image size (default: 800x600)
+//   -f frames       Frames to draw and time (default: 1)
+//   -obj file.obj   Object to show instead of the config's
+//   -flat           Flat normals
+//   -gouraud        Gouraud shading (default: Phong)
+//   -normals        Show normals as colors
+#define NOMINMAX
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+#include "offscreen.hpp"
+#include "glstate.hpp"
+
+// Value of an option that takes one
+std::string optionValue(int argc, char** argv, int& i) {
+	if (i + 1 >= argc)
+		throw std::runtime_error(std::string("Missing value for ") + argv[i]);
+	return argv[++i];
+}
+
+int main(int argc, char** argv) {
+	std::string configFile = "config.txt";
+	std::string imageFile = "headless.ppm";
+	std::string objFile;
+	int width = 800, height = 600;
+	int frames = 1;
+	GLState::NormalMode normalMode = GLState::NORMALMODE_SMOOTH;
+	GLState::ShadingMode shadingMode = GLState::SHADINGMODE_PHONG;
+
+	try {
+		// Read the options
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "-o")
+				imageFile = optionValue(argc, argv, i);
+			else if (arg == "-s") {
+				std::string size = optionValue(argc, argv, i);
+				if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2)
+					throw std::runtime_error("Image size must look like 800x600, not " + size);
+			} else if (arg == "-f")
+				frames = std::max(1, std::stoi(optionValue(argc, argv, i)));
+			else if (arg == "-obj")
+				objFile = optionValue(argc, argv, i);
+			else if (arg == "-flat")
+				normalMode = GLState::NORMALMODE_FACE;
+			else if (arg == "-gouraud")
+				shadingMode = GLState::SHADINGMODE_GOURAUD;
+			else if (arg == "-normals")
+				shadingMode = GLState::SHADINGMODE_NORMALS;
+			else if (!arg.empty() && arg[0] == '-')
+				throw std::runtime_error("Unknown option " + arg);
+			else
+				configFile = arg;
+		}
+
+		// Create the context first so that it outlives the OpenGL state
+		OffscreenContext context(width, height);
+		std::cout << "Rendering " << width << "x" << height << " with " << context.getRenderer() << std::endl;
+
+		auto glState = std::unique_ptr<GLState>(new GLState());
+		glState->initializeGL();
+		glState->resizeGL(width, height);
+		glState->readConfig(configFile);
+		if (!objFile.empty())
+			glState->showObjFile(objFile);
+		glState->setNormalMode(normalMode);
+		glState->setShadingMode(shadingMode);
+
+		// Wait for the object to load and the shaders to build, so the frames
+		// are timed as the viewer draws them once it has settled
+		while (glState->isLoading()) {
+			glState->update();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		do {
+			glState->paintGL();
+			glFinish();
+		} while (glState->getNumPendingShaders() > 0);
+
+		// Draw and time the frames
+		auto start = std::chrono::steady_clock::now();
+		for (int f = 0; f < frames; f++)
+			glState->paintGL();
+		glFinish();
+		double frameMs = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count() / frames;
+		if (frames > 1)
+			std::cout << "Drew " << frames << " frames in " << frameMs << " ms each" << std::endl;
+
+		context.writeImage(imageFile);
+		std::cout << "Wrote " << imageFile << std::endl;
+		glState.reset();
+
+	} catch (const std::exception& e) {
+		std::cerr << "Fatal error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
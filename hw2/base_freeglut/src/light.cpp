@@ -1,22 +1,30 @@
 #define NOMINMAX
 #include <vector>
+#include <cstddef>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "light.hpp"
 #include "util.hpp"
+#include "glcache.hpp"
 #include <iostream>
 
 // Static Light members (OpenGL state)
 unsigned int Light::refcount = 0;
-std::array<bool, Light::MAX_LIGHTS> Light::enabledLights;
-GLuint Light::ubo = 0;
+std::vector<bool> Light::enabledLights;
+std::vector<Light::LightData> Light::shadowLights;
+int Light::freeHint = 0;
+bool Light::lightsDirty = false;
+std::vector<Light::Packed> Light::packedLights;
+size_t Light::globalCount = 0;
+GLuint Light::lightBuf = 0;
+GLuint Light::lightTex = 0;
 GLuint Light::shader = 0;
 GLuint Light::vao = 0;
 GLuint Light::vbuf = 0;
 GLuint Light::vcountPoint = 0;
 GLuint Light::vcountDir = 0;
-GLuint Light::xformLoc = 0;
-GLuint Light::colorLoc = 0;
+GLuint Light::viewProjLoc = 0;
+GLuint Light::iconScaleLoc = 0;
 float Light::iconScale = 0.06f;
 
 // LightData constructor
@@ -24,7 +32,8 @@ Light::LightData::LightData() :
 	enabled(false),
 	type((int)POINT),
 	pos(0.0, 2.0, 0.0),
-	color(1.0, 1.0, 1.0) {}
+	color(1.0, 1.0, 1.0),
+	range(0.0f) {}
 
 // Constructor
 Light::Light() :
@@ -38,7 +47,7 @@ Light::Light() :
 
 // Destructor
 Light::~Light() {
-	// Disable the light (updates UBO)
+	// Disable the light (updates the shadow array)
 	setEnabled(false);
 
 	refcount--;
@@ -84,13 +93,14 @@ void Light::setEnabled(bool enabled) {
 	}
 
 	data.enabled = enabled;
-	// Update UBO
+	// Update shadow array
 	if (index >= 0)
-		updateUBO();
+		updateShadow();
 
 	// Relinquish index if disabled
 	if (!enabled && index >= 0) {
 		enabledLights[index] = false;
+		freeHint = glm::min(freeHint, index);
 		index = -1;
 	}
 }
@@ -99,25 +109,34 @@ void Light::setEnabled(bool enabled) {
 void Light::setType(LightType type) {
 	data.type = type;
 
-	// Update UBO
+	// Update shadow array
 	if (data.enabled && index >= 0)
-		updateUBO();
+		updateShadow();
 }
 
 void Light::setPos(glm::vec3 pos) {
 	data.pos = pos;
 
-	// Update UBO
+	// Update shadow array
 	if (data.enabled && index >= 0)
-		updateUBO();
+		updateShadow();
 }
 
 void Light::setColor(glm::vec3 color) {
 	data.color = color;
 
-	// Update UBO
+	// Update shadow array
 	if (data.enabled && index >= 0)
-		updateUBO();
+		updateShadow();
+}
+
+// Limit a point light to a sphere, so that it only shades what's nearby
+void Light::setRange(float range) {
+	data.range = glm::max(range, 0.0f);
+
+	// Update shadow array
+	if (data.enabled && index >= 0)
+		updateShadow();
 }
 
 // Set initial rotation state
@@ -169,107 +188,129 @@ void Light::offsetLight(float offset) {
 	setPos(newPos);
 }
 
-void Light::drawIcon(glm::mat4 viewProj) const {
-	glUseProgram(shader);
+// Draw the icons of the packed lights, one instance each
+void Light::drawIcons(glm::mat4 viewProj) {
+	flushLights();
+	if (packedLights.empty()) return;
 
-	// Get light position in NDC space
-	glm::vec4 clipPos = viewProj * glm::vec4(data.pos, 1.0f);
-	glm::vec4 ndcPos = clipPos / clipPos.w;
-	// Transform icon from NDC space to clip space
+	GLStateCache& gl = GLStateCache::global();
+	gl.useProgram(shader);
+	gl.uniform(viewProjLoc, viewProj);
+	// Keep icons square on screen
 	float aspect = glm::length(glm::vec3(glm::transpose(viewProj)[1])) /
 		glm::length(glm::vec3(glm::transpose(viewProj)[0]));
-	glm::mat4 xform(1.0f);
-	xform[0][0] = iconScale / aspect;
-	xform[1][1] = iconScale;
-	xform[3][0] = ndcPos.x;
-	xform[3][1] = ndcPos.y;
-	xform[3][2] = ndcPos.z;
-	xform = glm::mat4(clipPos.w) * xform;	// Multiply by W (NDC -> clip)
-	glUniformMatrix4fv(xformLoc, 1, GL_FALSE, glm::value_ptr(xform));
-	// Set color of icon
-	glUniform3fv(colorLoc, 1, glm::value_ptr(data.color));
-
-	glBindVertexArray(vao);
-
-	if (data.type == POINT)
-		glDrawArrays(GL_LINES, 0, vcountPoint);
-	else if (data.type == DIRECTIONAL)
-		glDrawArrays(GL_LINES, vcountPoint, vcountDir);
-
-	glBindVertexArray(0);
-	glUseProgram(0);
+	gl.uniform(iconScaleLoc, glm::vec2(iconScale / aspect, iconScale));
+
+	gl.bindVertexArray(vao);
+	glDrawArraysInstanced(GL_LINES, 0, glm::max(vcountPoint, vcountDir), (GLsizei)packedLights.size());
 }
 
-// Create UBO and icon state
+// Create light buffer and icon state
 void Light::initializeGL() {
-	// Light data uniform creation
-	initUBO();
+	// Light data buffer creation
+	initLightBuffer();
 
-	// Icon state creation
-	initShader();
+	// Icon state creation (the shader needs the icon vertex counts)
 	initGeometry();
+	initShader();
 }
 
 // Destroy OpenGL state
 void Light::destroyGL() {
-	if (ubo) { glDeleteBuffers(1, &ubo); ubo = 0; }
-	if (shader) { glDeleteProgram(shader); shader = 0; }
-	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
-	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
+	GLStateCache& gl = GLStateCache::global();
+	if (lightTex) { glDeleteTextures(1, &lightTex); lightTex = 0; }
+	if (lightBuf) { gl.deleteBuffer(lightBuf); lightBuf = 0; }
+	if (shader) { gl.deleteProgram(shader); shader = 0; }
+	if (vao) { gl.deleteVertexArray(vao); vao = 0; }
+	if (vbuf) { gl.deleteBuffer(vbuf); vbuf = 0; }
 }
 
-// Create Light data uniform buffer
-void Light::initUBO() {
-	enabledLights.fill(false);
-	std::vector<LightData> emptyLights(MAX_LIGHTS);
+// Create the light buffer and its buffer texture
+void Light::initLightBuffer() {
+	enabledLights.clear();
+	shadowLights.clear();
+	packedLights.clear();
+	freeHint = 0;
+	globalCount = 0;
+	lightsDirty = false;
+
+	// Create the buffer with no lights (binding it creates it, which
+	// glTexBuffer requires)
+	GLStateCache& gl = GLStateCache::global();
+	glGenBuffers(1, &lightBuf);
+	gl.bindBuffer(GL_TEXTURE_BUFFER, lightBuf);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(Packed), nullptr, GL_STREAM_DRAW);
+	glGenTextures(1, &lightTex);
+	glBindTexture(GL_TEXTURE_BUFFER, lightTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuf);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
 
-	// Create the uniform buffer and fill with empty lights
-	glGenBuffers(1, &ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-	glBufferData(GL_UNIFORM_BUFFER, emptyLights.size() * sizeof(LightData),
-		emptyLights.data(), GL_STATIC_DRAW);
+// Copy this light into the shadow array; the GPU sees it on the next flush
+void Light::updateShadow() {
+	if (index < 0) return;
 
-	// Set the binding point index of the buffer
-	glBindBufferBase(GL_UNIFORM_BUFFER, BIND_PT, ubo);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	shadowLights[index] = data;
+	lightsDirty = true;
 }
 
-// Update this light's entry in the uniform buffer
-void Light::updateUBO() {
-	if (index < 0) return;
+// Pack the enabled lights and upload them at once. Respecifying the whole
+// buffer orphans the storage earlier frames may still read, so the upload
+// never waits for them.
+void Light::flushLights() {
+	if (!lightsDirty || !lightBuf) return;
+
+	// Lights that reach everywhere first, then the ones with a range
+	packedLights.clear();
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < shadowLights.size(); i++) {
+			const LightData& light = shadowLights[i];
+			if (!enabledLights[i] || !light.enabled)
+				continue;
+			bool bounded = (light.type == POINT && light.range > 0.0f);
+			if (bounded != (pass == 1))
+				continue;
+			packedLights.push_back({ light.pos, (float)light.type, light.color,
+				bounded ? light.range : 0.0f });
+		}
+		if (pass == 0)
+			globalCount = packedLights.size();
+	}
 
-	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
-	glBufferSubData(GL_UNIFORM_BUFFER, index * sizeof(LightData),
-		sizeof(LightData), &data);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLStateCache::global().bindBuffer(GL_TEXTURE_BUFFER, lightBuf);
+	glBufferData(GL_TEXTURE_BUFFER, glm::max<size_t>(packedLights.size(), 1) * sizeof(Packed),
+		packedLights.data(), GL_STREAM_DRAW);
+	lightsDirty = false;
 }
 
-// Loop through array of lights to find the first available index
+// Find a free index, adding one if all are taken
 int Light::findAvailableIndex() {
-	int index = -1;
-	for (int i = 0; i < (int)enabledLights.size(); i++) {
-		if (!enabledLights[i]) {
-			index = i;
-			break;
-		}
+	int index = freeHint;
+	while (index < (int)enabledLights.size() && enabledLights[index])
+		index++;
+	if (index == (int)enabledLights.size()) {
+		if (index >= MAX_LIGHTS)
+			return -1;
+		enabledLights.push_back(false);
+		shadowLights.push_back(LightData());
 	}
+	freeHint = index + 1;
 	return index;
 }
 
-// Compile and link shader
+// Compile and link shader (or load the program saved by an earlier run)
 void Light::initShader() {
-	std::vector<GLuint> shaders;
-	shaders.push_back(compileShader(GL_VERTEX_SHADER, "shaders/icon_v.glsl"));
-	shaders.push_back(compileShader(GL_FRAGMENT_SHADER, "shaders/icon_f.glsl"));
-	shader = linkProgram(shaders);
-	// Cleanup extra state
-	for (auto s : shaders)
-		glDeleteShader(s);
-	shaders.clear();
+	shader = buildProgram({ { GL_VERTEX_SHADER, "shaders/icon_v.glsl" },
+		{ GL_FRAGMENT_SHADER, "shaders/icon_f.glsl" } });
 
 	// Get uniform locations
-	colorLoc = glGetUniformLocation(shader, "color");
-	xformLoc = glGetUniformLocation(shader, "xform");
+	viewProjLoc = glGetUniformLocation(shader, "viewProj");
+	iconScaleLoc = glGetUniformLocation(shader, "iconScale");
+
+	// Vertices of each icon, indexed by light type
+	GLint vertexCounts[2] = { (GLint)vcountPoint, (GLint)vcountDir };
+	GLStateCache::global().useProgram(shader);
+	glUniform1iv(glGetUniformLocation(shader, "vertexCounts"), 2, vertexCounts);
 }
 
 // Create icon geometry
@@ -310,27 +351,44 @@ void Light::initGeometry() {
 	};
 	vcountDir = (GLuint)directionIconVerts.size();
 
-	// Combine verts into a single buffer
-	std::vector<glm::vec2> verts;
-	verts.reserve(vcountPoint + vcountDir);
-	verts.insert(verts.end(), pointIconVerts.begin(), pointIconVerts.end());
-	verts.insert(verts.end(), directionIconVerts.begin(), directionIconVerts.end());
+	// Combine verts into a single buffer: vertex i of both icons side by
+	// side, so that one draw can show either icon (the shorter is padded)
+	std::vector<glm::vec2> verts(2 * glm::max(vcountPoint, vcountDir), glm::vec2(0.0f));
+	for (GLuint i = 0; i < vcountPoint; i++)
+		verts[2 * i] = pointIconVerts[i];
+	for (GLuint i = 0; i < vcountDir; i++)
+		verts[2 * i + 1] = directionIconVerts[i];
 
 	// Create vertex array object
+	GLStateCache& gl = GLStateCache::global();
 	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	gl.bindVertexArray(vao);
 
 	// Send geometry to vertex buffer
 	glGenBuffers(1, &vbuf);
-	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
+	gl.bindBuffer(GL_ARRAY_BUFFER, vbuf);
 	glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(glm::vec2),
 		verts.data(), GL_STATIC_DRAW);
 
 	// Specify vertex format
 	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), (GLvoid*)0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec2), (GLvoid*)0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(glm::vec2), (GLvoid*)sizeof(glm::vec2));
+
+	// Instances read the packed lights straight from the light buffer
+	gl.bindBuffer(GL_ARRAY_BUFFER, lightBuf);
+	GLsizei stride = sizeof(Packed);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offsetof(Packed, type));
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offsetof(Packed, pos));
+	glEnableVertexAttribArray(4);
+	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offsetof(Packed, color));
+	for (GLuint attrib = 2; attrib <= 4; attrib++)
+		glVertexAttribDivisor(attrib, 1);
 
 	// Reset state
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	gl.bindVertexArray(0);
+	gl.bindBuffer(GL_ARRAY_BUFFER, 0);
 }
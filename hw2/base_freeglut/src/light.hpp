@@ -1,7 +1,7 @@
 #ifndef LIGHT_HPP
 #define LIGHT_HPP
 
-#include <array>
+#include <vector>
 #include <glm/glm.hpp>
 #include "gl_core_3_3.h"
 
@@ -21,22 +21,42 @@ public:
 		DIRECTIONAL = 1,
 	};
 
-	static const int BIND_PT = 0;
-	static const int MAX_LIGHTS = 8;
+	// Lights enabled at once (two texels each must fit in a buffer texture)
+	static const int MAX_LIGHTS = 16384;
 
-	// Render a graphical representation of the light source
-	void drawIcon(glm::mat4 xform) const;
+	// A light as the shaders read it: two texels of a buffer texture
+	struct Packed {
+		glm::vec3 pos;		// Position (or direction) of the light
+		float type;			// LightType
+		glm::vec3 color;	// Color of the light
+		float range;		// Distance at which the light fades out, 0 = unbounded
+	};
+
+	// Render a graphical representation of every enabled light source, in
+	// one instanced draw
+	static void drawIcons(glm::mat4 viewProj);
+	// Upload the lights changed since the last flush to the light buffer
+	// (call once per frame, before drawing with it)
+	static void flushLights();
+	// Enabled lights as of the last flush: the ones that reach everywhere
+	// (directional lights and point lights without a range) come first
+	static const std::vector<Packed>& getPackedLights() { return packedLights; }
+	static size_t getGlobalCount() { return globalCount; }
+	// Buffer texture over the packed lights
+	static GLuint getLightTexture() { return lightTex; }
 
 	// Accessors
 	bool getEnabled() const { return data.enabled; }
 	LightType getType() const { return (LightType)data.type; }
 	glm::vec3 getPos() const { return data.pos; }
 	glm::vec3 getColor() const { return data.color; }
+	float getRange() const { return data.range; }
 	// Modifiers
 	void setEnabled(bool enabled);
 	void setType(LightType type);
 	void setPos(glm::vec3 pos);
 	void setColor(glm::vec3 color);
+	void setRange(float range);	// 0 = unbounded
 
 	// Rotation and offset
 	bool isRotating() const { return rotating; }
@@ -46,18 +66,16 @@ public:
 	void offsetLight(float offset);
 
 protected:
-	// Light properties, arranged for UBO storage (std140 layout)
+	// Light properties
 	struct LightData {
 		LightData();
-		int enabled;		// Whether light is on or off
+		bool enabled;		// Whether light is on or off
 		int type;			// Point light or directional light
-		glm::vec2 padding0;
 		glm::vec3 pos;		// Position (or direction) of the light
-		float padding1;
 		glm::vec3 color;	// Color of the light
-		float padding2;
+		float range;		// Distance at which a point light fades out, 0 = unbounded
 	} data;
-	int index = -1;		// Index into UBO (set upon enable)
+	int index = -1;		// Index into the shadow array (set upon enable)
 
 	// Rotation state
 	bool rotating;			// Whether light is rotating
@@ -66,23 +84,29 @@ protected:
 
 	// OpenGL state -- shared by all Light objects
 	static unsigned int refcount;	// Number of light objects instantiated
-	static std::array<bool, MAX_LIGHTS> enabledLights;	// Which lights are enabled
-	static GLuint ubo;				// Uniform buffer object for storing light data
+	static std::vector<bool> enabledLights;		// Which indices are taken
+	static std::vector<LightData> shadowLights;	// Light data by index
+	static int freeHint;			// No index below this is free
+	static bool lightsDirty;		// Whether shadowLights changed since the last flush
+	static std::vector<Packed> packedLights;	// Enabled lights, as last uploaded
+	static size_t globalCount;		// Lights at the start of packedLights that reach everywhere
+	static GLuint lightBuf;			// Buffer holding packedLights
+	static GLuint lightTex;			// Buffer texture over lightBuf
 	// Icon drawing state
 	static GLuint shader;			// Icon shader
-	static GLuint vao;				// Vertex array object
+	static GLuint vao;				// Vertex array object (instances come from lightBuf)
 	static GLuint vbuf;				// Vertex buffer
 	static GLuint vcountPoint;		// Number of vertices in point icon
 	static GLuint vcountDir;		// Number of vertices in directional icon
-	static GLuint xformLoc;			// Location of the xform matrix
-	static GLuint colorLoc;			// Location of color uniform
+	static GLuint viewProjLoc;		// Location of the view-projection matrix
+	static GLuint iconScaleLoc;		// Location of the icon scale
 	static float iconScale;			// Scale of the icons
 
 	// OpenGL state management
 	void initializeGL();
 	void destroyGL();
-	void initUBO();
-	void updateUBO();
+	void initLightBuffer();
+	void updateShadow();
 	int findAvailableIndex();
 	// Icon setup
 	void initShader();
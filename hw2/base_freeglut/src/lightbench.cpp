@@ -0,0 +1,86 @@
+// Measures frame time against the number of lights: fills the space around
+// the object with point lights of limited range and times the frames drawn
+// at each light count.
+//
+// Usage: lightbench [config.txt] [frames per count]   (defaults: config.txt, 20)
+#define NOMINMAX
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "glstate.hpp"
+#include <GL/freeglut.h>
+
+int main(int argc, char** argv) {
+	std::string configFile = (argc > 1) ? argv[1] : "config.txt";
+	int frames = (argc > 2) ? std::max(1, std::stoi(argv[2])) : 20;
+	const std::vector<unsigned int> lightCounts = { 8, 32, 128, 512, 2048, 10000 };
+	const int width = 800, height = 600;
+
+	// Render into a window of fixed size
+	glutInit(&argc, argv);
+	glutInitWindowSize(width, height);
+	glutInitContextProfile(GLUT_CORE_PROFILE);
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
+	glutCreateWindow("Light benchmark");
+
+	try {
+		GLState glState;
+		glState.initializeGL();
+		glState.resizeGL(width, height);
+		glState.readConfig(configFile);
+		// Wait for the object to load
+		while (glState.isLoading()) {
+			glState.update();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		std::cout << std::setw(8) << "lights" << std::setw(10) << "in view" << std::setw(10) << "refs"
+			<< std::setw(14) << "max/cluster" << std::setw(12) << "binning ms"
+			<< std::setw(12) << "frame ms" << std::endl;
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		for (unsigned int count : lightCounts) {
+			// Scatter lights through the box around the object (which has a
+			// unit diagonal and sits at the origin)
+			glState.setNumLights(count);
+			for (unsigned int i = 0; i < count; i++) {
+				Light& light = glState.getLight(i);
+				light.setType(Light::POINT);
+				light.setPos(glm::vec3(unit(rng), unit(rng), unit(rng)) * 1.4f - 0.7f);
+				light.setColor(glm::vec3(unit(rng), unit(rng), unit(rng)));
+				light.setRange(0.1f + 0.2f * unit(rng));
+				light.setEnabled(true);
+			}
+
+			// Warm up, then time whole frames including the GPU work
+			glState.paintGL();
+			glFinish();
+			double binningMs = 0.0;
+			auto start = std::chrono::steady_clock::now();
+			for (int f = 0; f < frames; f++) {
+				glState.paintGL();
+				binningMs += glState.getClusterStats().buildMs;
+			}
+			glFinish();
+			double frameMs = std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now() - start).count() / frames;
+
+			const ClusterStats& stats = glState.getClusterStats();
+			std::cout << std::setw(8) << count << std::setw(10) << stats.lights
+				<< std::setw(10) << stats.indices << std::setw(14) << stats.maxPerCluster
+				<< std::setw(12) << std::fixed << std::setprecision(3) << binningMs / frames
+				<< std::setw(12) << frameMs << std::endl;
+		}
+
+	} catch (const std::exception& e) {
+		std::cerr << "Fatal error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
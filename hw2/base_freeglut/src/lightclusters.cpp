@@ -0,0 +1,235 @@
+#define NOMINMAX
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "lightclusters.hpp"
+#include "glcache.hpp"
+#include "parallel.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLUSTERS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Where four lights land on the screen and in depth
+struct Footprint4 {
+	alignas(16) float x0[4], x1[4], y0[4], y1[4];	// Tiles, clamped to the grid
+	alignas(16) float dmin[4], dmax[4];				// View-space depth range
+};
+
+// Screen tiles and depth range of four spheres, from the view-space box
+// around each one: x / depth is smallest at the nearest depth where x is
+// negative, and at the farthest depth elsewhere (likewise for the largest
+// value and for y). Returns a mask of the spheres that reach the view
+// volume; a radius of 0 or less marks an unused lane.
+unsigned int footprint4(const float* x, const float* y, const float* z, const float* r,
+	const glm::mat4& view, float px, float py, float zNear, float zFar, Footprint4& out) {
+#ifdef CLUSTERS_SSE2
+	__m128 X = _mm_load_ps(x), Y = _mm_load_ps(y), Z = _mm_load_ps(z), R = _mm_load_ps(r);
+	auto row = [&](int i) {
+		return _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(view[0][i]), X), _mm_mul_ps(_mm_set1_ps(view[1][i]), Y)),
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(view[2][i]), Z), _mm_set1_ps(view[3][i])));
+	};
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+	__m128 nearest = _mm_set1_ps(zNear);
+	__m128 cx = row(0), cy = row(1), depth = _mm_sub_ps(zero, row(2));
+	__m128 dmin = _mm_max_ps(_mm_sub_ps(depth, R), nearest), dmax = _mm_add_ps(depth, R);
+	__m128 visible = _mm_and_ps(_mm_cmpgt_ps(R, zero),
+		_mm_and_ps(_mm_cmpgt_ps(dmax, nearest), _mm_cmplt_ps(_mm_sub_ps(depth, R), _mm_set1_ps(zFar))));
+
+	auto select = [](__m128 mask, __m128 a, __m128 b) {
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	};
+	auto tiles = [&](__m128 c, float scale, float dim, float* lo, float* hi) {
+		__m128 a = _mm_sub_ps(c, R), b = _mm_add_ps(c, R), s = _mm_set1_ps(scale);
+		__m128 ndcLo = _mm_mul_ps(s, _mm_div_ps(a, select(_mm_cmplt_ps(a, zero), dmin, dmax)));
+		__m128 ndcHi = _mm_mul_ps(s, _mm_div_ps(b, select(_mm_cmpgt_ps(b, zero), dmin, dmax)));
+		visible = _mm_and_ps(visible, _mm_and_ps(_mm_cmplt_ps(ndcLo, one),
+			_mm_cmpgt_ps(ndcHi, _mm_sub_ps(zero, one))));
+		__m128 d = _mm_set1_ps(dim), last = _mm_set1_ps(dim - 1.0f);
+		auto tile = [&](__m128 ndc) {
+			__m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(ndc, half), half), d);
+			return _mm_min_ps(_mm_max_ps(t, zero), last);
+		};
+		_mm_store_ps(lo, tile(ndcLo));
+		_mm_store_ps(hi, tile(ndcHi));
+	};
+	tiles(cx, px, (float)LightClusters::DIM_X, out.x0, out.x1);
+	tiles(cy, py, (float)LightClusters::DIM_Y, out.y0, out.y1);
+	_mm_store_ps(out.dmin, dmin);
+	_mm_store_ps(out.dmax, dmax);
+	return _mm_movemask_ps(visible);
+#else
+	unsigned int mask = 0;
+	for (int k = 0; k < 4; k++) {
+		glm::vec3 c = glm::vec3(view * glm::vec4(x[k], y[k], z[k], 1.0f));
+		float depth = -c.z;
+		float dmin = std::max(depth - r[k], zNear), dmax = depth + r[k];
+		bool visible = r[k] > 0.0f && dmax > zNear && depth - r[k] < zFar;
+		auto tiles = [&](float c, float scale, float dim, float& lo, float& hi) {
+			float a = c - r[k], b = c + r[k];
+			float ndcLo = scale * (a / (a < 0.0f ? dmin : dmax));
+			float ndcHi = scale * (b / (b > 0.0f ? dmin : dmax));
+			visible = visible && ndcLo < 1.0f && ndcHi > -1.0f;
+			lo = std::min(std::max((ndcLo * 0.5f + 0.5f) * dim, 0.0f), dim - 1.0f);
+			hi = std::min(std::max((ndcHi * 0.5f + 0.5f) * dim, 0.0f), dim - 1.0f);
+		};
+		tiles(c.x, px, (float)LightClusters::DIM_X, out.x0[k], out.x1[k]);
+		tiles(c.y, py, (float)LightClusters::DIM_Y, out.y0[k], out.y1[k]);
+		out.dmin[k] = dmin;
+		out.dmax[k] = dmax;
+		mask |= (unsigned int)visible << k;
+	}
+	return mask;
+#endif
+}
+
+}
+
+// Constructor
+LightClusters::LightClusters() :
+	sliceScale(1.0f),
+	clusterBuf(0), clusterTex(0),
+	indexBuf(0), indexTex(0),
+	maxTexels(0) {}
+
+// Destructor
+LightClusters::~LightClusters() {
+	// Release OpenGL resources
+	GLStateCache& gl = GLStateCache::global();
+	if (clusterTex) glDeleteTextures(1, &clusterTex);
+	if (indexTex) glDeleteTextures(1, &indexTex);
+	if (clusterBuf) gl.deleteBuffer(clusterBuf);
+	if (indexBuf) gl.deleteBuffer(indexBuf);
+}
+
+// Create the buffers and their buffer textures
+void LightClusters::initializeGL() {
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+
+	// Binding a buffer creates it, which glTexBuffer requires
+	GLStateCache& gl = GLStateCache::global();
+	glGenBuffers(1, &clusterBuf);
+	gl.bindBuffer(GL_TEXTURE_BUFFER, clusterBuf);
+	glGenBuffers(1, &indexBuf);
+	gl.bindBuffer(GL_TEXTURE_BUFFER, indexBuf);
+
+	glGenTextures(1, &clusterTex);
+	glBindTexture(GL_TEXTURE_BUFFER, clusterTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, clusterBuf);
+	glGenTextures(1, &indexTex);
+	glBindTexture(GL_TEXTURE_BUFFER, indexTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, indexBuf);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+// Find the clusters each light reaches
+void LightClusters::computeBounds(const std::vector<Light::Packed>& lights, size_t first,
+	const glm::mat4& view, const glm::mat4& proj, float zNear, float zFar) {
+	size_t count = lights.size() - first;
+	bounds.resize(count);
+	parallelFor(0, (count + 3) / 4, 1 << 8, [&](size_t begin, size_t end) {
+		for (size_t g = begin; g < end; g++) {
+			// Gather four lights; lanes past the end have no range
+			alignas(16) float x[4], y[4], z[4], r[4];
+			for (size_t k = 0; k < 4; k++) {
+				size_t i = g * 4 + k;
+				const Light::Packed* light = (i < count) ? &lights[first + i] : nullptr;
+				x[k] = light ? light->pos.x : 0.0f;
+				y[k] = light ? light->pos.y : 0.0f;
+				z[k] = light ? light->pos.z : 0.0f;
+				r[k] = light ? light->range : 0.0f;
+			}
+			Footprint4 fp;
+			unsigned int visible = footprint4(x, y, z, r, view, proj[0][0], proj[1][1], zNear, zFar, fp);
+
+			// Depth slices are logarithmic, which SSE2 can't do
+			for (size_t k = 0; k < 4 && g * 4 + k < count; k++) {
+				Bounds& b = bounds[g * 4 + k];
+				if (!(visible & (1u << k))) {
+					b = { 1, 0, 1, 0, 1, 0 };
+					continue;
+				}
+				auto slice = [&](float depth) {
+					int s = (int)(std::log(depth / zNear) * sliceScale);
+					return (uint8_t)std::min(std::max(s, 0), DIM_Z - 1);
+				};
+				b.x0 = (uint8_t)fp.x0[k]; b.x1 = (uint8_t)fp.x1[k];
+				b.y0 = (uint8_t)fp.y0[k]; b.y1 = (uint8_t)fp.y1[k];
+				b.z0 = slice(fp.dmin[k]);
+				b.z1 = slice(std::min(fp.dmax[k], zFar));
+			}
+		}
+	});
+}
+
+// Visit the clusters of some slices that each light reaches
+template <typename Fn>
+void LightClusters::forEachInSlices(size_t zBegin, size_t zEnd, Fn fn) const {
+	for (uint32_t i = 0; i < (uint32_t)bounds.size(); i++) {
+		const Bounds& b = bounds[i];
+		if (b.x0 > b.x1)
+			continue;
+		size_t z0 = std::max<size_t>(b.z0, zBegin), z1 = std::min<size_t>(b.z1 + 1, zEnd);
+		for (size_t z = z0; z < z1; z++)
+			for (size_t y = b.y0; y <= b.y1; y++)
+				for (size_t x = b.x0; x <= b.x1; x++)
+					fn((z * DIM_Y + y) * DIM_X + x, i);
+	}
+}
+
+// Bin the lights into clusters
+void LightClusters::build(const std::vector<Light::Packed>& lights, size_t first,
+	const glm::mat4& view, const glm::mat4& proj, float zNear, float zFar) {
+	auto start = std::chrono::steady_clock::now();
+	sliceScale = DIM_Z / std::log(zFar / zNear);
+	computeBounds(lights, first, view, proj, zNear, zFar);
+	stats = ClusterStats();
+	for (auto& b : bounds)
+		stats.lights += (b.x0 <= b.x1);
+	size_t sliceGrain = (stats.lights < PARALLEL_MIN_LIGHTS) ? DIM_Z : 1;
+
+	// Count the lights of each cluster. Each task takes whole slices, so no
+	// two tasks touch the same cluster.
+	clusters.assign(2 * CLUSTER_COUNT, 0);
+	parallelFor(0, DIM_Z, sliceGrain, [&](size_t zBegin, size_t zEnd) {
+		forEachInSlices(zBegin, zEnd, [&](size_t c, uint32_t) { clusters[2 * c + 1]++; });
+	});
+
+	// Lay the lists out one after another, dropping what a buffer texture
+	// can't hold
+	size_t offset = 0, limit = (maxTexels > 0) ? (size_t)maxTexels : SIZE_MAX;
+	for (size_t c = 0; c < CLUSTER_COUNT; c++) {
+		size_t count = std::min<size_t>(clusters[2 * c + 1], limit - offset);
+		clusters[2 * c] = (uint32_t)offset;
+		clusters[2 * c + 1] = (uint32_t)count;
+		offset += count;
+		stats.maxPerCluster = std::max(stats.maxPerCluster, count);
+	}
+	indices.resize(offset);
+
+	// Fill the lists, each in order of light
+	cursor.assign(CLUSTER_COUNT, 0);
+	parallelFor(0, DIM_Z, sliceGrain, [&](size_t zBegin, size_t zEnd) {
+		forEachInSlices(zBegin, zEnd, [&](size_t c, uint32_t i) {
+			if (cursor[c] < clusters[2 * c + 1])
+				indices[clusters[2 * c] + cursor[c]++] = (uint32_t)(first + i);
+		});
+	});
+
+	stats.indices = indices.size();
+	stats.buildMs = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+// Replace the buffer contents, orphaning what earlier frames may still read
+void LightClusters::upload() {
+	GLStateCache& gl = GLStateCache::global();
+	gl.bindBuffer(GL_TEXTURE_BUFFER, clusterBuf);
+	glBufferData(GL_TEXTURE_BUFFER, clusters.size() * sizeof(uint32_t), clusters.data(), GL_STREAM_DRAW);
+	gl.bindBuffer(GL_TEXTURE_BUFFER, indexBuf);
+	glBufferData(GL_TEXTURE_BUFFER, std::max<size_t>(indices.size(), 1) * sizeof(uint32_t),
+		indices.empty() ? nullptr : indices.data(), GL_STREAM_DRAW);
+}
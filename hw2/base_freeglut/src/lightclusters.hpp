@@ -0,0 +1,89 @@
+#ifndef LIGHTCLUSTERS_HPP
+#define LIGHTCLUSTERS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "gl_core_3_3.h"
+#include "light.hpp"
+
+// Work done by the last LightClusters::build
+struct ClusterStats {
+	size_t lights;			// Lights that reach the view volume
+	size_t indices;			// Light references over all clusters
+	size_t maxPerCluster;	// Most lights in one cluster
+	double buildMs;			// CPU time of the build
+	ClusterStats() : lights(0), indices(0), maxPerCluster(0), buildMs(0.0) {}
+};
+
+// Splits the view volume into a grid of clusters (screen tiles, cut into
+// slices that grow exponentially with depth) and lists, for each cluster,
+// the point lights whose range reaches it. Fragments then only shade the
+// lights of their own cluster. Rebuilt on the CPU every frame, in parallel
+// and four lights at a time with SSE2; shaders read the result from two
+// buffer textures.
+class LightClusters {
+public:
+	LightClusters();
+	~LightClusters();
+	// Disallow copy, move, & assignment
+	LightClusters(const LightClusters& other) = delete;
+	LightClusters& operator=(const LightClusters& other) = delete;
+	LightClusters(LightClusters&& other) = delete;
+	LightClusters& operator=(LightClusters&& other) = delete;
+
+	// Clusters along x, y (screen tiles) and z (depth slices)
+	static const int DIM_X = 16;
+	static const int DIM_Y = 9;
+	static const int DIM_Z = 24;
+	static const int CLUSTER_COUNT = DIM_X * DIM_Y * DIM_Z;
+
+	// Create the buffer textures (call once the OpenGL context exists)
+	void initializeGL();
+
+	// Bin lights[first, end), which must be point lights with a range, for a
+	// view and a symmetric perspective projection with the given depth range
+	void build(const std::vector<Light::Packed>& lights, size_t first,
+		const glm::mat4& view, const glm::mat4& proj, float zNear, float zFar);
+	// Send the clusters to the buffer textures (needs an OpenGL context)
+	void upload();
+
+	// Slice of a view-space depth: floor(log(depth / zNear) * sliceScale)
+	float getSliceScale() const { return sliceScale; }
+	// Offset and count of each cluster's lights in the index texture
+	GLuint getClusterTexture() const { return clusterTex; }
+	// Indices into the packed lights
+	GLuint getIndexTexture() const { return indexTex; }
+	const ClusterStats& getStats() const { return stats; }
+
+protected:
+	// Clusters a light reaches; empty if x0 > x1
+	struct Bounds {
+		uint8_t x0, x1, y0, y1, z0, z1;
+	};
+
+	// Fewer lights reaching the view than this are binned on the calling
+	// thread, where handing slices to the pool costs more than it saves
+	static const size_t PARALLEL_MIN_LIGHTS = 512;
+
+	void computeBounds(const std::vector<Light::Packed>& lights, size_t first,
+		const glm::mat4& view, const glm::mat4& proj, float zNear, float zFar);
+	// Call fn(cluster, light) for each cluster of the slices [zBegin, zEnd)
+	// that a light reaches, in order of light
+	template <typename Fn>
+	void forEachInSlices(size_t zBegin, size_t zEnd, Fn fn) const;
+
+	float sliceScale;
+	std::vector<Bounds> bounds;			// Per light
+	std::vector<uint32_t> clusters;		// Offset and count per cluster
+	std::vector<uint32_t> indices;		// Light indices of all clusters
+	std::vector<uint32_t> cursor;		// Fill position per cluster
+	ClusterStats stats;
+
+	// OpenGL state
+	GLuint clusterBuf, clusterTex;
+	GLuint indexBuf, indexTex;
+	GLint maxTexels;	// Largest buffer texture
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <algorithm>
 #include "glstate.hpp"
+#include "meshregistry.hpp"
 #include <GL/freeglut.h>
 namespace fs = std::filesystem;
 
@@ -19,6 +20,7 @@ const int MENU_PRESETS_OBSIDIAN = 8;
 const int MENU_PRESETS_PEARL = 9;
 const int MENU_EXIT = 1;					// Exit application
 std::vector<std::string> meshFilenames;		// Paths to .obj files to load
+bool prefetchNeighbors = true;				// Load the menu entries next to the shown object ahead of time
 
 // OpenGL state
 int width, height;
@@ -78,6 +80,7 @@ int main(int argc, char** argv) {
 	std::cout << "  x,X:  Decrease/increase specular exponent" << std::endl;
 	std::cout << "  n:    Toggle normals type (flat vs. smooth)" << std::endl;
 	std::cout << "  l,L:  Toggle shading type (Phong vs. Gouraud vs. colored normals)" << std::endl;
+	std::cout << "  g:    Print OpenGL state calls issued / skipped last frame, and memory use" << std::endl;
 	std::cout << std::endl;
 	std::cout << "Active light: " << activeLight+1 << std::endl;
 
@@ -344,6 +347,18 @@ void keyPress(unsigned char key, int x, int y) {
 		}
 		glutPostRedisplay();
 		break; }
+	// Print the state cache counters and memory use
+	case 'g':
+	case 'G': {
+		const GLCallStats& stats = glState->getGLCallStats();
+		std::cout << "Last frame issued " << stats.issued << " OpenGL state calls, skipped "
+			<< stats.skipped << " (" << glState->getNumShaderPrograms() << " shader programs built, "
+			<< glState->getNumPendingShaders() << " building)" << std::endl;
+		MeshRegistry& registry = MeshRegistry::global();
+		std::cout << "Meshes take " << registry.getGpuBytes() / 1024 << " KB of GPU memory (peak "
+			<< registry.getPeakGpuBytes() / 1024 << " KB); peak memory "
+			<< getPeakResidentBytes() / (1024 * 1024) << " MB" << std::endl;
+		break; }
 	default:
 		break;
 	}
@@ -423,6 +438,20 @@ void mouseMove(int x, int y) {
 void idle() {
 	// Anything that happens every frame (e.g. movement) should be done here
 	// Be sure to call glutPostRedisplay() if the screen needs to update as well
+
+	// Show objects once they finish loading in the background
+	try {
+		if (glState->update())
+			glutPostRedisplay();
+	// Might fail to load object
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+	}
+
+	// Programs are taken (and, without parallel compiling, started) as frames
+	// are drawn, so keep drawing until they're all in
+	if (glState->getNumPendingShaders() > 0)
+		glutPostRedisplay();
 }
 
 // Called when a menu button is pressed
@@ -483,8 +512,16 @@ void menu(int cmd) {
 		// Show the other objects
 		if (cmd >= MENU_OBJBASE) {
 			try {
-				glState->showObjFile(meshFilenames[cmd - MENU_OBJBASE]);
+				int i = cmd - MENU_OBJBASE;
+				glState->showObjFile(meshFilenames[i]);
 				glutPostRedisplay();	// Request redraw
+				// Get the objects next to it in the menu ready as well
+				if (prefetchNeighbors) {
+					std::vector<std::string> neighbors;
+					if (i > 0) neighbors.push_back(meshFilenames[i - 1]);
+					if (i + 1 < (int)meshFilenames.size()) neighbors.push_back(meshFilenames[i + 1]);
+					glState->prefetchObjFiles(neighbors);
+				}
 			// Might fail to load object
 			} catch (const std::exception& e) {
 				std::cerr << e.what() << std::endl;
@@ -1,87 +1,245 @@
 #define NOMINMAX
 #include "mesh.hpp"
-#include <fstream>
+#include "glcache.hpp"
+#include <chrono>
+#include <filesystem>
 #include <iostream>
 #include <sstream>
 
-// Helper functions
-int indexOfNumberLetter(std::string& str, int offset);
-int lastIndexOfNumberLetter(std::string& str);
-std::vector<std::string> split(const std::string &s, char delim);
+// Point a vertex attribute at positions stored in a vertex format
+static void positionAttrib(GLuint index, VertexFormat format, GLsizei stride, size_t offset) {
+	glEnableVertexAttribArray(index);
+	if (format == VERTEXFORMAT_QUANTIZED)
+		glVertexAttribPointer(index, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (GLvoid*)offset);
+	else if (format == VERTEXFORMAT_HALF)
+		glVertexAttribPointer(index, 3, GL_HALF_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+	else
+		glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+}
+
+// Point a vertex attribute at normals stored in a vertex format
+static void normalAttrib(GLuint index, VertexFormat format, GLsizei stride, size_t offset) {
+	glEnableVertexAttribArray(index);
+	if (format == VERTEXFORMAT_FLOAT)
+		glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+	else	// Packed types always have 4 components; the shader ignores w
+		glVertexAttribPointer(index, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (GLvoid*)offset);
+}
+
+// Identify the source of a prepared file for the mesh registry, here on the
+// preparing thread since it may have to hash the whole file
+static void identifySource(Mesh::Prepared& data) {
+	data.sourcePath = std::filesystem::weakly_canonical(data.filename).string();
+	data.sourceHash = MeshCache::hashSource(data.filename);
+}
+
+// Whether the buffers of a cache agree with each other: whole vertices and
+// indices, indices within the vertices and levels of detail within the
+// indices. A stale or damaged cache could otherwise make draws (or unpacking)
+// read past a buffer.
+static bool cacheConsistent(const MeshCache& cache, size_t vertexSize) {
+	if (cache.vertexBytes() % vertexSize != 0)
+		return false;
+	size_t vertexCount = cache.vertexBytes() / vertexSize;
+	size_t indexSize = indexSizeFor(vertexCount);
+	if (cache.indexBytes() % indexSize != 0)
+		return false;
+	size_t indexCount = cache.indexBytes() / indexSize;
+	return indicesFit(cache.indexData(), indexCount, indexSize, vertexCount) &&
+		lodsFit(cache.extraData(), cache.extraBytes(), indexCount);
+}
 
 // Vertex constructor
 Mesh::Vertex::Vertex() :
 	pos(glm::vec3(0.0f, 0.0f, 0.0f)),
-	face_norm(glm::vec3(1.0f, 0.0f, 0.0f)),
 	smooth_norm(glm::vec3(0.0f, 1.0f, 0.0f)) {}
 
 // Constructor - load mesh from file
-Mesh::Mesh(std::string filename, bool keepLocalGeometry) {
+Mesh::Mesh(std::string filename, bool keepLocalGeometry, unsigned int optimize,
+	VertexFormat format) {
+	init();
+	load(filename, keepLocalGeometry, optimize, format);
+}
+
+// Constructor - upload a file prepared elsewhere
+Mesh::Mesh(Prepared& data) {
+	init();
+	load(data);
+}
+
+// Set empty state
+void Mesh::init() {
 	minBB = glm::vec3(std::numeric_limits<float>::max());
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
 	vao = 0;
 	vbuf = 0;
+	ibuf = 0;
 	vcount = 0;
-	load(filename, keepLocalGeometry);
+	icount = 0;
+	itype = GL_UNSIGNED_INT;
+	vertexFormat = VERTEXFORMAT_FLOAT;
 }
 
-// Draw the mesh
-void Mesh::draw() {
-	glBindVertexArray(vao);
-	glDrawArrays(GL_TRIANGLES, 0, vcount);
-	glBindVertexArray(0);
+// Draw the mesh at a level of detail
+void Mesh::draw(unsigned int lod) const {
+	// The VAO stays bound, so drawing the same mesh again binds nothing
+	GLStateCache::global().bindVertexArray(vao);
+	if (lod < lods.size()) {
+		size_t indexSize = (itype == GL_UNSIGNED_SHORT) ? 2 : 4;
+		glDrawElements(GL_TRIANGLES, (GLsizei)lods[lod].indexCount, itype,
+			(GLvoid*)(lods[lod].indexOffset * indexSize));
+	} else if (icount > 0)
+		glDrawElements(GL_TRIANGLES, icount, itype, NULL);
+	else
+		glDrawArrays(GL_TRIANGLES, 0, vcount);
 }
 
-// Load a wavefront OBJ file
-void Mesh::load(std::string filename, bool keepLocalGeometry) {
+// Load a wavefront OBJ file (or its binary cache)
+void Mesh::load(std::string filename, bool keepLocalGeometry, unsigned int optimize,
+	VertexFormat format) {
+	Prepared data = prepare(filename, keepLocalGeometry, optimize, format);
+	load(data);
+}
+
+// Upload a prepared file
+void Mesh::load(Prepared& data) {
 	// Release resources
 	release();
+	vertexFormat = data.format;
+	minBB = data.minBB;
+	maxBB = data.maxBB;
+	posXform = positionTransform(vertexFormat, minBB, maxBB);
+	loadStats = data.loadStats;
+	optimizeStats = data.optimizeStats;
+	quantError = data.quantError;
+	lods = data.lods;
 
-	std::ifstream file(filename);
-	if (!file.is_open()) {
-		std::stringstream ss;
-		ss << "Error reading " << filename << ": failed to open file";
-		throw std::runtime_error(ss.str());
+	upload(data.vertexData(), data.vertexCount, data.indexData(), data.indexCount, data.indexSize);
+
+	// Keep local copy of geometry if requested
+	if (data.keepLocalGeometry) {
+		vertices = std::move(data.vertices);
+		indices = std::move(data.indices);
 	}
+}
+
+// Read a wavefront OBJ file (or its binary cache) and pack its buffers
+Mesh::Prepared Mesh::prepare(const std::string& filename, bool keepLocalGeometry,
+	unsigned int optimize, VertexFormat format) {
+	Prepared data;
+	data.filename = filename;
+	data.keepLocalGeometry = keepLocalGeometry;
+	data.optimize = optimize;
+	data.format = format;
 
-	// Store vertex data while reading
-	std::vector<glm::vec3> raw_vertices;
-	std::vector<unsigned int> v_elements;
-
-	std::string line;
-	while (getline(file, line)) {
-		if (line.substr(0, 2) == "v ") {
-			// Read position data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			glm::vec3 vert(stof(values[0]), stof(values[1]), stof(values[2]));
-			raw_vertices.push_back(vert);
-
-			// Update bounding box
-			minBB = glm::min(minBB, vert);
-			maxBB = glm::max(maxBB, vert);
-
-		} else if (line.substr(0, 2) == "f ") {
-			// Read face data
-			int index1 = indexOfNumberLetter(line, 2);
-			int index2 = lastIndexOfNumberLetter(line);
-			std::vector<std::string> values = split(line.substr(index1, index2 - index1 + 1), ' ');
-			for (int i = 0; i < int(values.size()) - 2; i++) {
-				// Split up vertex indices
-				std::vector<std::string> v1 = split(values[0], '/');		// Triangle fan for ngons
-				std::vector<std::string> v2 = split(values[i+1], '/');
-				std::vector<std::string> v3 = split(values[i+2], '/');
-
-				// Store position indices
-				v_elements.push_back(stoul(v1[0]) - 1);
-				v_elements.push_back(stoul(v2[0]) - 1);
-				v_elements.push_back(stoul(v3[0]) - 1);
-			}
+	// Use the binary cache if it's up to date
+	auto start = std::chrono::steady_clock::now();
+	data.cached = data.cache.open(filename, cacheFormat(optimize, format));
+	if (data.cached && !cacheConsistent(data.cache, vertexSize(format))) {
+		std::cerr << "Warning: ignoring the cache of " << filename << ": its buffers don't match" << std::endl;
+		data.cache.close();
+		data.cached = false;
+	}
+	if (data.cached) {
+		MeshCache& cache = data.cache;
+		data.minBB = cache.minBB();
+		data.maxBB = cache.maxBB();
+		data.vertexCount = cache.vertexBytes() / vertexSize(format);
+		data.indexSize = indexSizeFor(data.vertexCount);
+		data.indexCount = cache.indexBytes() / data.indexSize;
+		if (keepLocalGeometry) {
+			data.vertices = unpack((const unsigned char*)cache.vertexData(), data.vertexCount,
+				format, data.minBB, data.maxBB);
+			data.indices.resize(data.indexCount);
+			for (size_t i = 0; i < data.indexCount; i++)
+				data.indices[i] = (data.indexSize == 2) ? ((const uint16_t*)cache.indexData())[i]
+					: ((const uint32_t*)cache.indexData())[i];
 		}
+		const MeshLod* lods = (const MeshLod*)cache.extraData();
+		data.lods.assign(lods, lods + cache.extraBytes() / sizeof(MeshLod));
+
+		data.loadStats.bytes = cache.vertexBytes() + cache.indexBytes();
+		data.loadStats.threads = 1;
+		data.loadStats.seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		std::cout << "Loaded " << filename << " from cache: " << data.loadStats.bytes / 1024 << " KB in "
+			<< data.loadStats.seconds * 1000.0 << " ms" << std::endl;
+		identifySource(data);
+		return data;
+	}
+
+	// Parse the file, compute normals, merge shared vertices and optimize
+	Geometry geom = build(filename, optimize, &data.loadStats);
+	data.optimizeStats = geom.passes;
+	data.lods = std::move(geom.lods);
+	data.minBB = geom.minBB;
+	data.maxBB = geom.maxBB;
+	data.packed = pack(geom.vertices, format, data.minBB, data.maxBB, &data.quantError);
+	data.vertexCount = geom.vertices.size();
+	data.indexCount = geom.indices.size();
+	data.indexSize = indexSizeFor(data.vertexCount);
+	if (data.indexSize == sizeof(uint16_t))
+		data.shortIndices = narrowIndices(geom.indices);
+	if (keepLocalGeometry)
+		data.vertices = std::move(geom.vertices);
+	if (keepLocalGeometry || data.indexSize != sizeof(uint16_t))
+		data.indices = std::move(geom.indices);
+	size_t indexBytes = data.indexCount * data.indexSize;
+
+	const ObjLoadStats& loadStats = data.loadStats;
+	const QuantizationError& quantError = data.quantError;
+	std::cout << "Loaded " << filename << ": " << loadStats.bytes / 1024 << " KB in "
+		<< loadStats.seconds * 1000.0 << " ms (" << loadStats.throughput() << " MB/s, "
+		<< loadStats.threads << " threads); " << data.vertexCount << " vertices, "
+		<< (data.packed.size() + indexBytes) / 1024 << " KB" << (data.indexCount == 0 ? " (not indexed)" : "")
+		<< std::endl;
+	if (!geom.passes.empty()) {
+		std::cout << "  ACMR/ATVR";
+		for (auto& p : geom.passes)
+			std::cout << (&p == &geom.passes[0] ? " " : ", ") << p.pass << " "
+				<< p.cache.acmr << "/" << p.cache.atvr;
+		std::cout << std::endl;
+	}
+	if (!data.lods.empty()) {
+		std::cout << "  LODs";
+		for (auto& l : data.lods)
+			std::cout << (&l == &data.lods[0] ? " " : ", ") << l.indexCount / 3
+				<< " tris (error " << l.error << ")";
+		std::cout << std::endl;
+	}
+	if (format != VERTEXFORMAT_FLOAT) {
+		std::cout << "  " << vertexSize(format) << " bytes/vertex (" << sizeof(Vertex)
+			<< " as floats); position error " << quantError.maxPosition << " of bounding box, normal error "
+			<< quantError.maxNormal << " deg max, " << quantError.meanNormal << " deg mean" << std::endl;
+		if (quantError.visible())
+			std::cerr << "Warning: " << filename << " loses visible precision in this vertex format" << std::endl;
+	}
+
+	// Save the result for next time
+	try {
+		MeshCache::write(filename, cacheFormat(optimize, format), data.minBB, data.maxBB,
+			data.packed.data(), data.packed.size(), data.indexData(), indexBytes,
+			data.lods.data(), data.lods.size() * sizeof(MeshLod));
+	} catch (const std::exception& e) {
+		std::cerr << "Warning: " << e.what() << std::endl;
 	}
-	file.close();
+
+	identifySource(data);
+	return data;
+}
+
+// Build the indexed geometry for an OBJ file
+Mesh::Geometry Mesh::build(const std::string& filename, unsigned int optimize,
+	ObjLoadStats* stats) {
+	Geometry geom;
+
+	// Parse the file
+	ObjData obj = parseObj(filename, stats);
+	std::vector<glm::vec3>& raw_vertices = obj.positions;
+	std::vector<unsigned int>& v_elements = obj.v_elements;
+	geom.minBB = obj.minBB;
+	geom.maxBB = obj.maxBB;
 
 	// Check if the file was invalid
 	if (raw_vertices.empty() || v_elements.empty()) {
@@ -91,70 +249,114 @@ void Mesh::load(std::string filename, bool keepLocalGeometry) {
 	}
 
 	// TODO ========================================================================
-	// Calculate face and smoothed normals
-	std::vector<glm::vec3> face_normals(v_elements.size());
-	std::vector<glm::vec3> accumulated_normals(raw_vertices.size(), glm::vec3(0.0f));
-
-	for (size_t i = 0; i < size_t(v_elements.size()); i += 3) {
-		glm::vec3 e1, e2;
-		e1 = raw_vertices[v_elements[i+1]] - raw_vertices[v_elements[i+0]];
-		e2 = raw_vertices[v_elements[i+2]] - raw_vertices[v_elements[i+0]];
-		face_normals[i+0] = face_normals[i+1] = face_normals[i+2] = glm::normalize(glm::cross(e1, e2));
-
-		accumulated_normals[v_elements[i+0]] += face_normals[i+0] * glm::acos(glm::dot(e1, e2));
-		accumulated_normals[v_elements[i+1]] += face_normals[i+1] * glm::acos(glm::dot(e1, e2 - e1));
-		accumulated_normals[v_elements[i+2]] += face_normals[i+2] * glm::acos(glm::dot(e1 - e2, e2));
+	// Calculate smoothed normals (flat normals are derived in the fragment shader)
+	std::vector<glm::vec3> accumulated_normals = computeSmoothNormals(raw_vertices, v_elements);
+
+
+	// Create vertex array: every position has a single normal, so each one
+	// becomes a vertex shared by all the triangles that use it
+	geom.vertices.resize(raw_vertices.size());
+	for (size_t i = 0; i < raw_vertices.size(); i++) {
+		geom.vertices[i].pos = raw_vertices[i];
+		geom.vertices[i].smooth_norm = accumulated_normals[i];
 	}
+	geom.indices = std::move(v_elements);
+
+	// Reorder triangles and vertices for the GPU
+	geom.passes = optimizeMesh(geom.vertices, geom.indices, optimize);
 
-	for (size_t i = 0; i < size_t(accumulated_normals.size()); i++) {
-		accumulated_normals[i] = glm::normalize(accumulated_normals[i]);
+	// Append simplified levels of detail
+	if (optimize & MESHOPT_LOD) {
+		std::vector<glm::vec3> positions(geom.vertices.size());
+		for (size_t i = 0; i < geom.vertices.size(); i++)
+			positions[i] = geom.vertices[i].pos;
+		geom.lods = buildLodChain(positions, geom.indices);
 	}
+	return geom;
+}
+
+// Build an OBJ file's indexed geometry and write it to the binary cache
+void Mesh::bake(const std::string& filename, unsigned int optimize, VertexFormat format) {
+	Geometry geom = build(filename, optimize);
+	std::vector<unsigned char> packed = pack(geom.vertices, format, geom.minBB, geom.maxBB);
+	size_t indexSize = indexSizeFor(geom.vertices.size());
+	std::vector<uint16_t> shortIndices;
+	const void* elements = geom.indices.data();
+	if (indexSize == sizeof(uint16_t)) {
+		shortIndices = narrowIndices(geom.indices);
+		elements = shortIndices.data();
+	}
+	MeshCache::write(filename, cacheFormat(optimize, format), geom.minBB, geom.maxBB,
+		packed.data(), packed.size(), elements, geom.indices.size() * indexSize,
+		geom.lods.data(), geom.lods.size() * sizeof(MeshLod));
+}
+
+// Pack float vertices into the buffer layout of a vertex format
+std::vector<unsigned char> Mesh::pack(const std::vector<Vertex>& verts, VertexFormat format,
+	glm::vec3 minBB, glm::vec3 maxBB, QuantizationError* error) {
+	PositionTransform xf = positionTransform(format, minBB, maxBB);
+	size_t posSize = positionSize(format);
+	std::vector<unsigned char> packed(verts.size() * vertexSize(format));
+	float diagonal = glm::length(maxBB - minBB);
 
+	unsigned char* out = packed.data();
+	for (auto& v : verts) {
+		packPosition(format, v.pos, xf, out);
+		packNormal(format, v.smooth_norm, out + posSize);
+		if (error) {
+			error->addPosition(v.pos, unpackPosition(format, out, xf), diagonal);
+			error->addNormal(v.smooth_norm, unpackNormal(format, out + posSize));
+		}
+		out += vertexSize(format);
+	}
+	return packed;
+}
 
-	// Create vertex array
-	vertices = std::vector<Vertex>(v_elements.size());
-	for (int i = 0; i < int(v_elements.size()); i += 3) {
-		// Store positions
-		vertices[i+0].pos = raw_vertices[v_elements[i+0]];
-		vertices[i+1].pos = raw_vertices[v_elements[i+1]];
-		vertices[i+2].pos = raw_vertices[v_elements[i+2]];
-
-		// TODO ====================================================================
-		// Store face and smoothed normals in each vertex
-		
-		// Face normals
-		vertices[i+0].face_norm = face_normals[i+0];
-		vertices[i+1].face_norm = face_normals[i+1];
-		vertices[i+2].face_norm = face_normals[i+2];
-
-		//smoothed normals
-		vertices[i+0].smooth_norm = accumulated_normals[v_elements[i+0]];
-		vertices[i+1].smooth_norm = accumulated_normals[v_elements[i+1]];
-		vertices[i+2].smooth_norm = accumulated_normals[v_elements[i+2]];
+// Unpack vertices stored in a vertex format
+std::vector<Mesh::Vertex> Mesh::unpack(const unsigned char* packed, size_t count,
+	VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB) {
+	PositionTransform xf = positionTransform(format, minBB, maxBB);
+	size_t posSize = positionSize(format);
+	std::vector<Vertex> verts(count);
+	for (auto& v : verts) {
+		v.pos = unpackPosition(format, packed, xf);
+		v.smooth_norm = unpackNormal(format, packed + posSize);
+		packed += vertexSize(format);
 	}
-	vcount = (GLsizei)vertices.size();
+	return verts;
+}
+
+// Send vertices and indices to OpenGL
+void Mesh::upload(const void* verts, size_t vertexCount,
+	const void* elements, size_t indexCount, size_t indexSize) {
+	vcount = (GLsizei)vertexCount;
+	icount = (GLsizei)indexCount;
+	itype = (indexSize == sizeof(uint16_t)) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	GLsizei stride = (GLsizei)vertexSize(vertexFormat);
+	size_t posSize = positionSize(vertexFormat);
 
 	// Load vertices into OpenGL
+	GLStateCache& gl = GLStateCache::global();
 	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
+	gl.bindVertexArray(vao);
 
 	glGenBuffers(1, &vbuf);
-	glBindBuffer(GL_ARRAY_BUFFER, vbuf);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+	gl.bindBuffer(GL_ARRAY_BUFFER, vbuf);
+	glBufferData(GL_ARRAY_BUFFER, vertexCount * stride, verts, GL_STATIC_DRAW);
 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), NULL);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)sizeof(glm::vec3));
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)(2 * sizeof(glm::vec3)));
+	positionAttrib(0, vertexFormat, stride, 0);
+	normalAttrib(1, vertexFormat, stride, posSize);
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	// Load indices (the binding is stored in the VAO)
+	if (indexCount > 0) {
+		glGenBuffers(1, &ibuf);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibuf);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * indexSize, elements, GL_STATIC_DRAW);
+	}
 
-	// Delete local copy of geometry
-	if (!keepLocalGeometry)
-		vertices.clear();
+	gl.bindVertexArray(0);
+	gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 // Release resources
@@ -163,31 +365,14 @@ void Mesh::release() {
 	maxBB = glm::vec3(std::numeric_limits<float>::lowest());
 
 	vertices.clear();
-	if (vao) { glDeleteVertexArrays(1, &vao); vao = 0; }
-	if (vbuf) { glDeleteBuffers(1, &vbuf); vbuf = 0; }
+	indices.clear();
+	optimizeStats.clear();
+	lods.clear();
+	quantError = QuantizationError();
+	GLStateCache& gl = GLStateCache::global();
+	if (vao) { gl.deleteVertexArray(vao); vao = 0; }
+	if (vbuf) { gl.deleteBuffer(vbuf); vbuf = 0; }
+	if (ibuf) { gl.deleteBuffer(ibuf); ibuf = 0; }
 	vcount = 0;
-}
-
-int indexOfNumberLetter(std::string& str, int offset) {
-	for (int i = offset; i < int(str.length()); ++i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return (int)str.length();
-}
-int lastIndexOfNumberLetter(std::string& str) {
-	for (int i = int(str.length()) - 1; i >= 0; --i) {
-		if ((str[i] >= '0' && str[i] <= '9') || str[i] == '-' || str[i] == '.') return i;
-	}
-	return 0;
-}
-std::vector<std::string> split(const std::string &s, char delim) {
-	std::vector<std::string> elems;
-
-	std::stringstream ss(s);
-    std::string item;
-    while (getline(ss, item, delim)) {
-        elems.push_back(item);
-    }
-
-    return elems;
+	icount = 0;
 }
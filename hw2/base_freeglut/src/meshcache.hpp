@@ -0,0 +1,73 @@
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "objloader.hpp"
+
+// Binary sidecar holding the final vertex (and index) buffers of a mesh,
+// written next to the source file as <file>.mcache. The header records the
+// size, modification time and content hash of the source, so the cache is
+// ignored once the source changes.
+class MeshCache {
+public:
+	MeshCache() : header(nullptr) {}
+
+	// Map the cache for a source file. Returns false if there is no cache,
+	// it is stale, or it was written with a different buffer format.
+	bool open(const std::string& sourceFile, uint32_t format);
+	void close();
+
+	// Cached contents (valid while the cache is open)
+	const void* vertexData() const;
+	size_t vertexBytes() const;
+	const void* indexData() const;
+	size_t indexBytes() const;
+	glm::vec3 minBB() const;
+	glm::vec3 maxBB() const;
+	const void* extraData() const;	// Caller-defined data (may be empty)
+	size_t extraBytes() const;
+
+	// Write (or replace) the cache for a source file
+	static void write(const std::string& sourceFile, uint32_t format,
+		glm::vec3 minBB, glm::vec3 maxBB,
+		const void* vertices, size_t vertexBytes,
+		const void* indices, size_t indexBytes,
+		const void* extra = nullptr, size_t extraBytes = 0);
+
+	// Path of the sidecar for a source file
+	static std::string cachePath(const std::string& sourceFile)
+	{ return sourceFile + ".mcache"; }
+
+	// 64-bit hash of a file's contents (hashed in parallel blocks)
+	static uint64_t hashFile(const std::string& filename);
+	// Same as hashFile for a source file, but taken from the cache header
+	// without reading the source if it hasn't changed since the cache was written
+	static uint64_t hashSource(const std::string& sourceFile);
+
+	// On-disk header; buffers follow at 16-byte aligned offsets
+	struct Header {
+		char magic[8];			// "MESHCACH"
+		uint32_t version;		// Layout version of this file format
+		uint32_t format;		// Caller-defined buffer format id
+		uint64_t sourceSize;	// Size of the source file in bytes
+		int64_t sourceMtime;	// Modification time of the source file
+		uint64_t sourceHash;	// Content hash of the source file
+		float minBB[3];			// Bounding box
+		float maxBB[3];
+		uint64_t vertexOffset;	// Vertex buffer
+		uint64_t vertexBytes;
+		uint64_t indexOffset;	// Index buffer (may be empty)
+		uint64_t indexBytes;
+		uint64_t extraOffset;	// Caller-defined data (may be empty)
+		uint64_t extraBytes;
+	};
+
+protected:
+	std::unique_ptr<MappedFile> file;	// Mapping of the cache file
+	const Header* header;				// Start of the mapping
+};
+
+#endif
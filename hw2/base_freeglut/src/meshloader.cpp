@@ -0,0 +1,165 @@
+#define NOMINMAX
+#include "meshloader.hpp"
+#include <algorithm>
+
+// Constructor
+MeshLoader::MeshLoader() :
+	latest(0),
+	started(0),
+	active(false),
+	prefetching(false),
+	stopping(false) {
+	// Start the worker once everything it reads is set up
+	worker = std::thread(&MeshLoader::workerLoop, this);
+}
+
+// Destructor
+MeshLoader::~MeshLoader() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	requested.notify_all();
+	worker.join();
+}
+
+// Start preparing a file
+void MeshLoader::request(const std::string& filename, bool keepLocalGeometry,
+	unsigned int optimize, VertexFormat format) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = { filename, keepLocalGeometry, optimize, format };
+		latest++;
+		active = true;
+		result.reset();
+		error = nullptr;
+		prefetchQueue.erase(std::remove(prefetchQueue.begin(), prefetchQueue.end(), pending),
+			prefetchQueue.end());
+		if (takePrefetched(pending))
+			return;
+	}
+	requested.notify_all();
+}
+
+// Prepare files while idle
+void MeshLoader::prefetch(const std::vector<std::string>& filenames,
+	unsigned int optimize, VertexFormat format) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		wanted.clear();
+		for (auto& filename : filenames)
+			wanted.push_back({ filename, false, optimize, format });
+
+		// Drop what's no longer wanted and queue what's missing
+		prefetched.erase(std::remove_if(prefetched.begin(), prefetched.end(),
+			[this](const Prefetched& p) {
+				return std::find(wanted.begin(), wanted.end(), p.request) == wanted.end();
+			}), prefetched.end());
+		prefetchQueue.clear();
+		for (auto& req : wanted) {
+			bool done = std::any_of(prefetched.begin(), prefetched.end(),
+				[&req](const Prefetched& p) { return p.request == req; });
+			if (!done && !(prefetching && current == req))
+				prefetchQueue.push_back(req);
+		}
+	}
+	requested.notify_all();
+}
+
+// Fulfill the newest request from a prefetched file (with the lock held)
+bool MeshLoader::takePrefetched(const Request& req) {
+	for (auto it = prefetched.begin(); it != prefetched.end(); ++it) {
+		if (it->request == req) {
+			result = std::move(it->data);
+			prefetched.erase(it);
+			started = latest;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Forget the current request
+void MeshLoader::cancel() {
+	std::lock_guard<std::mutex> lock(mutex);
+	latest++;
+	started = latest;	// Nothing to start
+	active = false;
+	result.reset();
+	error = nullptr;
+}
+
+// Whether a request is waiting for its result to be taken
+bool MeshLoader::busy() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return active;
+}
+
+// Take the result of the current request if it's ready
+std::unique_ptr<Mesh::Prepared> MeshLoader::poll() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!active)
+		return nullptr;
+	if (error) {
+		std::exception_ptr e = error;
+		error = nullptr;
+		active = false;
+		std::rethrow_exception(e);
+	}
+	if (result)
+		active = false;
+	return std::move(result);
+}
+
+// Prepare requested files until told to stop
+void MeshLoader::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		requested.wait(lock, [this] {
+			return stopping || started < latest || !prefetchQueue.empty();
+		});
+		if (stopping)
+			return;
+
+		// Requests come before prefetches
+		uint64_t id = latest;
+		prefetching = started == latest;
+		if (prefetching) {
+			current = prefetchQueue.front();
+			prefetchQueue.pop_front();
+		} else {
+			current = pending;
+			started = id;
+		}
+		Request req = current;
+
+		// Prepare without holding the lock, so requests can come in meanwhile
+		lock.unlock();
+		std::unique_ptr<Mesh::Prepared> data;
+		std::exception_ptr e;
+		try {
+			data = std::unique_ptr<Mesh::Prepared>(new Mesh::Prepared(
+				Mesh::prepare(req.filename, req.keepLocalGeometry, req.optimize, req.format)));
+		} catch (...) {
+			e = std::current_exception();
+		}
+		lock.lock();
+
+		if (!prefetching) {
+			// Drop the result if a newer request or a cancel came in
+			if (id == latest) {
+				result = std::move(data);
+				error = e;
+			}
+		} else if (data) {
+			// The file may have been requested while we were prefetching it.
+			// Failed prefetches are dropped; the request will report the error.
+			if (started < latest && pending == req) {
+				result = std::move(data);
+				started = latest;
+			} else if (std::find(wanted.begin(), wanted.end(), req) != wanted.end())
+				prefetched.push_back({ req, std::move(data) });
+		}
+		prefetching = false;
+	}
+}
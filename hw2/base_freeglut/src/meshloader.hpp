@@ -0,0 +1,84 @@
+#ifndef MESHLOADER_HPP
+#define MESHLOADER_HPP
+
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include "mesh.hpp"
+
+// Prepares meshes on a background thread, so that parsing a file never
+// blocks the caller. Only the newest request matters: a request made while
+// another is running replaces it, and the older result is thrown away.
+// When there is no request, the thread prefetches files that are likely to
+// be requested next and holds on to them until they are.
+class MeshLoader {
+public:
+	MeshLoader();
+	~MeshLoader();	// Waits for the file being prepared, if any
+	// Disallow copy, move, & assignment
+	MeshLoader(const MeshLoader& other) = delete;
+	MeshLoader& operator=(const MeshLoader& other) = delete;
+	MeshLoader(MeshLoader&& other) = delete;
+	MeshLoader& operator=(MeshLoader&& other) = delete;
+
+	// Start preparing a file (see Mesh::prepare)
+	void request(const std::string& filename, bool keepLocalGeometry = false,
+		unsigned int optimize = MESHOPT_ALL, VertexFormat format = VERTEXFORMAT_QUANTIZED);
+	// Forget the current request; its result will be thrown away
+	void cancel();
+	// Whether a request is waiting for its result to be taken
+	bool busy() const;
+	// Take the result of the current request if it's ready (null otherwise).
+	// If preparing failed, the exception is rethrown here instead.
+	std::unique_ptr<Mesh::Prepared> poll();
+
+	// Prepare these files while idle, so that requesting them is quick.
+	// Replaces the previous list; prefetched files not in it are dropped.
+	void prefetch(const std::vector<std::string>& filenames,
+		unsigned int optimize = MESHOPT_ALL, VertexFormat format = VERTEXFORMAT_QUANTIZED);
+
+protected:
+	void workerLoop();
+
+	// A file to prepare
+	struct Request {
+		std::string filename;
+		bool keepLocalGeometry;
+		unsigned int optimize;
+		VertexFormat format;
+		bool operator==(const Request& other) const {
+			return filename == other.filename && keepLocalGeometry == other.keepLocalGeometry &&
+				optimize == other.optimize && format == other.format;
+		}
+	};
+	// A prefetched file
+	struct Prefetched {
+		Request request;
+		std::unique_ptr<Mesh::Prepared> data;
+	};
+	bool takePrefetched(const Request& req);	// Fulfill the newest request from a prefetch
+
+	std::thread worker;
+	mutable std::mutex mutex;				// Guards everything below
+	std::condition_variable requested;		// Signals the worker
+	Request pending;						// Newest request
+	uint64_t latest;						// Number of the newest request or cancel
+	uint64_t started;						// Number of the newest request the worker has taken
+	bool active;							// Whether the newest request's result is still wanted
+	std::unique_ptr<Mesh::Prepared> result;	// Result of the newest request, once ready
+	std::exception_ptr error;				// Or the reason there is none
+	std::vector<Request> wanted;			// Files to prefetch
+	std::deque<Request> prefetchQueue;		// Wanted files not prefetched yet
+	std::vector<Prefetched> prefetched;		// Wanted files already prefetched
+	bool prefetching;						// Whether the worker is prefetching current
+	Request current;						// File the worker is preparing
+	bool stopping;							// Tells the worker to exit
+};
+
+#endif
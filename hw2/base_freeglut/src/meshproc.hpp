@@ -0,0 +1,268 @@
+#ifndef MESHPROC_HPP
+#define MESHPROC_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <glm/glm.hpp>
+
+// Mesh processing stages shared by the loaders. Everything here works on
+// CPU-side arrays only and never touches OpenGL.
+
+// Optimization passes applied to indexed meshes (combine with |)
+enum MeshOptimize {
+	MESHOPT_NONE = 0,
+	MESHOPT_VERTEX_CACHE = 1,	// Reorder triangles for the post-transform cache
+	MESHOPT_OVERDRAW = 2,		// Reorder clusters of triangles to draw outer ones first
+	MESHOPT_VERTEX_FETCH = 4,	// Reorder vertices in the order they are first used
+	MESHOPT_LOD = 8,			// Add simplified levels of detail
+	MESHOPT_ALL = 15,
+};
+
+// Entries in the simulated post-transform vertex cache (FIFO)
+const unsigned int VERTEX_CACHE_SIZE = 16;
+
+// Post-transform cache efficiency of an index list
+struct VertexCacheStats {
+	float acmr;		// Average cache miss ratio: vertex shader runs per triangle
+	float atvr;		// Average transform to vertex ratio: vertex shader runs per vertex
+};
+
+// Cache efficiency measured before or after one optimization pass
+struct MeshPassStats {
+	const char* pass;		// Name of the pass ("input" for the unoptimized mesh)
+	VertexCacheStats cache;
+};
+
+// One level of detail: a range of the index buffer drawn instead of the
+// whole mesh. Level 0 is the full mesh; each further level has about half
+// the triangles of the one before.
+struct MeshLod {
+	uint32_t indexOffset;	// First index of the level
+	uint32_t indexCount;	// Number of indices
+	float error;			// Largest distance from the full mesh, relative to the bounding box diagonal
+};
+
+// Limits of the level of detail chain
+const unsigned int MAX_LODS = 8;			// Levels including the full mesh
+const unsigned int MIN_LOD_TRIANGLES = 64;	// Meshes below twice this aren't simplified
+const float MAX_LOD_ERROR = 0.05f;			// Relative to the bounding box diagonal
+
+// Vertex buffer layouts. Meshes are built with float vertices and only
+// packed into one of these for the GPU (and the binary cache).
+enum VertexFormat {
+	VERTEXFORMAT_FLOAT = 0,		// 32-bit float positions and normals
+	VERTEXFORMAT_HALF = 1,		// Half-float positions, 10:10:10 signed normalized normals
+	VERTEXFORMAT_QUANTIZED = 2,	// 16-bit positions within the bounding box, 10:10:10 normals
+};
+
+// Bytes taken by a position or a normal (positions are padded to 4-byte alignment)
+size_t positionSize(VertexFormat format);
+size_t normalSize(VertexFormat format);
+
+// Maps a stored position back to model space: pos = offset + scale * stored
+// (stored is what the vertex shader receives, e.g. in [0, 1] when normalized)
+struct PositionTransform {
+	glm::vec3 scale;
+	glm::vec3 offset;
+};
+PositionTransform positionTransform(VertexFormat format, glm::vec3 minBB, glm::vec3 maxBB);
+
+// Encode / decode one attribute (positionSize or normalSize bytes)
+void packPosition(VertexFormat format, glm::vec3 pos, const PositionTransform& xf, unsigned char* out);
+glm::vec3 unpackPosition(VertexFormat format, const unsigned char* in, const PositionTransform& xf);
+void packNormal(VertexFormat format, glm::vec3 norm, unsigned char* out);
+glm::vec3 unpackNormal(VertexFormat format, const unsigned char* in);
+
+// Largest errors we consider invisible: a pixel when the mesh spans a 4K
+// screen, and a normal tilt well below what shading can show
+const float MAX_POSITION_ERROR = 1.0f / 4096.0f;	// Relative to the bounding box diagonal
+const float MAX_NORMAL_ERROR = 0.5f;				// Degrees
+
+// Error introduced by packing a mesh into a vertex format
+struct QuantizationError {
+	float maxPosition;		// Largest position error relative to the bounding box diagonal
+	float maxNormal;		// Largest normal error in degrees
+	float meanNormal;		// Average normal error in degrees
+	size_t normalCount;		// Number of normals measured
+
+	QuantizationError() : maxPosition(0.0f), maxNormal(0.0f), meanNormal(0.0f), normalCount(0) {}
+	void addPosition(glm::vec3 original, glm::vec3 decoded, float diagonal);
+	void addNormal(glm::vec3 original, glm::vec3 decoded);
+	bool visible() const
+	{ return maxPosition > MAX_POSITION_ERROR || maxNormal > MAX_NORMAL_ERROR; }
+};
+
+// Size in bytes of the smallest index type that can address vertexCount vertices
+inline size_t indexSizeFor(size_t vertexCount) {
+	return vertexCount <= 0x10000 ? sizeof(uint16_t) : sizeof(uint32_t);
+}
+
+// Copy 32-bit indices into 16-bit ones (all indices must fit)
+std::vector<uint16_t> narrowIndices(const std::vector<unsigned int>& indices);
+
+// Hash of an object's bytes, read as 32-bit words
+inline uint32_t hashWords(const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint32_t h = 0x811C9DC5u;
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		uint32_t w;
+		memcpy(&w, bytes + i, 4);
+		h = (h ^ w) * 0x9E3779B1u;
+		h ^= h >> 15;
+	}
+	h ^= h >> 16; h *= 0x85EBCA6Bu;
+	h ^= h >> 13; h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// Merge bitwise-identical vertices. Each group of three corners is a
+// triangle; on return, unique holds one copy of every distinct vertex (in
+// order of first use) and indices holds one entry per corner.
+template <typename Vertex>
+void indexVertices(const std::vector<Vertex>& corners,
+	std::vector<Vertex>& unique, std::vector<unsigned int>& indices) {
+	static_assert(std::is_trivially_copyable<Vertex>::value,
+		"vertices are compared bitwise");
+	const unsigned int EMPTY = 0xFFFFFFFFu;
+
+	// Open-addressing table of indices into unique, at most half full
+	size_t tableSize = 16;
+	while (tableSize < corners.size() * 2) tableSize *= 2;
+	std::vector<unsigned int> table(tableSize, EMPTY);
+	size_t mask = tableSize - 1;
+
+	unique.clear();
+	indices.resize(corners.size());
+	for (size_t i = 0; i < corners.size(); i++) {
+		const Vertex& v = corners[i];
+		size_t slot = hashWords(&v, sizeof(Vertex)) & mask;
+		while (true) {
+			unsigned int u = table[slot];
+			if (u == EMPTY) {
+				// First time we've seen this vertex
+				u = (unsigned int)unique.size();
+				table[slot] = u;
+				unique.push_back(v);
+				indices[i] = u;
+				break;
+			}
+			if (memcmp(&unique[u], &v, sizeof(Vertex)) == 0) {
+				indices[i] = u;
+				break;
+			}
+			slot = (slot + 1) & mask;
+		}
+	}
+}
+
+// Angle-weighted vertex normals: every triangle adds its unit normal times
+// its angle at the vertex. Runs on the global thread pool (with SSE2 where
+// available); vertices no triangle uses, or only degenerate ones, get zero.
+std::vector<glm::vec3> computeSmoothNormals(const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& indices);
+
+// Simulate a FIFO post-transform cache over an index list
+VertexCacheStats analyzeVertexCache(const std::vector<unsigned int>& indices,
+	size_t vertexCount, unsigned int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder triangles for the post-transform cache (Tipsify, Sander et al. 2007).
+// If clusters is given, it receives the first triangle of every run that
+// starts after a dead end; these runs can be reordered without hurting the
+// cache much, which is what optimizeOverdraw needs.
+void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount,
+	std::vector<unsigned int>* clusters = nullptr, unsigned int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder clusters of triangles so that those facing away from the center of
+// the mesh are drawn first, which lowers overdraw from most view directions.
+// Clusters are split further wherever that costs at most a factor of
+// threshold in ACMR. Pass the clusters from optimizeVertexCache, or an
+// empty list to treat the whole mesh as one cluster.
+void optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& clusters, float threshold = 1.05f,
+	unsigned int cacheSize = VERTEX_CACHE_SIZE);
+
+// Reorder vertices in the order the index list first uses them, so that
+// vertex fetches walk through memory instead of jumping around
+template <typename Vertex>
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+	const unsigned int EMPTY = 0xFFFFFFFFu;
+	std::vector<unsigned int> remap(vertices.size(), EMPTY);
+	std::vector<Vertex> reordered;
+	reordered.reserve(vertices.size());
+	for (auto& index : indices) {
+		if (remap[index] == EMPTY) {
+			remap[index] = (unsigned int)reordered.size();
+			reordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices.swap(reordered);
+}
+
+// Simplify an indexed mesh by collapsing edges (Garland & Heckbert 1997),
+// cheapest first by quadric error, until at most targetIndexCount indices
+// are left or collapsing further would move the surface by more than
+// maxError. Vertices only ever move onto other vertices, so the result
+// indexes the same vertex array. Open boundaries only shrink along
+// themselves; non-manifold parts don't change. resultError receives the
+// largest error of a collapse, and sourceTriangles the input triangle
+// each output triangle came from (its corners stay in the same order).
+std::vector<unsigned int> simplifyMesh(const std::vector<glm::vec3>& positions,
+	const std::vector<unsigned int>& indices, size_t targetIndexCount, float maxError,
+	float* resultError = nullptr, std::vector<unsigned int>* sourceTriangles = nullptr);
+
+// Append levels of detail to an index list by simplifying each level to
+// half of the one before, until MAX_LODS levels, MIN_LOD_TRIANGLES or
+// MAX_LOD_ERROR. Levels after the first are reordered for the vertex cache.
+// sourceTriangles receives the triangle of the first level each triangle
+// of the result came from.
+std::vector<MeshLod> buildLodChain(const std::vector<glm::vec3>& positions,
+	std::vector<unsigned int>& indices, std::vector<unsigned int>* sourceTriangles = nullptr);
+
+// Coarsest level whose error is at most maxPixelError when the bounding box
+// diagonal covers diagonalPixels on screen. Below a pixel of error,
+// switching levels can't be seen.
+unsigned int selectLod(const std::vector<MeshLod>& lods, float diagonalPixels,
+	float maxPixelError = 1.0f);
+
+// Whether every one of indexCount stored indices of indexSize bytes (2 or 4)
+// is below vertexCount
+bool indicesFit(const void* indices, size_t indexCount, size_t indexSize, size_t vertexCount);
+
+// Whether lodBytes of stored levels of detail (e.g. from a cache) are whole
+// MeshLod records that each lie within an index buffer of indexCount indices
+bool lodsFit(const void* lods, size_t lodBytes, size_t indexCount);
+
+// Run the requested passes over an indexed mesh. Returns the cache
+// statistics of the input followed by those after each pass that ran.
+// MESHOPT_LOD is left to the caller (see buildLodChain), since the levels
+// are drawn from the same vertices as the full mesh.
+template <typename Vertex>
+std::vector<MeshPassStats> optimizeMesh(std::vector<Vertex>& vertices,
+	std::vector<unsigned int>& indices, unsigned int passes) {
+	std::vector<MeshPassStats> stats;
+	stats.push_back({ "input", analyzeVertexCache(indices, vertices.size()) });
+
+	std::vector<unsigned int> clusters;
+	if (passes & MESHOPT_VERTEX_CACHE) {
+		optimizeVertexCache(indices, vertices.size(), &clusters);
+		stats.push_back({ "vertex cache", analyzeVertexCache(indices, vertices.size()) });
+	}
+	if (passes & MESHOPT_OVERDRAW) {
+		std::vector<glm::vec3> positions(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++)
+			positions[i] = vertices[i].pos;
+		optimizeOverdraw(indices, positions, clusters);
+		stats.push_back({ "overdraw", analyzeVertexCache(indices, vertices.size()) });
+	}
+	if (passes & MESHOPT_VERTEX_FETCH) {
+		optimizeVertexFetch(vertices, indices);
+		stats.push_back({ "vertex fetch", analyzeVertexCache(indices, vertices.size()) });
+	}
+	return stats;
+}
+
+#endif
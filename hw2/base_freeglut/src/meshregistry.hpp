@@ -0,0 +1,78 @@
+#ifndef MESHREGISTRY_HPP
+#define MESHREGISTRY_HPP
+
+#include <string>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include "mesh.hpp"
+
+// Meshes loaded anywhere in the program, so that each distinct asset is
+// parsed and uploaded once no matter how many objects or views use it.
+// Assets are keyed by canonical path and content hash (plus load options),
+// so different spellings of a path share a mesh while an edited file gets a
+// new one. Handles are reference counted; the registry only remembers meshes
+// while some handle to them is alive.
+class MeshRegistry {
+public:
+	MeshRegistry() : peakBytes(0) {}
+	// Disallow copy, move, & assignment
+	MeshRegistry(const MeshRegistry& other) = delete;
+	MeshRegistry& operator=(const MeshRegistry& other) = delete;
+	MeshRegistry(MeshRegistry&& other) = delete;
+	MeshRegistry& operator=(MeshRegistry&& other) = delete;
+
+	// Registry shared by the whole program
+	static MeshRegistry& global();
+
+	typedef std::shared_ptr<const Mesh> Handle;	// Shared, immutable mesh
+	// What identifies an asset
+	struct Key {
+		std::string path;		// Canonical path of the source file
+		uint64_t hash;			// Content hash of the source file
+		unsigned int optimize;	// Optimization passes (MeshOptimize flags)
+		VertexFormat format;	// Vertex buffer layout
+		bool operator<(const Key& other) const {
+			return std::tie(path, hash, optimize, format) <
+				std::tie(other.path, other.hash, other.optimize, other.format);
+		}
+	};
+	// Key of a file loaded with the given options (reads the file to hash it
+	// unless its binary cache is up to date)
+	static Key makeKey(const std::string& filename, unsigned int optimize, VertexFormat format);
+
+	// Mesh for a key if some handle to it is alive, or null
+	Handle find(const Key& key);
+	// Mesh for a key, calling load to create it if there is none. Callers
+	// asking for a key that another thread is loading wait for that load and
+	// share its mesh. If load throws, the exception reaches this caller only
+	// and the next waiting caller tries again.
+	Handle acquire(const Key& key, const std::function<std::unique_ptr<Mesh>()>& load);
+	// Mesh for a file, constructing it on this thread (which must own the
+	// OpenGL context) if there is none
+	Handle acquire(const std::string& filename, unsigned int optimize = MESHOPT_ALL,
+		VertexFormat format = VERTEXFORMAT_QUANTIZED);
+
+	size_t getCount();			// Number of live meshes
+	size_t getGpuBytes();		// GPU memory of live meshes
+	size_t getPeakGpuBytes();	// Most GPU memory live meshes have taken at once
+
+protected:
+	struct Entry {
+		std::weak_ptr<const Mesh> mesh;
+		size_t bytes;	// GPU memory of the mesh
+		bool loading;	// Whether a caller is creating the mesh
+	};
+	size_t prune();		// Forget meshes with no handles left and return the live bytes
+
+	std::mutex mutex;					// Guards everything below
+	std::condition_variable loaded;		// Signals the end of a load
+	std::map<Key, Entry> entries;
+	size_t peakBytes;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#define NOMINMAX
+#include "meshresidency.hpp"
+#include <iostream>
+
+// Find a resident mesh and mark it as used
+MeshRegistry::Handle MeshResidency::find(const std::string& filename, unsigned int optimize, VertexFormat format) {
+	auto it = index.find(Key(filename, optimize, format));
+	if (it == index.end())
+		return nullptr;
+	entries.splice(entries.begin(), entries, it->second);
+	return entries.front().mesh;
+}
+
+// Whether a mesh is resident (doesn't count as a use)
+bool MeshResidency::contains(const std::string& filename, unsigned int optimize,
+	VertexFormat format) const {
+	return index.count(Key(filename, optimize, format)) > 0;
+}
+
+// Make a mesh resident
+MeshRegistry::Handle MeshResidency::insert(const std::string& filename, unsigned int optimize,
+	VertexFormat format, MeshRegistry::Handle mesh) {
+	Key key(filename, optimize, format);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		bytes -= it->second->bytes;
+		entries.erase(it->second);
+		index.erase(it);
+	}
+
+	size_t meshBytes = mesh->getGpuBytes();
+	entries.push_front({ key, std::move(mesh), meshBytes });
+	index[key] = entries.begin();
+	bytes += meshBytes;
+	evict();
+	return entries.front().mesh;
+}
+
+// Release all meshes
+void MeshResidency::clear() {
+	entries.clear();
+	index.clear();
+	bytes = 0;
+}
+
+// Change the budget
+void MeshResidency::setBudget(size_t budgetBytes) {
+	budget = budgetBytes;
+	evict();
+}
+
+// Drop least recently used meshes until within budget
+void MeshResidency::evict() {
+	while (bytes > budget && entries.size() > 1) {
+		Entry& lru = entries.back();
+		std::cout << "Evicted " << std::get<0>(lru.key) << " (" << lru.bytes / 1024
+			<< " KB) from GPU memory" << std::endl;
+		bytes -= lru.bytes;
+		index.erase(lru.key);
+		entries.pop_back();
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef MESHRESIDENCY_HPP
+#define MESHRESIDENCY_HPP
+
+#include <string>
+#include <memory>
+#include <list>
+#include <map>
+#include <tuple>
+#include "mesh.hpp"
+#include "meshregistry.hpp"
+
+// Keeps recently shown meshes on the GPU so that showing them again needs no
+// load. Meshes are evicted least recently used first once their buffers take
+// more than the budget; the most recently used mesh is never evicted. Evicted
+// meshes are released once no other handle to them is left.
+class MeshResidency {
+public:
+	MeshResidency(size_t budgetBytes = DEFAULT_BUDGET) : budget(budgetBytes), bytes(0) {}
+	// Disallow copy, move, & assignment
+	MeshResidency(const MeshResidency& other) = delete;
+	MeshResidency& operator=(const MeshResidency& other) = delete;
+	MeshResidency(MeshResidency&& other) = delete;
+	MeshResidency& operator=(MeshResidency&& other) = delete;
+
+	static const size_t DEFAULT_BUDGET = (size_t)512 << 20;	// 512 MB
+
+	// Resident mesh for a file loaded with the given options, or null. The
+	// mesh becomes the most recently used one.
+	MeshRegistry::Handle find(const std::string& filename, unsigned int optimize, VertexFormat format);
+	bool contains(const std::string& filename, unsigned int optimize, VertexFormat format) const;
+	// Make a mesh resident as the most recently used one (replacing any
+	// mesh for the same key), then evict down to the budget
+	MeshRegistry::Handle insert(const std::string& filename, unsigned int optimize, VertexFormat format,
+		MeshRegistry::Handle mesh);
+	void clear();
+
+	size_t getBudget() const { return budget; }
+	void setBudget(size_t budgetBytes);		// Evicts if needed
+	size_t getBytes() const { return bytes; }	// GPU memory of resident meshes
+	size_t getCount() const { return entries.size(); }
+
+protected:
+	typedef std::tuple<std::string, unsigned int, VertexFormat> Key;	// File and load options
+	struct Entry {
+		Key key;
+		MeshRegistry::Handle mesh;
+		size_t bytes;	// GPU memory of the mesh
+	};
+	void evict();	// Drop least recently used meshes until within budget
+
+	std::list<Entry> entries;	// Most recently used first
+	std::map<Key, std::list<Entry>::iterator> index;	// Entry of each key
+	size_t budget;				// Memory budget in bytes
+	size_t bytes;				// Memory used by all entries
+};
+
+#endif
@@ -0,0 +1,387 @@
+#define NOMINMAX
+#include "objloader.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Map a file into memory
+MappedFile::MappedFile(const std::string& filename) :
+	bytes(nullptr),
+	length(0) {
+
+	std::stringstream ss;
+	ss << "Error reading " << filename << ": failed to open file";
+
+#if defined(_WIN32)
+	fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	mapHandle = NULL;
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(ss.str());
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	length = (size_t)fileSize.QuadPart;
+	if (length > 0) {
+		mapHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapHandle)
+			bytes = (const char*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+		if (!bytes) {
+			if (mapHandle) CloseHandle(mapHandle);
+			CloseHandle(fileHandle);
+			throw std::runtime_error(ss.str());
+		}
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error(ss.str());
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error(ss.str());
+	}
+	length = (size_t)st.st_size;
+	if (length > 0) {
+		void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error(ss.str());
+		}
+		madvise(addr, length, MADV_SEQUENTIAL);
+		bytes = (const char*)addr;
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+#endif
+}
+
+// Unmap the file
+MappedFile::~MappedFile() {
+#if defined(_WIN32)
+	if (bytes) UnmapViewOfFile(bytes);
+	if (mapHandle) CloseHandle(mapHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+#else
+	if (bytes) munmap((void*)bytes, length);
+#endif
+}
+
+namespace {
+
+// Files smaller than this are parsed on the calling thread
+const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// Thrown by the tokenizer; converted to a runtime_error with a line number
+struct ObjSyntaxError {
+	const char* where;
+	const char* what;
+};
+
+// Records parsed from one line-aligned range of the file. Positive indices
+// are absolute already; negative ones are resolved against the chunk's own
+// counts and listed in relV/relN so they can be offset once the number of
+// records in earlier chunks is known.
+struct ObjChunk {
+	ObjData data;
+	std::vector<size_t> relV;		// Entries of v_elements holding chunk-relative indices
+	std::vector<size_t> relN;		// Entries of n_elements holding chunk-relative indices
+	bool allFacesHaveNormals = true;
+};
+
+// Tokenizes a range of an OBJ file without copying or allocating per token
+class ObjTokenizer {
+public:
+	ObjTokenizer(const char* begin, const char* end) : p(begin), end(end) {}
+
+	// Parse every record in the range, appending to out
+	void parse(ObjChunk& out) {
+		ObjData& data = out.data;
+		while (p < end) {
+			skipBlanks();
+			if (p >= end) break;
+			if (p[0] == 'v' && isBlank(1)) {
+				// Position (advance past the tag only, so a bare "v" fails on
+				// reaching the end of its line rather than reading the next)
+				p += 1;
+				glm::vec3 vert = readVec3();
+				data.positions.push_back(vert);
+				data.minBB = glm::min(data.minBB, vert);
+				data.maxBB = glm::max(data.maxBB, vert);
+			} else if (p[0] == 'v' && p + 1 < end && p[1] == 'n' && isBlank(2)) {
+				// Normal
+				p += 2;
+				data.normals.push_back(readVec3());
+			} else if (p[0] == 'f' && isBlank(1)) {
+				// Face
+				p += 1;
+				readFace(out);
+			}
+			skipLine();
+		}
+	}
+
+protected:
+	const char* p;		// Current read position
+	const char* end;	// End of the range
+
+	// Polygon corner indices (zero-based)
+	struct Corner {
+		unsigned int v, n;
+		bool relV, relN;	// Whether v / n are relative to the chunk
+		bool hasNormal;
+	};
+
+	bool isBlank(size_t offset) const {
+		return p + offset >= end || p[offset] == ' ' || p[offset] == '\t' ||
+			p[offset] == '\r' || p[offset] == '\n';
+	}
+	// Skip spaces and tabs (and a stray '\r' from CRLF line endings)
+	void skipBlanks() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+	}
+	void skipLine() {
+		const char* nl = (const char*)memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
+	bool atLineEnd() const {
+		return p >= end || *p == '\n' || *p == '#';
+	}
+
+	float readFloat() {
+		skipBlanks();
+		if (p < end && *p == '+') ++p;	// from_chars rejects a leading '+'
+		float value;
+		auto result = std::from_chars(p, end, value);
+		if (result.ec != std::errc())
+			throw ObjSyntaxError{ p, "expected a number" };
+		p = result.ptr;
+		return value;
+	}
+	glm::vec3 readVec3() {
+		float x = readFloat();
+		float y = readFloat();
+		float z = readFloat();
+		return glm::vec3(x, y, z);
+	}
+
+	// Read a one-based (or negative, relative) index and convert it to zero-based.
+	// Relative indices are resolved against count, the number of records
+	// read so far in this chunk, and may still be negative.
+	unsigned int readIndex(size_t count, bool& relative) {
+		long long value;
+		auto result = std::from_chars(p, end, value);
+		if (result.ec != std::errc() || value == 0)
+			throw ObjSyntaxError{ p, "invalid face index" };
+		p = result.ptr;
+		relative = value < 0;
+		if (relative)
+			return (unsigned int)(int)((long long)count + value);
+		return (unsigned int)(value - 1);
+	}
+
+	// Read a corner of the form v, v/vt, v//vn or v/vt/vn
+	Corner readCorner(const ObjData& data) {
+		Corner c = { 0, 0, false, false, false };
+		c.v = readIndex(data.positions.size(), c.relV);
+		if (p < end && *p == '/') {
+			++p;
+			// Skip the texture coordinate, which we don't use
+			while (p < end && *p != '/' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') ++p;
+			if (p < end && *p == '/') {
+				++p;
+				c.n = readIndex(data.normals.size(), c.relN);
+				c.hasNormal = true;
+			}
+		}
+		return c;
+	}
+
+	void emit(ObjChunk& out, const Corner& c) {
+		if (c.relV) out.relV.push_back(out.data.v_elements.size());
+		out.data.v_elements.push_back(c.v);
+	}
+	void emitNormal(ObjChunk& out, const Corner& c) {
+		if (c.relN) out.relN.push_back(out.data.n_elements.size());
+		out.data.n_elements.push_back(c.n);
+	}
+
+	// Read a polygon, emitting it as a triangle fan
+	void readFace(ObjChunk& out) {
+		Corner first, prev;
+		int count = 0;
+		skipBlanks();
+		while (!atLineEnd()) {
+			Corner c = readCorner(out.data);
+			if (count >= 2) {
+				emit(out, first);
+				emit(out, prev);
+				emit(out, c);
+				if (first.hasNormal && prev.hasNormal && c.hasNormal) {
+					emitNormal(out, first);
+					emitNormal(out, prev);
+					emitNormal(out, c);
+				} else
+					out.allFacesHaveNormals = false;
+			} else if (count == 0)
+				first = c;
+			prev = c;
+			count++;
+			skipBlanks();
+		}
+		if (count < 3)
+			throw ObjSyntaxError{ p, "face has fewer than 3 vertices" };
+	}
+};
+
+// Copy a chunk's elements to their final place (dst may alias src),
+// offsetting relative indices. Returns the largest index written, or -1 if a relative index is out of range.
+long long mergeElements(const std::vector<unsigned int>& src, const std::vector<size_t>& rel,
+	size_t base, unsigned int* dst) {
+
+	unsigned int maxIndex = 0;
+	for (size_t i = 0; i < src.size(); i++) {
+		dst[i] = src[i];
+		maxIndex = std::max(maxIndex, src[i]);
+	}
+	for (size_t r : rel) {
+		long long value = (long long)(int)src[r] + (long long)base;
+		if (value < 0)
+			return -1;
+		dst[r] = (unsigned int)value;
+	}
+	// Relative entries may have been counted as huge values above; rescan them
+	if (!rel.empty()) {
+		maxIndex = 0;
+		for (size_t i = 0; i < src.size(); i++)
+			maxIndex = std::max(maxIndex, dst[i]);
+	}
+	return maxIndex;
+}
+
+}
+
+// Parse an OBJ file from a memory mapping
+ObjData parseObj(const std::string& filename, ObjLoadStats* stats, unsigned int threads) {
+	auto start = std::chrono::steady_clock::now();
+
+	MappedFile file(filename);
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+
+	// Split the file into line-aligned chunks
+	ThreadPool& pool = ThreadPool::global();
+	if (threads == 0)
+		threads = pool.size();
+	size_t numChunks = std::min<size_t>((size_t)threads * 4, file.size() / MIN_CHUNK_BYTES);
+	if (threads <= 1 || numChunks < 2)
+		numChunks = 1;
+	std::vector<const char*> bounds(numChunks + 1);
+	bounds[0] = begin;
+	bounds[numChunks] = end;
+	for (size_t i = 1; i < numChunks; i++) {
+		const char* split = std::max(bounds[i - 1], begin + file.size() * i / numChunks);
+		const char* nl = (const char*)memchr(split, '\n', end - split);
+		bounds[i] = nl ? nl + 1 : end;
+	}
+
+	// Parse the chunks
+	std::vector<ObjChunk> chunks(numChunks);
+	auto parseChunk = [&](size_t i) {
+		chunks[i].data.minBB = glm::vec3(std::numeric_limits<float>::max());
+		chunks[i].data.maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+		ObjTokenizer tokenizer(bounds[i], bounds[i + 1]);
+		tokenizer.parse(chunks[i]);
+	};
+	try {
+		if (numChunks == 1)
+			parseChunk(0);
+		else
+			pool.run(numChunks, parseChunk);
+	} catch (const ObjSyntaxError& e) {
+		std::stringstream ss;
+		ss << "Error reading " << filename << ": line "
+			<< std::count(begin, e.where, '\n') + 1 << ": " << e.what;
+		throw std::runtime_error(ss.str());
+	}
+
+	// Offsets of each chunk in the merged arrays
+	std::vector<size_t> posBase(numChunks + 1, 0), normBase(numChunks + 1, 0);
+	std::vector<size_t> vBase(numChunks + 1, 0), nBase(numChunks + 1, 0);
+	bool allFacesHaveNormals = true;
+	ObjData obj;
+	obj.minBB = glm::vec3(std::numeric_limits<float>::max());
+	obj.maxBB = glm::vec3(std::numeric_limits<float>::lowest());
+	for (size_t i = 0; i < numChunks; i++) {
+		const ObjData& d = chunks[i].data;
+		posBase[i + 1] = posBase[i] + d.positions.size();
+		normBase[i + 1] = normBase[i] + d.normals.size();
+		vBase[i + 1] = vBase[i] + d.v_elements.size();
+		nBase[i + 1] = nBase[i] + d.n_elements.size();
+		allFacesHaveNormals = allFacesHaveNormals && chunks[i].allFacesHaveNormals;
+		obj.minBB = glm::min(obj.minBB, d.minBB);
+		obj.maxBB = glm::max(obj.maxBB, d.maxBB);
+	}
+
+	// Merge the chunks into the final arrays
+	std::vector<long long> maxV(numChunks), maxN(numChunks, 0);
+	if (numChunks == 1) {
+		// Nothing to merge; take the arrays and fix up relative indices in place
+		ObjChunk& c = chunks[0];
+		obj.positions.swap(c.data.positions);
+		obj.normals.swap(c.data.normals);
+		obj.v_elements.swap(c.data.v_elements);
+		maxV[0] = mergeElements(obj.v_elements, c.relV, 0, obj.v_elements.data());
+		if (allFacesHaveNormals) {
+			obj.n_elements.swap(c.data.n_elements);
+			maxN[0] = mergeElements(obj.n_elements, c.relN, 0, obj.n_elements.data());
+		}
+	} else {
+		obj.positions.resize(posBase[numChunks]);
+		obj.normals.resize(normBase[numChunks]);
+		obj.v_elements.resize(vBase[numChunks]);
+		if (allFacesHaveNormals)
+			obj.n_elements.resize(nBase[numChunks]);
+		pool.run(numChunks, [&](size_t i) {
+			ObjChunk& c = chunks[i];
+			std::copy(c.data.positions.begin(), c.data.positions.end(), obj.positions.begin() + posBase[i]);
+			std::copy(c.data.normals.begin(), c.data.normals.end(), obj.normals.begin() + normBase[i]);
+			maxV[i] = mergeElements(c.data.v_elements, c.relV, posBase[i], obj.v_elements.data() + vBase[i]);
+			if (allFacesHaveNormals)
+				maxN[i] = mergeElements(c.data.n_elements, c.relN, normBase[i], obj.n_elements.data() + nBase[i]);
+			c = ObjChunk();		// Free the chunk's memory as soon as it's merged
+		});
+	}
+
+	// Check for indices referring outside of the arrays
+	for (size_t i = 0; i < numChunks; i++) {
+		bool vBad = maxV[i] < 0 || (vBase[i + 1] > vBase[i] && maxV[i] >= (long long)obj.positions.size());
+		bool nBad = maxN[i] < 0 || (nBase[i + 1] > nBase[i] && maxN[i] >= (long long)obj.normals.size());
+		if (vBad || nBad) {
+			std::stringstream ss;
+			ss << "Error reading " << filename << ": face index out of range";
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	if (stats) {
+		stats->bytes = file.size();
+		stats->threads = (unsigned int)std::min<size_t>(numChunks, pool.size());
+		stats->seconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	}
+	return obj;
+}
@@ -0,0 +1,59 @@
+#ifndef OBJLOADER_HPP
+#define OBJLOADER_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+// Read-only view of a whole file, mapped into memory
+class MappedFile {
+public:
+	MappedFile(const std::string& filename);
+	~MappedFile();
+	// Disallow copy, move, & assignment
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator=(const MappedFile& other) = delete;
+	MappedFile(MappedFile&& other) = delete;
+	MappedFile& operator=(MappedFile&& other) = delete;
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+protected:
+	const char* bytes;	// Start of the mapping (null for empty files)
+	size_t length;		// Size of the file in bytes
+#if defined(_WIN32)
+	void* fileHandle;	// Win32 file handle
+	void* mapHandle;	// Win32 file mapping handle
+#endif
+};
+
+// Geometry read from a wavefront OBJ file
+struct ObjData {
+	std::vector<glm::vec3> positions;		// "v" records
+	std::vector<glm::vec3> normals;			// "vn" records
+	std::vector<unsigned int> v_elements;	// Position index of each triangle corner
+	std::vector<unsigned int> n_elements;	// Normal index of each corner (empty if any face lacks normals)
+	glm::vec3 minBB;						// Bounding box of the positions
+	glm::vec3 maxBB;
+};
+
+// Timing of a single parse
+struct ObjLoadStats {
+	size_t bytes = 0;		// Size of the source file
+	double seconds = 0.0;	// Wall-clock time spent mapping and parsing
+	unsigned int threads = 1;	// Number of threads that parsed the file
+	double throughput() const	// Parse rate in MB/s
+	{ return seconds > 0.0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0.0; }
+};
+
+// Parse an OBJ file in place from a memory mapping. Polygons are
+// triangulated as fans, negative (relative) indices are resolved, and
+// "v", "v/vt", "v//vn" and "v/vt/vn" corners are all accepted.
+// Large files are split at line boundaries and parsed on up to `threads`
+// threads (0 = all cores, 1 = serial); the result is the same either way.
+ObjData parseObj(const std::string& filename, ObjLoadStats* stats = nullptr,
+	unsigned int threads = 0);
+
+#endif
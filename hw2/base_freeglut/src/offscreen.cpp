@@ -0,0 +1,190 @@
+#define NOMINMAX
+#define EGL_NO_X11
+#include "offscreen.hpp"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Whether a space-separated EGL extension string lists an extension
+bool hasEGLExtension(const char* extensions, const char* name) {
+	if (!extensions)
+		return false;
+	size_t length = strlen(name);
+	for (const char* p = extensions; (p = strstr(p, name)) != nullptr; p += length) {
+		if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+// Throw an exception with the last EGL error
+void throwEGLError(const char* what) {
+	std::stringstream ss;
+	ss << "Failed to " << what << " (EGL error 0x" << std::hex << eglGetError() << ")";
+	throw std::runtime_error(ss.str());
+}
+
+// Display that needs no window system: Mesa's surfaceless platform if the
+// EGL library has it, else the default display
+EGLDisplay openDisplay() {
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (hasEGLExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+		auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+			eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (getPlatformDisplay) {
+			EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+			if (display != EGL_NO_DISPLAY)
+				return display;
+		}
+	}
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+}
+
+// Create the context and the framebuffer, and make them current
+OffscreenContext::OffscreenContext(int w, int h) :
+	width(w), height(h),
+	display(EGL_NO_DISPLAY),
+	context(EGL_NO_CONTEXT),
+	surface(EGL_NO_SURFACE),
+	fbo(0),
+	colorRb(0),
+	depthRb(0) {
+
+	if (w <= 0 || h <= 0)
+		throw std::runtime_error("Offscreen framebuffer must not be empty");
+	// Open and initialize the display
+	EGLDisplay dpy = openDisplay();
+	if (dpy == EGL_NO_DISPLAY)
+		throwEGLError("open an EGL display");
+	if (!eglInitialize(dpy, nullptr, nullptr))
+		throwEGLError("initialize EGL");
+	display = dpy;
+
+	try {
+		if (!eglBindAPI(EGL_OPENGL_API))
+			throwEGLError("select the OpenGL API");
+		// Any config that can draw OpenGL into a pbuffer (one is only made if
+		// the context can't be current without a surface)
+		const EGLint configAttribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE };
+		EGLConfig config;
+		EGLint numConfigs = 0;
+		if (!eglChooseConfig(dpy, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+			throwEGLError("find an EGL config for OpenGL");
+
+		// Same context version and profile as the windowed viewer
+		const EGLint contextAttribs[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE };
+		context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+		if (context == EGL_NO_CONTEXT)
+			throwEGLError("create an OpenGL 3.3 core context");
+
+		if (!hasEGLExtension(eglQueryString(dpy, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+			const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+			surface = eglCreatePbufferSurface(dpy, config, pbufferAttribs);
+			if (surface == EGL_NO_SURFACE)
+				throwEGLError("create a pbuffer");
+		}
+		if (!eglMakeCurrent(dpy, (EGLSurface)surface, (EGLSurface)surface, (EGLContext)context))
+			throwEGLError("make the OpenGL context current");
+
+		// Color and depth buffers to draw into
+		glGenRenderbuffers(1, &colorRb);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorRb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glGenRenderbuffers(1, &depthRb);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthRb);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRb);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRb);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::stringstream ss;
+			ss << "Offscreen framebuffer of " << width << "x" << height << " is not supported";
+			throw std::runtime_error(ss.str());
+		}
+		glViewport(0, 0, width, height);
+
+	} catch (const std::exception&) {
+		release();
+		throw;
+	}
+}
+
+// Destructor
+OffscreenContext::~OffscreenContext() {
+	release();
+}
+
+// Release the framebuffer and the context
+void OffscreenContext::release() {
+	if (context != EGL_NO_CONTEXT) {
+		if (fbo) glDeleteFramebuffers(1, &fbo);
+		if (colorRb) glDeleteRenderbuffers(1, &colorRb);
+		if (depthRb) glDeleteRenderbuffers(1, &depthRb);
+		fbo = colorRb = depthRb = 0;
+		eglMakeCurrent((EGLDisplay)display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext((EGLDisplay)display, (EGLContext)context);
+		context = EGL_NO_CONTEXT;
+	}
+	if (surface != EGL_NO_SURFACE) {
+		eglDestroySurface((EGLDisplay)display, (EGLSurface)surface);
+		surface = EGL_NO_SURFACE;
+	}
+	if (display != EGL_NO_DISPLAY) {
+		eglTerminate((EGLDisplay)display);
+		display = EGL_NO_DISPLAY;
+	}
+}
+
+// Name of the renderer
+std::string OffscreenContext::getRenderer() const {
+	const GLubyte* renderer = glGetString(GL_RENDERER);
+	return renderer ? (const char*)renderer : "";
+}
+
+// Read back the framebuffer, flipped so the top row comes first
+std::vector<unsigned char> OffscreenContext::readPixels() const {
+	size_t rowBytes = (size_t)width * 3;
+	std::vector<unsigned char> rows((size_t)height * rowBytes);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+
+	std::vector<unsigned char> pixels(rows.size());
+	for (int y = 0; y < height; y++)
+		memcpy(&pixels[y * rowBytes], &rows[(height - 1 - y) * rowBytes], rowBytes);
+	return pixels;
+}
+
+// Write the framebuffer to a file
+void OffscreenContext::writeImage(const std::string& filename) const {
+	std::vector<unsigned char> pixels = readPixels();
+	std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		std::stringstream ss;
+		ss << "Error writing " << filename << ": failed to open file";
+		throw std::runtime_error(ss.str());
+	}
+	out << "P6\n" << width << " " << height << "\n255\n";
+	out.write((const char*)pixels.data(), pixels.size());
+	if (!out) {
+		std::stringstream ss;
+		ss << "Error writing " << filename;
+		throw std::runtime_error(ss.str());
+	}
+}
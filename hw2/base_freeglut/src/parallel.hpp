@@ -0,0 +1,76 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Fixed set of worker threads that run batches of tasks
+class ThreadPool {
+public:
+	ThreadPool(unsigned int threads = 0);	// 0 = one thread per core
+	~ThreadPool();
+	// Disallow copy, move, & assignment
+	ThreadPool(const ThreadPool& other) = delete;
+	ThreadPool& operator=(const ThreadPool& other) = delete;
+	ThreadPool(ThreadPool&& other) = delete;
+	ThreadPool& operator=(ThreadPool&& other) = delete;
+
+	// Pool shared by the whole program
+	static ThreadPool& global();
+
+	// Number of threads that work on a batch (workers plus the caller)
+	unsigned int size() const { return (unsigned int)workers.size() + 1; }
+
+	// Call fn(i) for every i in [0, count) and wait for all of them to finish.
+	// The calling thread helps with this batch only (never with batches queued
+	// by other threads), so batches may be nested and a short batch doesn't
+	// wait behind a long one. The first exception thrown by a task is
+	// rethrown here.
+	void run(size_t count, const std::function<void(size_t)>& fn);
+
+protected:
+	// Tasks of one call to run(), handed out by index
+	struct Batch {
+		const std::function<void(size_t)>* fn;
+		size_t count;
+		size_t next;				// Next index to hand out
+		size_t remaining;			// Tasks not finished yet
+		std::exception_ptr error;	// First exception thrown by a task
+	};
+
+	void workerLoop();
+	bool runOne(Batch& batch, std::unique_lock<std::mutex>& lock);	// Run the batch's next task if it has one
+
+	std::vector<std::thread> workers;
+	std::deque<Batch*> batches;				// Batches with tasks not handed out yet
+	std::mutex mutex;						// Guards batches and stopping
+	std::condition_variable taskAdded;		// Signals workers
+	std::condition_variable taskDone;		// Signals callers waiting in run()
+	bool stopping;
+};
+
+// Split [begin, end) into contiguous blocks of at least grain elements and
+// call fn(blockBegin, blockEnd) for each block on the global pool
+template <typename Fn>
+void parallelFor(size_t begin, size_t end, size_t grain, Fn fn) {
+	if (end <= begin) return;
+	ThreadPool& pool = ThreadPool::global();
+	size_t n = end - begin;
+	size_t blocks = std::min<size_t>((n + grain - 1) / std::max<size_t>(grain, 1), pool.size() * 4);
+	if (blocks <= 1) {
+		fn(begin, end);
+		return;
+	}
+	pool.run(blocks, [&](size_t b) {
+		fn(begin + n * b / blocks, begin + n * (b + 1) / blocks);
+	});
+}
+
+#endif
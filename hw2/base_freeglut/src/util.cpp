@@ -1,10 +1,80 @@
+#define NOMINMAX
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
 #include "util.hpp"
+#if defined(_WIN32)
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+namespace fs = std::filesystem;
 
-// Compile a single shader stage
-GLuint compileShader(GLenum type, const std::string& filename) {
+namespace {
+
+const char MAGIC[8] = { 'P', 'R', 'O', 'G', 'B', 'I', 'N', '1' };
+
+// Header of a program binary file; the binary follows
+struct ProgramCacheHeader {
+	char magic[8];			// "PROGBIN1"
+	uint64_t key;			// Hash of the sources and the driver
+	uint32_t format;		// Driver-defined binary format
+	uint32_t size;			// Size of the binary in bytes
+};
+
+// 64-bit FNV-1a hash of a string, continuing from h
+uint64_t hashString(const std::string& str, uint64_t h = 0xCBF29CE484222325ULL) {
+	for (unsigned char c : str) {
+		h ^= c;
+		h *= 0x100000001B3ULL;
+	}
+	// Also hash the length, so consecutive strings can't run together
+	h ^= str.length();
+	return h * 0x100000001B3ULL;
+}
+
+// String of the current context (empty if the driver doesn't report it)
+std::string glString(GLenum name) {
+	const GLubyte* str = glGetString(name);
+	return str ? (const char*)str : "";
+}
+
+// Whether the driver supports an extension
+bool hasExtension(const char* name) {
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; i++) {
+		const GLubyte* ext = glGetStringi(GL_EXTENSIONS, i);
+		if (ext && strcmp((const char*)ext, name) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Whether the driver can save and load program binaries
+bool programBinarySupported() {
+	static int supported = -1;
+	if (supported < 0) {
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		bool entryPoints = major > 4 || (major == 4 && minor >= 1) ||
+			hasExtension("GL_ARB_get_program_binary");
+		// The driver also needs at least one binary format
+		GLint numFormats = 0;
+		if (entryPoints)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		supported = numFormats > 0;
+	}
+	return supported > 0;
+}
+
+// Read a shader file, with the definitions inserted after its #version line
+std::string readShaderSource(const std::string& filename, const std::vector<std::string>& defines) {
 	// Read the file
 	std::ifstream file(filename);
 	if (!file.is_open()) {
@@ -17,32 +87,154 @@ GLuint compileShader(GLenum type, const std::string& filename) {
 	std::stringstream buffer;
 	buffer << file.rdbuf();
 	std::string bufStr = buffer.str();
-	const char* bufCStr = bufStr.c_str();
-	GLint length = (GLint)bufStr.length();
+
+	// Insert the definitions after the #version line (which must come first),
+	// then restore the line numbering for the compile log
+	if (!defines.empty()) {
+		size_t versionPos = bufStr.find("#version");
+		size_t insertPos = (versionPos == std::string::npos) ? 0 : bufStr.find('\n', versionPos);
+		insertPos = (insertPos == std::string::npos) ? bufStr.length() : insertPos + 1;
+		int nextLine = 1 + (int)std::count(bufStr.begin(), bufStr.begin() + insertPos, '\n');
+		std::stringstream header;
+		for (auto& define : defines)
+			header << "#define " << define << "\n";
+		header << "#line " << nextLine << "\n";
+		bufStr.insert(insertPos, header.str());
+	}
+	return bufStr;
+}
+
+// Start compiling a shader stage from source, without waiting for the result
+GLuint submitShader(GLenum type, const std::string& source) {
+	const char* bufCStr = source.c_str();
+	GLint length = (GLint)source.length();
 
 	// Compile the shader
 	GLuint shader = glCreateShader(type);
 	glShaderSource(shader, 1, &bufCStr, &length);
 	glCompileShader(shader);
+	return shader;
+}
 
-	// Make sure compilation succeeded
+// Error message for a shader that failed to compile (filename and defines
+// name the shader in the message)
+std::string compileError(GLuint shader, const std::string& filename,
+	const std::vector<std::string>& defines) {
+	// Compilation failed, get the info log
+	GLint logLength;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+	std::vector<GLchar> logText(std::max(logLength, 1));
+	glGetShaderInfoLog(shader, (GLsizei)logText.size(), NULL, logText.data());
+
+	// Construct an error message with the compile log
+	std::stringstream ss;
+	ss << "Error compiling " << filename;
+	for (auto& define : defines)
+		ss << " [" << define << "]";
+	ss << ":" << std::endl << std::endl;
+	ss << logText.data() << std::endl;
+	return ss.str();
+}
+
+// Error message for a program that failed to link
+std::string linkError(GLuint program) {
+	// Link failed, get the info log
+	GLint logLength;
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+	std::vector<GLchar> logText(std::max(logLength, 1));
+	glGetProgramInfoLog(program, (GLsizei)logText.size(), NULL, logText.data());
+
+	// Construct an error message with the compile log
+	std::stringstream ss;
+	ss << "Error linking shader program:" << std::endl << std::endl;
+	ss << logText.data() << std::endl;
+	return ss.str();
+}
+
+// Create a program from a saved binary; returns 0 if there is none or the
+// driver rejects it (e.g. after a driver update)
+GLuint loadProgramBinary(const std::string& path, uint64_t key) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open())
+		return 0;
+	ProgramCacheHeader h;
+	if (!in.read((char*)&h, sizeof(h)) || memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.key != key)
+		return 0;
+	// The size comes from the file, so check it before allocating: a damaged
+	// file must not ask for gigabytes
+	std::error_code ec;
+	uintmax_t fileSize = fs::file_size(path, ec);
+	if (ec || fileSize < sizeof(h) || h.size == 0 || h.size != fileSize - sizeof(h))
+		return 0;
+	std::vector<char> binary(h.size);
+	if (!in.read(binary.data(), binary.size()))
+		return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, h.format, binary.data(), (GLsizei)binary.size());
 	GLint status;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
 	if (status == GL_FALSE) {
-		// Compilation failed, get the info log
-		GLint logLength;
-		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
-		std::vector<GLchar> logText(logLength);
-		glGetShaderInfoLog(shader, logLength, NULL, logText.data());
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
 
-		// Construct an error message with the compile log
-		std::stringstream ss;
-		ss << "Error compiling " << filename << ":" << std::endl << std::endl;
-		ss << logText.data() << std::endl;
+// Save the binary of a linked program
+void saveProgramBinary(const std::string& path, uint64_t key, GLuint program) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	ProgramCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.key = key;
+	std::vector<char> binary(length);
+	GLsizei written = 0;
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &written, &format, binary.data());
+	h.format = format;
+	h.size = (uint32_t)written;
+
+	// Write to a temporary file, then move it into place so that readers
+	// never see a partially written binary
+	fs::create_directories(fs::path(path).parent_path());
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			std::stringstream ss;
+			ss << "Error writing " << tmpPath << ": failed to open file";
+			throw std::runtime_error(ss.str());
+		}
+		out.write((const char*)&h, sizeof(h));
+		out.write(binary.data(), written);
+		if (!out) {
+			std::stringstream ss;
+			ss << "Error writing " << tmpPath;
+			throw std::runtime_error(ss.str());
+		}
+	}
+	fs::rename(tmpPath, path);
+}
+
+}
+
+// Compile a single shader stage
+GLuint compileShader(GLenum type, const std::string& filename,
+	const std::vector<std::string>& defines) {
+	GLuint shader = submitShader(type, readShaderSource(filename, defines));
 
+	// Make sure compilation succeeded
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status == GL_FALSE) {
 		// Cleanup shader and throw an exception
+		std::string error = compileError(shader, filename, defines);
 		glDeleteShader(shader);
-		throw std::runtime_error(ss.str());
+		throw std::runtime_error(error);
 	}
 
 	return shader;
@@ -65,21 +257,176 @@ GLuint linkProgram(std::vector<GLuint>& shaders) {
 	GLint status;
 	glGetProgramiv(program, GL_LINK_STATUS, &status);
 	if (status == GL_FALSE) {
-		// Link failed, get the info log
-		GLint logLength;
-		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
-		std::vector<GLchar> logText(logLength);
-		glGetProgramInfoLog(program, logLength, NULL, logText.data());
+		// Cleanup program and throw an exception
+		std::string error = linkError(program);
+		glDeleteProgram(program);
+		throw std::runtime_error(error);
+	}
 
-		// Construct an error message with the compile log
-		std::stringstream ss;
-		ss << "Error linking shader program:" << std::endl << std::endl;
-		ss << logText.data() << std::endl;
+	return program;
+}
 
-		// Cleanup program and throw an exception
+// Build a program, from the binary cache if possible
+GLuint buildProgram(const std::vector<ShaderStage>& stages,
+	const std::vector<std::string>& defines, const std::string& cacheDir) {
+	ProgramBatch batch;
+	size_t id = batch.add(stages, defines, cacheDir);
+	batch.submit();
+	return batch.take(id);
+}
+
+// Delete the programs that were never taken
+ProgramBatch::~ProgramBatch() {
+	for (auto& job : jobs) {
+		for (auto s : job.shaders)
+			glDeleteShader(s);
+		if (job.program)
+			glDeleteProgram(job.program);
+	}
+}
+
+// Queue a program
+size_t ProgramBatch::add(const std::vector<ShaderStage>& stages,
+	const std::vector<std::string>& defines, const std::string& cacheDir) {
+	Job job;
+	job.stages = stages;
+	job.defines = defines;
+	job.key = 0;
+	job.program = 0;
+	job.loaded = false;
+
+	// Read the sources (with the definitions in them)
+	for (auto& stage : stages)
+		job.sources.push_back(readShaderSource(stage.filename, defines));
+
+	// The binary is only valid for the same sources and the same driver
+	if (!cacheDir.empty() && programBinarySupported()) {
+		job.key = hashString(glString(GL_VENDOR));
+		job.key = hashString(glString(GL_RENDERER), job.key);
+		job.key = hashString(glString(GL_VERSION), job.key);
+		for (size_t i = 0; i < stages.size(); i++)
+			job.key = hashString(std::to_string(stages[i].type) + "\n" + job.sources[i], job.key);
+		std::stringstream name;
+		name << std::hex;
+		name.width(16);
+		name.fill('0');
+		name << job.key;
+		job.cachePath = (fs::path(cacheDir) / (name.str() + ".pcache")).string();
+	}
+
+	jobs.push_back(std::move(job));
+	return jobs.size() - 1;
+}
+
+// Load the queued programs from the cache, and start building the others:
+// all stages are compiled, then all programs linked, and no status is read
+void ProgramBatch::submit() {
+	for (size_t i = submitted; i < jobs.size(); i++) {
+		Job& job = jobs[i];
+		if (!job.cachePath.empty() && (job.program = loadProgramBinary(job.cachePath, job.key)))
+			job.loaded = true;
+		else
+			for (size_t s = 0; s < job.stages.size(); s++)
+				job.shaders.push_back(submitShader(job.stages[s].type, job.sources[s]));
+	}
+	for (size_t i = submitted; i < jobs.size(); i++) {
+		Job& job = jobs[i];
+		if (job.loaded)
+			continue;
+		job.program = glCreateProgram();
+		if (!job.cachePath.empty())
+			glProgramParameteri(job.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		for (auto s : job.shaders)
+			glAttachShader(job.program, s);
+		glLinkProgram(job.program);
+	}
+	submitted = jobs.size();
+}
+
+// Whether a program is done building
+bool ProgramBatch::isReady(size_t id) const {
+	const Job& job = jobs.at(id);
+	if (!job.program)
+		return false;
+	if (job.loaded || !isParallel())
+		return true;
+	GLint done = GL_FALSE;
+	glGetProgramiv(job.program, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
+}
+
+// Take a finished program
+GLuint ProgramBatch::take(size_t id) {
+	Job& job = jobs.at(id);
+	if (!job.program)
+		throw std::runtime_error("Shader program was not submitted or was already taken");
+	GLuint program = job.program;
+	job.program = 0;
+	if (job.loaded)
+		return program;
+
+	// Make sure link succeeded (this waits for the build to finish)
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	std::string error;
+	if (status == GL_FALSE) {
+		// Report the first stage that failed to compile, or else the link log
+		for (size_t s = 0; s < job.shaders.size() && error.empty(); s++) {
+			GLint compiled;
+			glGetShaderiv(job.shaders[s], GL_COMPILE_STATUS, &compiled);
+			if (compiled == GL_FALSE)
+				error = compileError(job.shaders[s], job.stages[s].filename, job.defines);
+		}
+		if (error.empty())
+			error = linkError(program);
+	}
+
+	// Cleanup extra state
+	for (auto s : job.shaders) {
+		glDetachShader(program, s);
+		glDeleteShader(s);
+	}
+	job.shaders.clear();
+	if (!error.empty()) {
 		glDeleteProgram(program);
-		throw std::runtime_error(ss.str());
+		throw std::runtime_error(error);
 	}
 
+	// Save the result for next time
+	if (!job.cachePath.empty()) {
+		try {
+			saveProgramBinary(job.cachePath, job.key, program);
+		} catch (const std::exception& e) {
+			std::cerr << "Warning: " << e.what() << std::endl;
+		}
+	}
+	job.sources.clear();
 	return program;
 }
+
+// Whether the driver builds programs in the background
+bool ProgramBatch::isParallel() {
+	static int parallel = -1;
+	if (parallel < 0)
+		parallel = hasExtension("GL_KHR_parallel_shader_compile") ||
+			hasExtension("GL_ARB_parallel_shader_compile");
+	return parallel > 0;
+}
+
+// Peak resident set of the process
+size_t getPeakResidentBytes() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+#if defined(__APPLE__)
+		return (size_t)usage.ru_maxrss;			// Bytes on macOS
+#else
+		return (size_t)usage.ru_maxrss * 1024;	// Kilobytes elsewhere
+#endif
+#endif
+	return 0;
+}
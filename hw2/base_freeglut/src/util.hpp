@@ -3,9 +3,76 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 #include "gl_core_3_3.h"
 
-GLuint compileShader(GLenum type, const std::string& filename);
+// Compile a shader stage, specialized by the given preprocessor definitions
+// ("NAME" or "NAME value"), which are inserted after the #version line
+GLuint compileShader(GLenum type, const std::string& filename,
+	const std::vector<std::string>& defines = std::vector<std::string>());
 GLuint linkProgram(std::vector<GLuint>& shaders);
 
+// A shader stage of a program and the file it's compiled from
+struct ShaderStage {
+	GLenum type;
+	std::string filename;
+};
+
+// Compile and link a program from shader files, with the given definitions
+// in every stage. The linked binary is saved under cacheDir (unless empty)
+// and loaded instead on later runs, as long as the sources, definitions and
+// driver are the same; if the driver rejects it, the program is rebuilt.
+GLuint buildProgram(const std::vector<ShaderStage>& stages,
+	const std::vector<std::string>& defines = std::vector<std::string>(),
+	const std::string& cacheDir = "shaders/cache");
+
+// Builds many programs at once. Every program's stages are compiled and
+// linked before any status is read, so the driver never waits for one
+// program before starting the next, and with KHR_parallel_shader_compile
+// it builds them on its own threads while the caller keeps drawing.
+class ProgramBatch {
+public:
+	ProgramBatch() : submitted(0) {}
+	~ProgramBatch();
+	// Disallow copy, move, & assignment
+	ProgramBatch(const ProgramBatch& other) = delete;
+	ProgramBatch& operator=(const ProgramBatch& other) = delete;
+	ProgramBatch(ProgramBatch&& other) = delete;
+	ProgramBatch& operator=(ProgramBatch&& other) = delete;
+
+	// Queue a program (as in buildProgram); returns its id in the batch
+	size_t add(const std::vector<ShaderStage>& stages,
+		const std::vector<std::string>& defines = std::vector<std::string>(),
+		const std::string& cacheDir = "shaders/cache");
+	// Load or start building every program queued since the last submit
+	void submit();
+	// Whether a submitted program is done building. Never waits if the
+	// driver builds in parallel; otherwise programs count as done once
+	// submitted, and take() waits for them.
+	bool isReady(size_t id) const;
+	// Take a submitted program, waiting for it if needed; throws if it
+	// failed to build. The caller owns the program from then on.
+	GLuint take(size_t id);
+
+	// Whether the driver builds programs in the background
+	static bool isParallel();
+
+protected:
+	struct Job {
+		std::vector<ShaderStage> stages;
+		std::vector<std::string> defines;
+		std::vector<std::string> sources;	// Stage sources with the definitions
+		std::string cachePath;			// Binary cache file (empty if not cached)
+		uint64_t key;					// Hash of the sources and the driver
+		std::vector<GLuint> shaders;	// Compiled stages (until taken)
+		GLuint program;					// Program (0 until submitted or once taken)
+		bool loaded;					// Whether the program came from the cache
+	};
+	std::vector<Job> jobs;
+	size_t submitted;	// Jobs before this one have been submitted
+};
+
+// Most memory the process has had resident at once (0 if unknown)
+size_t getPeakResidentBytes();
+
 #endif